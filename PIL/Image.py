@@ -141,9 +141,11 @@ CUBIC = BICUBIC = 3
 # dithers
 NONE = 0
 NEAREST = 0
-ORDERED = 1 # Not yet implemented
+ORDERED = 1 # 8x8 Bayer matrix
 RASTERIZE = 2 # Not yet implemented
 FLOYDSTEINBERG = 3 # default
+BAYER4 = 4
+BLUENOISE = 5
 
 # palettes/quantizers
 WEB = 0
@@ -653,8 +655,10 @@ class Image:
     #    should be 4- or 16-tuple containing floating point values.
     # @param options Additional options, given as keyword arguments.
     # @keyparam dither Dithering method, used when converting from
-    #    mode "RGB" to "P".
-    #    Available methods are NONE or FLOYDSTEINBERG (default).
+    #    mode "RGB" to "P", or from "RGB" or "L" to "1".
+    #    Available methods are NONE, FLOYDSTEINBERG (default), and
+    #    the ordered dithers ORDERED (8x8 Bayer matrix), BAYER4 (4x4
+    #    Bayer matrix), and BLUENOISE.
     # @keyparam palette Palette to use when converting from mode "RGB"
     #    to "P".  Available palettes are WEB or ADAPTIVE.
     # @keyparam colors Number of colors to use for the ADAPTIVE palette.
@@ -725,7 +729,7 @@ class Image:
                 raise ValueError(
                     "only RGB or L mode images can be quantized to a palette"
                     )
-            im = self.im.convert("P", 1, palette.im)
+            im = self.im.convert("P", FLOYDSTEINBERG, palette.im)
             return self._makeself(im)
 
         im = self.im.quantize(colors, method, kmeans)
@@ -809,7 +813,7 @@ class Image:
         if not hasattr(filter, "filter"):
             raise TypeError("filter argument should be ImageFilter.Filter instance or class")
 
-        if self.im.bands == 1:
+        if self.im.bands == 1 or getattr(filter, "multiband", 0):
             return self._new(filter.filter(self.im))
         # fix to handle multiband images since _imaging doesn't
         ims = []
@@ -1857,6 +1861,58 @@ def frombuffer(mode, size, data, decoder_name="raw", *args):
 
     return fromstring(mode, size, data, decoder_name, args)
 
+##
+# (New in 1.1.8) Maps a raw image file into memory.  The file holds
+# the lines back to back, in the internal format for the given mode
+# ("L", "P", "I", "F", "RGBA", "RGBX", "CMYK", etc; "RGB" is stored
+# as "RGBX").  Unless readonly is set, the file is created or
+# extended as needed, and changes to the image go straight to the
+# file.
+#
+# @param filename Name of the raw image file.
+# @param mode The image mode.
+# @param size The image size.
+# @param readonly If true, the file is mapped read-only, and the
+#     image is copied before it's modified.
+# @return An Image object.
+# @since 1.1.8
+
+def mapfile(filename, mode, size, readonly=0):
+    "Map raw image file"
+
+    im = new(mode, (1,1))
+    im = im._new(core.map_file(filename, mode, size, readonly))
+    im.readonly = readonly
+    return im
+
+##
+# (New in 1.1.8) Creates an image memory that uses the pixels in an
+# object supporting the new buffer interface (such as a bytearray or a
+# NumPy array), without copying them.  The buffer must hold the pixels
+# in the internal format for the given mode (see {@link mapfile}).
+# Unless readonly is set, changes to the image are visible in the
+# buffer, and vice versa.
+# <p>
+# To access the pixels of an image without copying them, use
+# <b>memoryview(im.im)</b> or <b>numpy.asarray(im.im)</b>.
+#
+# @param obj Buffer object.
+# @param mode The image mode.
+# @param size The image size.
+# @param stride Distance between lines, in bytes.  The default is to
+#     use the line size for the given mode.
+# @param readonly If true, the image is copied before it's modified.
+# @return An Image object.
+# @since 1.1.8
+
+def wrapbuffer(obj, mode, size, stride=0, readonly=0):
+    "Wrap image around buffer object"
+
+    im = new(mode, (1,1))
+    im = im._new(core.wrap_buffer(obj, mode, size, stride, readonly))
+    im.readonly = readonly
+    return im
+
 
 ##
 # (New in 1.1.6) Creates an image memory from an object exporting
@@ -188,6 +188,8 @@ class ImageCmsTransform(Image.ImagePointHandler):
         im.load()
         if imOut is None:
             imOut = Image.new(self.output_mode, im.size, None)
+        else:
+            imOut.im.detach()
         result = self.transform.apply(im.im.id, imOut.im.id)
         return imOut
 
@@ -195,6 +197,7 @@ class ImageCmsTransform(Image.ImagePointHandler):
         im.load()
         if im.mode != self.output_mode:
             raise ValueError("mode mismatch") # wrong output mode
+        im.im.detach()
         result = self.transform.apply(im.im.id, im.im.id)
         return im
 
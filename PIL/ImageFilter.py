@@ -24,15 +24,17 @@ class Filter:
 class Kernel(Filter):
 
     ##
-    # Create a convolution kernel.  The current version only
-    # supports 3x3 and 5x5 integer and floating point kernels.
+    # Create a convolution kernel.  Kernels can have any odd size,
+    # and use integer or floating point weights.  Kernels that are
+    # the product of a row and a column vector are applied in two
+    # passes.
     # <p>
-    # In the current version, kernels can only be applied to
-    # "L" and "RGB" images.
+    # Kernels can be applied to all images except "1", "P", and
+    # the 16-bit modes.  All bands are filtered in one go.
     #
     # @def __init__(size, kernel, **options)
-    # @param size Kernel size, given as (width, height).  In
-    #    the current version, this must be (3,3) or (5,5).
+    # @param size Kernel size, given as (width, height).  Both
+    #    must be odd.
     # @param kernel A sequence containing kernel weights.
     # @param **options Optional keyword arguments.
     # @keyparam scale Scale factor.  If given, the result for each
@@ -49,6 +51,9 @@ class Kernel(Filter):
             raise ValueError("not enough coefficients in kernel")
         self.filterargs = size, scale, offset, kernel
 
+    # the core filter handles all bands at once
+    multiband = 1
+
     def filter(self, image):
         if image.mode == "P":
             raise ValueError("cannot filter palette images")
@@ -77,6 +82,9 @@ class RankFilter(Filter):
         self.size = size
         self.rank = rank
 
+    # the core filter handles all bands of 8-bit images at once
+    multiband = 1
+
     def filter(self, image):
         if image.mode == "P":
             raise ValueError("cannot filter palette images")
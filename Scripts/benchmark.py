@@ -0,0 +1,95 @@
+#! /usr/local/bin/python
+#
+# The Python Imaging Library.
+# $Id$
+#
+# time some of the core resampling operations
+#
+# Usage: benchmark.py [-n count] [-t threads] [imagefile]
+#
+# Each operation is timed for each mode, first with the portable
+# code only, and then with whatever vectorized code the processor
+# supports.
+#
+
+import getopt, sys, time
+
+from PIL import Image
+
+def timeit(func, count):
+    best = None
+    for i in range(count):
+        t0 = time.time()
+        func()
+        t = time.time() - t0
+        if best is None or t < best:
+            best = t
+    return best
+
+def run(im, count):
+
+    tests = [
+        ("resize/4 ANTIALIAS", lambda im: im.resize(
+            (im.size[0]/4, im.size[1]/4), Image.ANTIALIAS)),
+        ("resize*1.5 ANTIALIAS", lambda im: im.resize(
+            (im.size[0]*3/2, im.size[1]*3/2), Image.ANTIALIAS)),
+        ("resize*1.5 BILINEAR", lambda im: im.resize(
+            (im.size[0]*3/2, im.size[1]*3/2), Image.BILINEAR)),
+        ("resize*1.5 BICUBIC", lambda im: im.resize(
+            (im.size[0]*3/2, im.size[1]*3/2), Image.BICUBIC)),
+        ("rotate BICUBIC", lambda im: im.rotate(30, Image.BICUBIC)),
+        ]
+
+    features = Image.core.getcpufeatures()
+
+    print "%-24s %-5s %9s %9s %7s" % (
+        "operation", "mode", "portable", "vector", "speedup"
+        )
+
+    for name, test in tests:
+        for mode in ("L", "LA", "RGB", "RGBA", "CMYK"):
+            if mode == "LA":
+                i = im.convert("L").convert("LA")
+            else:
+                i = im.convert(mode)
+            Image.core.setcpufeatures(0)
+            t0 = timeit(lambda: test(i), count)
+            Image.core.setcpufeatures(-1)
+            t1 = timeit(lambda: test(i), count)
+            print "%-24s %-5s %8.3fs %8.3fs %6.2fx" % (
+                name, mode, t0, t1, t0 / max(t1, 1e-6)
+                )
+
+    print
+    print "cpu features: %d, threads: %d" % (
+        features, Image.core.getthreads()
+        )
+
+try:
+    opt, argv = getopt.getopt(sys.argv[1:], "n:t:")
+except getopt.error, v:
+    print v
+    sys.exit(1)
+
+count = 3
+
+for o, a in opt:
+    if o == "-n":
+        count = int(a)
+    elif o == "-t":
+        Image.core.setthreads(int(a))
+
+if argv:
+    im = Image.open(argv[0])
+else:
+    im = Image.new("RGB", (256, 256))
+    im.putdata([(x, y, x ^ y) for y in range(256) for x in range(256)])
+
+# make sure we have something reasonably large to work on
+while im.size[0] * im.size[1] < 2000000:
+    im = im.resize((im.size[0]*2, im.size[1]*2), Image.BILINEAR)
+
+print "image size:", im.size
+print
+
+run(im, count)
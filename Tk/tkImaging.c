@@ -136,7 +136,7 @@ PyImagingPhotoPut(ClientData clientdata, Tcl_Interp* interp,
 
     block.width = im->xsize;
     block.height = im->ysize;
-    block.pitch = im->linesize;
+    block.pitch = im->stride;
     block.pixelPtr = (unsigned char*) im->block;
 #if 0
     block.pixelPtr = (unsigned char*) im->block +
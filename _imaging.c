@@ -124,6 +124,11 @@ typedef struct {
     PyObject_HEAD
     Imaging image;
     ImagingAccess access;
+#if PY_VERSION_HEX >= 0x02060000
+    /* buffer layout; the same for all exports of this image */
+    Py_ssize_t shape[3];
+    Py_ssize_t strides[3];
+#endif
 } ImagingObject;
 
 staticforward PyTypeObject Imaging_Type;
@@ -193,6 +198,24 @@ PyImagingNew(Imaging imOut)
     return (PyObject*) imagep;
 }
 
+static PyObject*
+PyImagingResult(ImagingObject* outp, Imaging imOut)
+{
+    /* result of an operation with an optional output image; returns
+       the output image object, or a new image object */
+
+    if (!outp)
+        return PyImagingNew(imOut);
+
+    if (!imOut)
+        return NULL;
+
+    Py_INCREF(outp);
+    return (PyObject*) outp;
+}
+
+#define	OUTPUT(outp) ((outp) ? (outp)->image : NULL)
+
 static void
 _dealloc(ImagingObject* imagep)
 {
@@ -652,6 +675,30 @@ _new_block(PyObject* self, PyObject* args)
     return PyImagingNew(ImagingNewBlock(mode, xsize, ysize));
 }
 
+static PyObject* 
+_advise(ImagingObject* self, PyObject* args)
+{
+    int advice;
+
+    if (!PyArg_ParseTuple(args, "i:advise", &advice))
+	return NULL;
+
+    /* returns true if the hint was passed on to the system */
+    return PyInt_FromLong(ImagingMapAdvise(self->image, advice));
+}
+
+static PyObject* 
+_new_virtual(PyObject* self, PyObject* args)
+{
+    char* mode;
+    int xsize, ysize;
+
+    if (!PyArg_ParseTuple(args, "s(ii)", &mode, &xsize, &ysize))
+	return NULL;
+
+    return PyImagingNew(ImagingNewVirtual(mode, xsize, ysize));
+}
+
 static PyObject* 
 _getcount(PyObject* self, PyObject* args)
 {
@@ -661,6 +708,228 @@ _getcount(PyObject* self, PyObject* args)
     return PyInt_FromLong(ImagingNewCount);
 }
 
+static PyObject* 
+_getthreads(PyObject* self, PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":getthreads"))
+	return NULL;
+
+    return PyInt_FromLong(ImagingGetThreads());
+}
+
+static PyObject* 
+_setthreads(PyObject* self, PyObject* args)
+{
+    int threads;
+
+    if (!PyArg_ParseTuple(args, "i:setthreads", &threads))
+	return NULL;
+
+    /* returns the old value */
+    return PyInt_FromLong(ImagingSetThreads(threads));
+}
+
+static PyObject* 
+_getcpufeatures(PyObject* self, PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":getcpufeatures"))
+	return NULL;
+
+    return PyInt_FromLong(ImagingCpuFeatures());
+}
+
+static PyObject* 
+_setcpufeatures(PyObject* self, PyObject* args)
+{
+    int mask;
+
+    if (!PyArg_ParseTuple(args, "i:setcpufeatures", &mask))
+	return NULL;
+
+    /* returns the old mask; mainly for testing and benchmarking */
+    return PyInt_FromLong(ImagingSetCpuFeatures(mask));
+}
+
+static PyObject* 
+_getvirtualthreshold(PyObject* self, PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":getvirtualthreshold"))
+	return NULL;
+
+    return PyInt_FromLong(ImagingGetVirtualThreshold());
+}
+
+static PyObject* 
+_setvirtualthreshold(PyObject* self, PyObject* args)
+{
+    long bytes;
+
+    if (!PyArg_ParseTuple(args, "l:setvirtualthreshold", &bytes))
+	return NULL;
+
+    /* returns the old value; 0 disables virtual storage */
+    return PyInt_FromLong(ImagingSetVirtualThreshold(bytes));
+}
+
+static PyObject* 
+_getpoolstats(PyObject* self, PyObject* args)
+{
+    struct ImagingPoolStats stats;
+
+    if (!PyArg_ParseTuple(args, ":getpoolstats"))
+	return NULL;
+
+    ImagingPoolGetStats(&stats);
+
+    return Py_BuildValue(
+        "{s:l,s:l,s:l,s:l,s:l,s:l}",
+        "hits", stats.hits, "misses", stats.misses,
+        "retained_blocks", stats.retained_blocks,
+        "retained_bytes", stats.retained_bytes,
+        "max_bytes", stats.max_bytes, "max_block", stats.max_block
+        );
+}
+
+static PyObject* 
+_setpoollimits(PyObject* self, PyObject* args)
+{
+    long max_bytes, max_block = -1;
+
+    if (!PyArg_ParseTuple(args, "l|l:setpoollimits", &max_bytes, &max_block))
+	return NULL;
+
+    /* negative values leave the limit unchanged */
+    ImagingPoolSetLimits(max_bytes, max_block);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* 
+_clearpool(PyObject* self, PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":clearpool"))
+	return NULL;
+
+    ImagingPoolClear();
+    ImagingPaletteIndexClear(); /* retained palette indexes go too */
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* 
+_settrace(PyObject* self, PyObject* args)
+{
+    int enabled;
+
+    if (!PyArg_ParseTuple(args, "i:settrace", &enabled))
+	return NULL;
+
+    /* returns the old setting */
+    return PyInt_FromLong(ImagingSetTrace(enabled));
+}
+
+static PyObject* 
+_gettrace(PyObject* self, PyObject* args)
+{
+    /* get (and forget) the records collected so far, as a list of
+       (op, thread, start, time, pixels, bytes) tuples */
+
+    ImagingTraceRecord records[256];
+    PyObject* list;
+    PyObject* item;
+    int i, n;
+
+    if (!PyArg_ParseTuple(args, ":gettrace"))
+	return NULL;
+
+    list = PyList_New(0);
+    if (!list)
+        return NULL;
+
+    do {
+        n = ImagingTraceCollect(records, 256);
+        for (i = 0; i < n; i++) {
+            item = Py_BuildValue(
+                "siddll", records[i].op, records[i].thread,
+                records[i].start, records[i].time,
+                records[i].pixels, records[i].bytes
+                );
+            if (!item || PyList_Append(list, item) < 0) {
+                Py_XDECREF(item);
+                Py_DECREF(list);
+                return NULL;
+            }
+            Py_DECREF(item);
+        }
+    } while (n == 256);
+
+    return list;
+}
+
+static PyObject* 
+_getmemorystats(PyObject* self, PyObject* args)
+{
+    struct ImagingMemoryStats stats;
+    PyObject* sizes;
+    int i;
+
+    if (!PyArg_ParseTuple(args, ":getmemorystats"))
+	return NULL;
+
+    ImagingMemoryGetStats(&stats);
+
+    /* allocation size histogram, without the empty tail */
+    for (i = IMAGING_SIZE_BUCKETS; i > 0; i--)
+        if (stats.sizes[i-1])
+            break;
+    sizes = PyList_New(i);
+    if (!sizes)
+        return NULL;
+    while (--i >= 0)
+        PyList_SET_ITEM(sizes, i, PyInt_FromLong(stats.sizes[i]));
+
+    return Py_BuildValue(
+        "{s:l,s:l,s:l,s:l,s:l,s:l,s:l,s:l,s:l,s:l,s:N}",
+        "live_bytes", stats.live_bytes, "peak_bytes", stats.peak_bytes,
+        "block_bytes", stats.bytes[IMAGING_STORAGE_BLOCK],
+        "array_bytes", stats.bytes[IMAGING_STORAGE_ARRAY],
+        "map_bytes", stats.bytes[IMAGING_STORAGE_MAP],
+        "block_images", stats.images[IMAGING_STORAGE_BLOCK],
+        "array_images", stats.images[IMAGING_STORAGE_ARRAY],
+        "map_images", stats.images[IMAGING_STORAGE_MAP],
+        "budget", stats.budget, "refused", stats.refused,
+        "sizes", sizes
+        );
+}
+
+static PyObject* 
+_resetmemorypeak(PyObject* self, PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":resetmemorypeak"))
+	return NULL;
+
+    ImagingMemoryResetPeak();
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* 
+_setmemorybudget(PyObject* self, PyObject* args)
+{
+    long bytes;
+
+    if (!PyArg_ParseTuple(args, "l:setmemorybudget", &bytes))
+	return NULL;
+
+    /* zero means no budget.  returns the old budget.  only heap
+       storage (blocks and arrays) is budgeted; mapped images, and
+       thus images above the virtual threshold, are never refused */
+    return PyInt_FromLong(ImagingMemorySetBudget(bytes));
+}
+
 static PyObject* 
 _linear_gradient(PyObject* self, PyObject* args)
 {
@@ -699,17 +968,20 @@ _blend(ImagingObject* self, PyObject* args)
 {
     ImagingObject* imagep1;
     ImagingObject* imagep2;
+    ImagingObject* outp = NULL;
     double alpha;
     
     alpha = 0.5;
-    if (!PyArg_ParseTuple(args, "O!O!|d",
+    if (!PyArg_ParseTuple(args, "O!O!|dO!",
 			  &Imaging_Type, &imagep1,
 			  &Imaging_Type, &imagep2,
-			  &alpha))
+			  &alpha, &Imaging_Type, &outp))
 	return NULL;
 
-    return PyImagingNew(ImagingBlend(imagep1->image, imagep2->image,
-				     (float) alpha));
+    return PyImagingResult(
+        outp, ImagingBlend2(OUTPUT(outp), imagep1->image, imagep2->image,
+                            (float) alpha)
+        );
 }
 
 /* -------------------------------------------------------------------- */
@@ -831,8 +1103,10 @@ _filter(ImagingObject* self, PyObject* args)
     int xsize, ysize;
     float divisor, offset;
     PyObject* kernel = NULL;
-    if (!PyArg_ParseTuple(args, "(ii)ffO", &xsize, &ysize,
-                         &divisor, &offset, &kernel))
+    ImagingObject* outp = NULL;
+    if (!PyArg_ParseTuple(args, "(ii)ffO|O!", &xsize, &ysize,
+                          &divisor, &offset, &kernel,
+                          &Imaging_Type, &outp))
         return NULL;
     
     /* get user-defined kernel */
@@ -844,8 +1118,9 @@ _filter(ImagingObject* self, PyObject* args)
         return ImagingError_ValueError("bad kernel size");
     }
 
-    imOut = PyImagingNew(
-        ImagingFilter(self->image, xsize, ysize, kerneldata, offset, divisor)
+    imOut = PyImagingResult(
+        outp, ImagingFilter2(OUTPUT(outp), self->image, xsize, ysize,
+                             kerneldata, offset, divisor)
         );
 
     free(kerneldata);
@@ -869,8 +1144,10 @@ _gaussian_blur(ImagingObject* self, PyObject* args)
     if (!imOut)
         return NULL;
 
-    if (!ImagingGaussianBlur(imIn, imOut, radius))
+    if (!ImagingGaussianBlur(imIn, imOut, radius)) {
+        ImagingDelete(imOut);
         return NULL;
+    }
 
     return PyImagingNew(imOut);
 }
@@ -1066,10 +1343,14 @@ static PyObject*
 _offset(ImagingObject* self, PyObject* args)
 {
     int xoffset, yoffset;
-    if (!PyArg_ParseTuple(args, "ii", &xoffset, &yoffset))
+    ImagingObject* outp = NULL;
+    if (!PyArg_ParseTuple(args, "ii|O!", &xoffset, &yoffset,
+                          &Imaging_Type, &outp))
 	return NULL;
 
-    return PyImagingNew(ImagingOffset(self->image, xoffset, yoffset));
+    return PyImagingResult(
+        outp, ImagingOffset2(OUTPUT(outp), self->image, xoffset, yoffset)
+        );
 }
 
 static PyObject* 
@@ -1111,6 +1392,14 @@ _paste(ImagingObject* self, PyObject* args)
     return Py_None;
 }
 
+static Imaging
+point(ImagingObject* outp, Imaging im, const char* mode, void* table)
+{
+    if (outp)
+        return ImagingPoint2(outp->image, im, table);
+    return ImagingPoint(im, mode, table);
+}
+
 static PyObject*
 _point(ImagingObject* self, PyObject* args)
 {
@@ -1122,9 +1411,16 @@ _point(ImagingObject* self, PyObject* args)
 
     PyObject* list;
     char* mode;
-    if (!PyArg_ParseTuple(args, "Oz", &list, &mode))
+    ImagingObject* outp = NULL;
+    if (!PyArg_ParseTuple(args, "Oz|O!", &list, &mode,
+                          &Imaging_Type, &outp))
 	return NULL;
 
+    /* the table layout depends on the output mode */
+    if (outp && strcmp(mode ? mode : self->image->mode,
+                       outp->image->mode) != 0)
+        return ImagingError_Mismatch();
+
     if (mode && !strcmp(mode, "F")) {
         FLOAT32* data;
 
@@ -1133,7 +1429,7 @@ _point(ImagingObject* self, PyObject* args)
         data = getlist(list, &n, wrong_number, TYPE_FLOAT32);
         if (!data)
             return NULL;
-        im = ImagingPoint(self->image, mode, (void*) data);
+        im = point(outp, self->image, mode, (void*) data);
         free(data);
 
     } else if (!strcmp(self->image->mode, "I") && mode && !strcmp(mode, "L")) {
@@ -1145,7 +1441,7 @@ _point(ImagingObject* self, PyObject* args)
         data = getlist(list, &n, wrong_number, TYPE_UINT8);
         if (!data)
             return NULL;
-        im = ImagingPoint(self->image, mode, (void*) data);
+        im = point(outp, self->image, mode, (void*) data);
         free(data);
 
     } else {
@@ -1166,7 +1462,7 @@ _point(ImagingObject* self, PyObject* args)
             return NULL;
 
         if (mode && !strcmp(mode, "I"))
-            im = ImagingPoint(self->image, mode, (void*) data);
+            im = point(outp, self->image, mode, (void*) data);
         else if (mode && bands > 1) {
             for (i = 0; i < 256; i++) {
                 lut[i*4] = CLIP(data[i]);
@@ -1175,17 +1471,17 @@ _point(ImagingObject* self, PyObject* args)
                 if (n > 768)
                     lut[i*4+3] = CLIP(data[i+768]);
             }
-            im = ImagingPoint(self->image, mode, (void*) lut);
+            im = point(outp, self->image, mode, (void*) lut);
         } else {
             /* map individual bands */
             for (i = 0; i < n; i++)
                 lut[i] = CLIP(data[i]);
-            im = ImagingPoint(self->image, mode, (void*) lut);
+            im = point(outp, self->image, mode, (void*) lut);
         }
         free(data);
     }
 
-    return PyImagingNew(im);
+    return PyImagingResult(outp, im);
 }
 
 static PyObject*
@@ -1193,10 +1489,14 @@ _point_transform(ImagingObject* self, PyObject* args)
 {
     double scale = 1.0;
     double offset = 0.0;
-    if (!PyArg_ParseTuple(args, "|dd", &scale, &offset))
+    ImagingObject* outp = NULL;
+    if (!PyArg_ParseTuple(args, "|ddO!", &scale, &offset,
+                          &Imaging_Type, &outp))
 	return NULL;
 
-    return PyImagingNew(ImagingPointTransform(self->image, scale, offset));
+    return PyImagingResult(
+        outp, ImagingPointTransform2(OUTPUT(outp), self->image, scale, offset)
+        );
 }
 
 static PyObject*
@@ -1224,6 +1524,9 @@ _putdata(ImagingObject* self, PyObject* args)
 	return NULL;
     }
 
+    if (ImagingDetach(image) < 0)
+	return NULL;
+
     if (image->image8) {
         if (PyString_Check(data)) {
             unsigned char* p;
@@ -1382,6 +1685,7 @@ _putpalette(ImagingObject* self, PyObject* args)
     ImagingPaletteDelete(self->image->palette);
 
     strcpy(self->image->mode, "P");
+    self->image->modeid = IMAGING_MODE_P;
 
     self->image->palette = ImagingPaletteNew("RGB");
 
@@ -1437,6 +1741,9 @@ _putpixel(ImagingObject* self, PyObject* args)
     if (!getink(color, im, ink))
         return NULL;
 
+    if (ImagingDetach(im) < 0)
+	return NULL;
+
     if (self->access)
         self->access->put_pixel(im, x, y, ink);
 
@@ -1449,10 +1756,14 @@ static PyObject*
 _rankfilter(ImagingObject* self, PyObject* args)
 {
     int size, rank;
-    if (!PyArg_ParseTuple(args, "ii", &size, &rank))
+    ImagingObject* outp = NULL;
+    if (!PyArg_ParseTuple(args, "ii|O!", &size, &rank,
+                          &Imaging_Type, &outp))
 	return NULL;
 
-    return PyImagingNew(ImagingRankFilter(self->image, size, rank));
+    return PyImagingResult(
+        outp, ImagingRankFilter2(OUTPUT(outp), self->image, size, rank)
+        );
 }
 #endif
 
@@ -1548,6 +1859,7 @@ im_setmode(ImagingObject* self, PyObject* args)
     } else if (IS_RGB(im->mode) && IS_RGB(mode)) {
         /* color to color */
         strcpy(im->mode, mode);
+        im->modeid = ImagingModeId(mode);
         im->bands = modelen;
         if (!strcmp(mode, "RGBA"))
             (void) ImagingFillBand(im, 3, 255);
@@ -1569,7 +1881,6 @@ static PyObject*
 _stretch(ImagingObject* self, PyObject* args)
 {
     Imaging imIn;
-    Imaging imTemp;
     Imaging imOut;
 
     int xsize, ysize;
@@ -1579,35 +1890,16 @@ _stretch(ImagingObject* self, PyObject* args)
 
     imIn = self->image;
 
-    /* two-pass resize: minimize size of intermediate image */
-    if (imIn->xsize * ysize < xsize * imIn->ysize)
-        imTemp = ImagingNew(imIn->mode, imIn->xsize, ysize);
-    else 
-        imTemp = ImagingNew(imIn->mode, xsize, imIn->ysize);
-    if (!imTemp)
-        return NULL;
-
-    /* first pass */
-    if (!ImagingStretch(imTemp, imIn, filter)) {
-        ImagingDelete(imTemp);
-        return NULL;
-    }
-
     imOut = ImagingNew(imIn->mode, xsize, ysize);
-    if (!imOut) {
-        ImagingDelete(imTemp);
+    if (!imOut)
         return NULL;
-    }
 
-    /* second pass */
-    if (!ImagingStretch(imOut, imTemp, filter)) {
+    /* two-pass resize, without a full-size intermediate image */
+    if (!ImagingResample(imOut, imIn, filter)) {
         ImagingDelete(imOut);
-        ImagingDelete(imTemp);
         return NULL;
     }
 
-    ImagingDelete(imTemp);
-    
     return PyImagingNew(imOut);
 }
 
@@ -1655,6 +1947,11 @@ _transform2(ImagingObject* self, PyObject* args)
     imOut = self->image;
     imIn = imagep->image;
 
+    if (ImagingDetach(imOut) < 0) {
+        free(a);
+        return NULL;
+    }
+
     /* FIXME: move transform dispatcher into libImaging */
 
     switch (method) {
@@ -1753,8 +2050,10 @@ _unsharp_mask(ImagingObject* self, PyObject* args)
     if (!imOut)
         return NULL;
 
-    if (!ImagingUnsharpMask(imIn, imOut, radius, percent, threshold))
+    if (!ImagingUnsharpMask(imIn, imOut, radius, percent, threshold)) {
+        ImagingDelete(imOut);
         return NULL;
+    }
 
     return PyImagingNew(imOut);
 }
@@ -1768,6 +2067,23 @@ _isblock(ImagingObject* self, PyObject* args)
     return PyInt_FromLong((long) self->image->block);
 }
 
+static PyObject* 
+_detach(ImagingObject* self, PyObject* args)
+{
+    /* make sure this image doesn't share its pixels with other
+       images.  extensions that modify images through the "id" or
+       "ptr" attributes should call this first. */
+
+    if (!PyArg_ParseTuple(args, ":detach"))
+	return NULL;
+
+    if (ImagingDetach(self->image) < 0)
+	return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
 static PyObject* 
 _getbbox(ImagingObject* self, PyObject* args)
 {
@@ -1922,153 +2238,204 @@ _putband(ImagingObject* self, PyObject* args)
 static PyObject* 
 _chop_invert(ImagingObject* self, PyObject* args)
 {
-    return PyImagingNew(ImagingNegative(self->image));
+    ImagingObject* outp = NULL;
+
+    if (!PyArg_ParseTuple(args, "|O!", &Imaging_Type, &outp))
+	return NULL;
+
+    return PyImagingResult(outp, ImagingNegative2(OUTPUT(outp), self->image));
 }
 
 static PyObject* 
 _chop_lighter(ImagingObject* self, PyObject* args)
 {
     ImagingObject* imagep;
+    ImagingObject* outp = NULL;
 
-    if (!PyArg_ParseTuple(args, "O!", &Imaging_Type, &imagep))
+    if (!PyArg_ParseTuple(args, "O!|O!", &Imaging_Type, &imagep,
+                          &Imaging_Type, &outp))
 	return NULL;
 
-    return PyImagingNew(ImagingChopLighter(self->image, imagep->image));
+    return PyImagingResult(
+        outp, ImagingChopLighter2(OUTPUT(outp), self->image, imagep->image)
+        );
 }
 
 static PyObject* 
 _chop_darker(ImagingObject* self, PyObject* args)
 {
     ImagingObject* imagep;
+    ImagingObject* outp = NULL;
 
-    if (!PyArg_ParseTuple(args, "O!", &Imaging_Type, &imagep))
+    if (!PyArg_ParseTuple(args, "O!|O!", &Imaging_Type, &imagep,
+                          &Imaging_Type, &outp))
 	return NULL;
 
-    return PyImagingNew(ImagingChopDarker(self->image, imagep->image));
+    return PyImagingResult(
+        outp, ImagingChopDarker2(OUTPUT(outp), self->image, imagep->image)
+        );
 }
 
 static PyObject* 
 _chop_difference(ImagingObject* self, PyObject* args)
 {
     ImagingObject* imagep;
+    ImagingObject* outp = NULL;
 
-    if (!PyArg_ParseTuple(args, "O!", &Imaging_Type, &imagep))
+    if (!PyArg_ParseTuple(args, "O!|O!", &Imaging_Type, &imagep,
+                          &Imaging_Type, &outp))
 	return NULL;
 
-    return PyImagingNew(ImagingChopDifference(self->image, imagep->image));
+    return PyImagingResult(
+        outp, ImagingChopDifference2(OUTPUT(outp), self->image, imagep->image)
+        );
 }
 
 static PyObject* 
 _chop_multiply(ImagingObject* self, PyObject* args)
 {
     ImagingObject* imagep;
+    ImagingObject* outp = NULL;
 
-    if (!PyArg_ParseTuple(args, "O!", &Imaging_Type, &imagep))
+    if (!PyArg_ParseTuple(args, "O!|O!", &Imaging_Type, &imagep,
+                          &Imaging_Type, &outp))
 	return NULL;
 
-    return PyImagingNew(ImagingChopMultiply(self->image, imagep->image));
+    return PyImagingResult(
+        outp, ImagingChopMultiply2(OUTPUT(outp), self->image, imagep->image)
+        );
 }
 
 static PyObject* 
 _chop_screen(ImagingObject* self, PyObject* args)
 {
     ImagingObject* imagep;
+    ImagingObject* outp = NULL;
 
-    if (!PyArg_ParseTuple(args, "O!", &Imaging_Type, &imagep))
+    if (!PyArg_ParseTuple(args, "O!|O!", &Imaging_Type, &imagep,
+                          &Imaging_Type, &outp))
 	return NULL;
 
-    return PyImagingNew(ImagingChopScreen(self->image, imagep->image));
+    return PyImagingResult(
+        outp, ImagingChopScreen2(OUTPUT(outp), self->image, imagep->image)
+        );
 }
 
 static PyObject* 
 _chop_add(ImagingObject* self, PyObject* args)
 {
     ImagingObject* imagep;
+    ImagingObject* outp = NULL;
     float scale;
     int offset;
 
     scale = 1.0;
     offset = 0;
 
-    if (!PyArg_ParseTuple(args, "O!|fi", &Imaging_Type, &imagep,
-			  &scale, &offset))
+    if (!PyArg_ParseTuple(args, "O!|fiO!", &Imaging_Type, &imagep,
+			  &scale, &offset, &Imaging_Type, &outp))
 	return NULL;
 
-    return PyImagingNew(ImagingChopAdd(self->image, imagep->image,
-				       scale, offset));
+    return PyImagingResult(
+        outp, ImagingChopAdd2(OUTPUT(outp), self->image, imagep->image,
+                              scale, offset)
+        );
 }
 
 static PyObject* 
 _chop_subtract(ImagingObject* self, PyObject* args)
 {
     ImagingObject* imagep;
+    ImagingObject* outp = NULL;
     float scale;
     int offset;
 
     scale = 1.0;
     offset = 0;
 
-    if (!PyArg_ParseTuple(args, "O!|fi", &Imaging_Type, &imagep,
-			  &scale, &offset))
+    if (!PyArg_ParseTuple(args, "O!|fiO!", &Imaging_Type, &imagep,
+			  &scale, &offset, &Imaging_Type, &outp))
 	return NULL;
 
-    return PyImagingNew(ImagingChopSubtract(self->image, imagep->image,
-					    scale, offset));
+    return PyImagingResult(
+        outp, ImagingChopSubtract2(OUTPUT(outp), self->image, imagep->image,
+                              scale, offset)
+        );
 }
 
 static PyObject* 
 _chop_and(ImagingObject* self, PyObject* args)
 {
     ImagingObject* imagep;
+    ImagingObject* outp = NULL;
 
-    if (!PyArg_ParseTuple(args, "O!", &Imaging_Type, &imagep))
+    if (!PyArg_ParseTuple(args, "O!|O!", &Imaging_Type, &imagep,
+                          &Imaging_Type, &outp))
 	return NULL;
 
-    return PyImagingNew(ImagingChopAnd(self->image, imagep->image));
+    return PyImagingResult(
+        outp, ImagingChopAnd2(OUTPUT(outp), self->image, imagep->image)
+        );
 }
 
 static PyObject* 
 _chop_or(ImagingObject* self, PyObject* args)
 {
     ImagingObject* imagep;
+    ImagingObject* outp = NULL;
 
-    if (!PyArg_ParseTuple(args, "O!", &Imaging_Type, &imagep))
+    if (!PyArg_ParseTuple(args, "O!|O!", &Imaging_Type, &imagep,
+                          &Imaging_Type, &outp))
 	return NULL;
 
-    return PyImagingNew(ImagingChopOr(self->image, imagep->image));
+    return PyImagingResult(
+        outp, ImagingChopOr2(OUTPUT(outp), self->image, imagep->image)
+        );
 }
 
 static PyObject* 
 _chop_xor(ImagingObject* self, PyObject* args)
 {
     ImagingObject* imagep;
+    ImagingObject* outp = NULL;
 
-    if (!PyArg_ParseTuple(args, "O!", &Imaging_Type, &imagep))
+    if (!PyArg_ParseTuple(args, "O!|O!", &Imaging_Type, &imagep,
+                          &Imaging_Type, &outp))
 	return NULL;
 
-    return PyImagingNew(ImagingChopXor(self->image, imagep->image));
+    return PyImagingResult(
+        outp, ImagingChopXor2(OUTPUT(outp), self->image, imagep->image)
+        );
 }
 
 static PyObject* 
 _chop_add_modulo(ImagingObject* self, PyObject* args)
 {
     ImagingObject* imagep;
+    ImagingObject* outp = NULL;
 
-    if (!PyArg_ParseTuple(args, "O!", &Imaging_Type, &imagep))
+    if (!PyArg_ParseTuple(args, "O!|O!", &Imaging_Type, &imagep,
+                          &Imaging_Type, &outp))
 	return NULL;
 
-    return PyImagingNew(ImagingChopAddModulo(self->image, imagep->image));
+    return PyImagingResult(
+        outp, ImagingChopAddModulo2(OUTPUT(outp), self->image, imagep->image)
+        );
 }
 
 static PyObject* 
 _chop_subtract_modulo(ImagingObject* self, PyObject* args)
 {
     ImagingObject* imagep;
+    ImagingObject* outp = NULL;
 
-    if (!PyArg_ParseTuple(args, "O!", &Imaging_Type, &imagep))
+    if (!PyArg_ParseTuple(args, "O!|O!", &Imaging_Type, &imagep,
+                          &Imaging_Type, &outp))
 	return NULL;
 
-    return PyImagingNew(ImagingChopSubtractModulo(self->image, imagep->image));
+    return PyImagingResult(
+        outp, ImagingChopSubtractModulo2(OUTPUT(outp), self->image, imagep->image)
+        );
 }
 
 #endif
@@ -2730,6 +3097,9 @@ pixel_access_setitem(PixelAccessObject *self, PyObject *xy, PyObject *color)
     if (!getink(color, im, ink))
         return -1;
 
+    if (ImagingDetach(im) < 0)
+        return -1;
+
     self->image->access->put_pixel(im, x, y, ink);
 
     return 0;
@@ -2906,6 +3276,7 @@ static struct PyMethodDef methods[] = {
     {"transform2", (PyCFunction)_transform2, 1},
 
     {"isblock", (PyCFunction)_isblock, 1},
+    {"detach", (PyCFunction)_detach, 1},
 
     {"getbbox", (PyCFunction)_getbbox, 1},
     {"getcolors", (PyCFunction)_getcolors, 1},
@@ -2953,6 +3324,8 @@ static struct PyMethodDef methods[] = {
     /* Misc. */
     {"new_array", (PyCFunction)_new_array, 1},
     {"new_block", (PyCFunction)_new_block, 1},
+    {"new_virtual", (PyCFunction)_new_virtual, 1},
+    {"advise", (PyCFunction)_advise, 1},
 
 #ifdef WITH_DEBUG
     {"save_ppm", (PyCFunction)_save_ppm, 1},
@@ -3024,6 +3397,116 @@ static PySequenceMethods image_as_sequence = {
 };
 
 
+/* buffer interface (zero-copy access to the pixels) */
+
+#if PY_VERSION_HEX >= 0x02060000
+
+static int
+image_getbuffer(ImagingObject* self, Py_buffer* view, int flags)
+{
+    Imaging im = self->image;
+    const char* format;
+    int y, itemsize, ndim;
+
+    if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE && im->readonly) {
+        PyErr_SetString(PyExc_BufferError, readonly);
+        return -1;
+    }
+
+    /* pixel layout */
+    itemsize = 1;
+    ndim = 2;
+    if (im->type == IMAGING_TYPE_INT32) {
+        format = "i";
+        itemsize = 4;
+    } else if (im->type == IMAGING_TYPE_FLOAT32) {
+        format = "f";
+        itemsize = 4;
+    } else if (!strcmp(im->mode, "I;16") || !strcmp(im->mode, "I;16L")) {
+        format = "<H";
+        itemsize = 2;
+    } else if (!strcmp(im->mode, "I;16B")) {
+        format = ">H";
+        itemsize = 2;
+    } else if (!strcmp(im->mode, "I;16N")) {
+        format = "H";
+        itemsize = 2;
+    } else if (im->type == IMAGING_TYPE_UINT8) {
+        format = "B";
+        if (im->pixelsize == 4)
+            ndim = 3; /* one byte per band */
+    } else {
+        PyErr_SetString(PyExc_BufferError, "image mode not supported");
+        return -1;
+    }
+
+    if (ImagingPin(im) < 0)
+        return -1;
+
+    /* all lines must be stride bytes apart */
+    for (y = 1; y < im->ysize; y++)
+        if (im->image[y] != im->image[0] + (size_t) y * im->stride) {
+            ImagingUnpin(im);
+            PyErr_SetString(PyExc_BufferError, "image storage not supported");
+            return -1;
+        }
+
+    /* the raster is pinned, so the stride cannot change under any
+       earlier exports.  note that the layout is not kept in the view
+       itself, since 2.X memoryviews copy views around. */
+    self->shape[0] = im->ysize;
+    self->shape[1] = im->xsize;
+    self->strides[0] = im->stride;
+    self->strides[1] = im->pixelsize;
+    if (ndim == 3) {
+        /* "LA" and "PA" keep alpha in the last byte */
+        self->shape[2] = im->bands;
+        self->strides[2] = (im->bands == 2) ? 3 : 1;
+    }
+
+    if ((flags & PyBUF_STRIDES) != PyBUF_STRIDES &&
+        (im->stride != im->xsize * im->pixelsize ||
+         (ndim == 3 && im->bands != 4))) {
+        ImagingUnpin(im);
+        PyErr_SetString(PyExc_BufferError, "image is not contiguous");
+        return -1;
+    }
+
+    view->buf = im->image[0];
+    view->obj = (PyObject*) self;
+    Py_INCREF(self);
+    view->len = (Py_ssize_t) im->xsize * im->ysize * itemsize *
+        ((ndim == 3) ? im->bands : 1);
+    view->readonly = im->readonly;
+    view->itemsize = itemsize;
+    view->format = (flags & PyBUF_FORMAT) ? (char*) format : NULL;
+    view->ndim = ndim;
+    view->shape = (flags & PyBUF_ND) ? self->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) ? self->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+
+    return 0;
+}
+
+static void
+image_releasebuffer(ImagingObject* self, Py_buffer* view)
+{
+    ImagingUnpin(self->image);
+}
+
+static PyBufferProcs image_as_buffer = {
+    (readbufferproc) NULL, /*bf_getreadbuffer*/
+    (writebufferproc) NULL, /*bf_getwritebuffer*/
+    (segcountproc) NULL, /*bf_getsegcount*/
+    (charbufferproc) NULL, /*bf_getcharbuffer*/
+    (getbufferproc) image_getbuffer, /*bf_getbuffer*/
+    (releasebufferproc) image_releasebuffer, /*bf_releasebuffer*/
+};
+
+#endif
+
+
 /* type description */
 
 statichere PyTypeObject Imaging_Type = {
@@ -3042,7 +3525,15 @@ statichere PyTypeObject Imaging_Type = {
     0,                          /*tp_as_number */
     &image_as_sequence,         /*tp_as_sequence */
     0,                          /*tp_as_mapping */
-    0                           /*tp_hash*/
+    0,                          /*tp_hash*/
+#if PY_VERSION_HEX >= 0x02060000
+    0,				/*tp_call*/
+    0,				/*tp_str*/
+    0,				/*tp_getattro*/
+    0,				/*tp_setattro*/
+    &image_as_buffer,		/*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
+#endif
 };
 
 #ifdef WITH_IMAGEDRAW
@@ -3119,6 +3610,9 @@ extern PyObject* PyImaging_TgaRleDecoderNew(PyObject* self, PyObject* args);
 extern PyObject* PyImaging_XbmDecoderNew(PyObject* self, PyObject* args);
 extern PyObject* PyImaging_ZipDecoderNew(PyObject* self, PyObject* args);
 
+/* Streaming convert and resize (in decode.c) */
+extern PyObject* PyImaging_PipelineNew(PyObject* self, PyObject* args);
+
 /* Encoders (in encode.c) */
 extern PyObject* PyImaging_EpsEncoderNew(PyObject* self, PyObject* args);
 extern PyObject* PyImaging_GifEncoderNew(PyObject* self, PyObject* args);
@@ -3148,6 +3642,10 @@ extern PyObject* PyOutline_Create(ImagingObject* self, PyObject* args);
 
 extern PyObject* PyImaging_Mapper(PyObject* self, PyObject* args);
 extern PyObject* PyImaging_MapBuffer(PyObject* self, PyObject* args);
+extern PyObject* PyImaging_MapFile(PyObject* self, PyObject* args);
+#if PY_VERSION_HEX >= 0x02060000
+extern PyObject* PyImaging_WrapBuffer(PyObject* self, PyObject* args);
+#endif
 
 static PyMethodDef functions[] = {
 
@@ -3157,6 +3655,20 @@ static PyMethodDef functions[] = {
     {"new", (PyCFunction)_new, 1},
 
     {"getcount", (PyCFunction)_getcount, 1},
+    {"getthreads", (PyCFunction)_getthreads, 1},
+    {"setthreads", (PyCFunction)_setthreads, 1},
+    {"getcpufeatures", (PyCFunction)_getcpufeatures, 1},
+    {"setcpufeatures", (PyCFunction)_setcpufeatures, 1},
+    {"getpoolstats", (PyCFunction)_getpoolstats, 1},
+    {"setpoollimits", (PyCFunction)_setpoollimits, 1},
+    {"clearpool", (PyCFunction)_clearpool, 1},
+    {"getmemorystats", (PyCFunction)_getmemorystats, 1},
+    {"resetmemorypeak", (PyCFunction)_resetmemorypeak, 1},
+    {"setmemorybudget", (PyCFunction)_setmemorybudget, 1},
+    {"settrace", (PyCFunction)_settrace, 1},
+    {"gettrace", (PyCFunction)_gettrace, 1},
+    {"getvirtualthreshold", (PyCFunction)_getvirtualthreshold, 1},
+    {"setvirtualthreshold", (PyCFunction)_setvirtualthreshold, 1},
 
     /* Functions */
     {"convert", (PyCFunction)_convert2, 1},
@@ -3190,6 +3702,7 @@ static PyMethodDef functions[] = {
     {"zip_decoder", (PyCFunction)PyImaging_ZipDecoderNew, 1},
     {"zip_encoder", (PyCFunction)PyImaging_ZipEncoderNew, 1},
 #endif
+    {"pipeline", (PyCFunction)PyImaging_PipelineNew, 1},
 
     /* Memory mapping */
 #ifdef WITH_MAPPING
@@ -3197,6 +3710,10 @@ static PyMethodDef functions[] = {
     {"map", (PyCFunction)PyImaging_Mapper, 1},
 #endif
     {"map_buffer", (PyCFunction)PyImaging_MapBuffer, 1},
+    {"map_file", (PyCFunction)PyImaging_MapFile, 1},
+#if PY_VERSION_HEX >= 0x02060000
+    {"wrap_buffer", (PyCFunction)PyImaging_WrapBuffer, 1},
+#endif
 #endif
 
     /* Display support */
@@ -3260,7 +3777,11 @@ init_imaging(void)
 #endif
     PixelAccess_Type.ob_type = &PyType_Type;
 
+    ImagingModeInit();
     ImagingAccessInit();
+    ImagingConvertInit();
+    ImagingPackInit();
+    ImagingUnpackInit();
 
     m = Py_InitModule("_imaging", functions);
     d = PyModule_GetDict(m);
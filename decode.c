@@ -55,10 +55,13 @@ typedef struct {
     struct ImagingCodecStateInstance state;
     Imaging im;
     PyObject* lock;
+    int modeid; /* unpacker mode, if lines are delivered in order */
 } ImagingDecoderObject;
 
 staticforward PyTypeObject ImagingDecoderType;
 
+static ImagingPipeline PyImaging_AsPipeline(PyObject* op);
+
 static ImagingDecoderObject*
 PyImaging_DecoderNew(int contextsize)
 {
@@ -91,6 +94,7 @@ PyImaging_DecoderNew(int contextsize)
     /* Target image */
     decoder->lock = NULL;
     decoder->im = NULL;
+    decoder->modeid = IMAGING_MODE_UNKNOWN;
 
     return decoder;
 }
@@ -104,38 +108,51 @@ _dealloc(ImagingDecoderObject* decoder)
     PyObject_Del(decoder);
 }
 
+static long
+traced_pixels(ImagingCodecState state, int y)
+{
+    /* pixels handled since the codec was at line y.  bottom-up codecs
+       jump to the last line on the first call; don't count that. */
+
+    long lines = (state->ystep < 0) ? y - state->y : state->y - y;
+
+    return (lines > 0) ? lines * state->xsize : 0;
+}
+
 static PyObject* 
 _decode(ImagingDecoderObject* decoder, PyObject* args)
 {
     UINT8* buffer;
-    int bufsize, status;
+    int bufsize, status, y;
+    ImagingTraceCookie trace;
 
     if (!PyArg_ParseTuple(args, "s#", &buffer, &bufsize))
 	return NULL;
 
+    /* the image may have been copied since the last call; make sure
+       we're not writing into a shared image */
+    if (decoder->im && ImagingDetach(decoder->im) < 0)
+	return NULL;
+
+    ImagingTraceBegin(&trace, "decode");
+    y = decoder->state.y;
+
     status = decoder->decode(decoder->im, &decoder->state, buffer, bufsize);
 
+    ImagingTraceEnd(&trace, traced_pixels(&decoder->state, y));
+
     return Py_BuildValue("ii", status, decoder->state.errcode);
 }
 
 extern Imaging PyImaging_AsImaging(PyObject *op);
 
-static PyObject*
-_setimage(ImagingDecoderObject* decoder, PyObject* args)
+static int
+setup(ImagingDecoderObject* decoder, PyObject* op, Imaging im,
+      int x0, int y0, int x1, int y1)
 {
-    PyObject* op;
-    Imaging im;
-    ImagingCodecState state;
-    int x0, y0, x1, y1;
-
-    x0 = y0 = x1 = y1 = 0;
+    /* attach decoder to target image (owned by op) */
 
-    /* FIXME: should publish the ImagingType descriptor */
-    if (!PyArg_ParseTuple(args, "O|(iiii)", &op, &x0, &y0, &x1, &y1))
-	return NULL;
-    im = PyImaging_AsImaging(op);
-    if (!im)
-	return NULL;
+    ImagingCodecState state;
 
     decoder->im = im;
 
@@ -157,7 +174,7 @@ _setimage(ImagingDecoderObject* decoder, PyObject* args)
 	state->ysize <= 0 ||
 	state->ysize + state->yoff > (int) im->ysize) {
 	PyErr_SetString(PyExc_ValueError, "tile cannot extend outside image");
-	return NULL;
+	return -1;
     }
 
     /* Allocate memory buffer (if bits field is set) */
@@ -165,8 +182,10 @@ _setimage(ImagingDecoderObject* decoder, PyObject* args)
         if (!state->bytes)
             state->bytes = (state->bits * state->xsize+7)/8;
 	state->buffer = (UINT8*) malloc(state->bytes);
-	if (!state->buffer)
-	    return PyErr_NoMemory();
+	if (!state->buffer) {
+	    (void) PyErr_NoMemory();
+	    return -1;
+	}
     }
 
     /* Keep a reference to the image object, to make sure it doesn't
@@ -175,6 +194,72 @@ _setimage(ImagingDecoderObject* decoder, PyObject* args)
     Py_XDECREF(decoder->lock);
     decoder->lock = op;
 
+    return 0;
+}
+
+static PyObject*
+_setimage(ImagingDecoderObject* decoder, PyObject* args)
+{
+    PyObject* op;
+    Imaging im;
+    int x0, y0, x1, y1;
+
+    x0 = y0 = x1 = y1 = 0;
+
+    /* FIXME: should publish the ImagingType descriptor */
+    if (!PyArg_ParseTuple(args, "O|(iiii)", &op, &x0, &y0, &x1, &y1))
+	return NULL;
+    im = PyImaging_AsImaging(op);
+    if (!im)
+	return NULL;
+
+    /* make sure we're not writing into a shared image */
+    if (ImagingDetach(im) < 0)
+	return NULL;
+
+    if (setup(decoder, op, im, x0, y0, x1, y1) < 0)
+	return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject*
+_setpipeline(ImagingDecoderObject* decoder, PyObject* args)
+{
+    PyObject* op;
+    ImagingPipeline pipeline;
+    int x0, y0, x1, y1;
+
+    x0 = y0 = x1 = y1 = 0;
+
+    if (!PyArg_ParseTuple(args, "O|(iiii)", &op, &x0, &y0, &x1, &y1))
+	return NULL;
+    pipeline = PyImaging_AsPipeline(op);
+    if (!pipeline)
+	return NULL;
+
+    if (x0 == 0 && x1 == 0) {
+	x1 = pipeline->xsize;
+	y1 = pipeline->ysize;
+    }
+
+    /* the decoder must deliver complete lines, starting at the
+       pipeline's current line */
+    if (decoder->modeid != pipeline->modeid ||
+	decoder->state.shuffle == ImagingPipelineFeed ||
+	decoder->state.ystep < 0 ||
+	x0 != 0 || x1 != pipeline->xsize || y0 != pipeline->y) {
+	PyErr_SetString(PyExc_ValueError, "cannot stream tile to pipeline");
+	return NULL;
+    }
+
+    if (setup(decoder, op, &pipeline->staging, x0, y0, x1, y1) < 0)
+	return NULL;
+
+    pipeline->unpack = decoder->state.shuffle;
+    decoder->state.shuffle = ImagingPipelineFeed;
+
     Py_INCREF(Py_None);
     return Py_None;
 }
@@ -182,6 +267,7 @@ _setimage(ImagingDecoderObject* decoder, PyObject* args)
 static struct PyMethodDef methods[] = {
     {"decode", (PyCFunction)_decode, 1},
     {"setimage", (PyCFunction)_setimage, 1},
+    {"setpipeline", (PyCFunction)_setpipeline, 1},
     {NULL, NULL} /* sentinel */
 };
 
@@ -225,11 +311,148 @@ get_unpacker(ImagingDecoderObject* decoder, const char* mode,
 
     decoder->state.shuffle = unpack;
     decoder->state.bits = bits;
+    decoder->modeid = ImagingModeId(mode);
 
     return 0;
 }
 
 
+/* -------------------------------------------------------------------- */
+/* Pipelines (streaming convert and resize)				*/
+/* -------------------------------------------------------------------- */
+
+typedef struct {
+    PyObject_HEAD
+    ImagingPipeline pipeline;
+    PyObject* image; /* destination image object */
+} ImagingPipelineObject;
+
+staticforward PyTypeObject ImagingPipelineType;
+
+extern PyObject* PyImagingNew(Imaging imOut);
+
+PyObject*
+PyImaging_PipelineNew(PyObject* self, PyObject* args)
+{
+    ImagingPipelineObject* pipeline;
+    PyObject* image;
+
+    char* mode;
+    char* outmode;
+    int xsize, ysize, xout, yout;
+    int filter = IMAGING_TRANSFORM_NEAREST;
+    if (!PyArg_ParseTuple(args, "s(ii)s(ii)|i", &mode, &xsize, &ysize,
+			  &outmode, &xout, &yout, &filter))
+	return NULL;
+
+    image = PyImagingNew(ImagingNew(outmode, xout, yout));
+    if (!image)
+	return NULL;
+
+    ImagingPipelineType.ob_type = &PyType_Type;
+
+    pipeline = PyObject_New(ImagingPipelineObject, &ImagingPipelineType);
+    if (!pipeline) {
+	Py_DECREF(image);
+	return NULL;
+    }
+
+    pipeline->image = image;
+    pipeline->pipeline = ImagingPipelineNew(
+	PyImaging_AsImaging(image), mode, xsize, ysize, filter
+	);
+    if (!pipeline->pipeline) {
+	Py_DECREF(pipeline);
+	return NULL;
+    }
+
+    return (PyObject*) pipeline;
+}
+
+static void
+_pipeline_dealloc(ImagingPipelineObject* pipeline)
+{
+    ImagingPipelineDelete(pipeline->pipeline);
+    Py_XDECREF(pipeline->image);
+    PyObject_Del(pipeline);
+}
+
+static ImagingPipeline
+PyImaging_AsPipeline(PyObject* op)
+{
+    if (op->ob_type != &ImagingPipelineType) {
+	PyErr_BadInternalCall();
+	return NULL;
+    }
+
+    return ((ImagingPipelineObject*) op)->pipeline;
+}
+
+static PyObject*
+_pipeline_push(ImagingPipelineObject* pipeline, PyObject* args)
+{
+    PyObject* op;
+    Imaging im;
+
+    if (!PyArg_ParseTuple(args, "O", &op))
+	return NULL;
+    im = PyImaging_AsImaging(op);
+    if (!im)
+	return NULL;
+
+    if (ImagingPipelinePushImage(pipeline->pipeline, im) < 0)
+	return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject*
+_pipeline_getimage(ImagingPipelineObject* pipeline, PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":getimage"))
+	return NULL;
+
+    if (pipeline->pipeline->error)
+	return PyErr_NoMemory();
+
+    /* lines that haven't been pushed yet are not initialized */
+    if (pipeline->pipeline->y < pipeline->pipeline->ysize) {
+	PyErr_SetString(PyExc_ValueError, "pipeline not complete");
+	return NULL;
+    }
+
+    Py_INCREF(pipeline->image);
+    return pipeline->image;
+}
+
+static struct PyMethodDef _pipeline_methods[] = {
+    {"push", (PyCFunction)_pipeline_push, 1},
+    {"getimage", (PyCFunction)_pipeline_getimage, 1},
+    {NULL, NULL} /* sentinel */
+};
+
+static PyObject*
+_pipeline_getattr(ImagingPipelineObject* self, char* name)
+{
+    if (strcmp(name, "lines") == 0)
+	return PyInt_FromLong(self->pipeline->y);
+    return Py_FindMethod(_pipeline_methods, (PyObject*) self, name);
+}
+
+statichere PyTypeObject ImagingPipelineType = {
+	PyObject_HEAD_INIT(NULL)
+	0,				/*ob_size*/
+	"ImagingPipeline",		/*tp_name*/
+	sizeof(ImagingPipelineObject),	/*tp_size*/
+	0,				/*tp_itemsize*/
+	/* methods */
+	(destructor)_pipeline_dealloc,	/*tp_dealloc*/
+	0,				/*tp_print*/
+	(getattrfunc)_pipeline_getattr,	/*tp_getattr*/
+};
+
+
 /* -------------------------------------------------------------------- */
 /* BIT (packed fields)          					*/
 /* -------------------------------------------------------------------- */
@@ -626,6 +849,10 @@ PyImaging_ZipDecoderNew(PyObject* self, PyObject* args)
 
     ((ZIPSTATE*)decoder->state.context)->interlaced = interlaced;
 
+    /* interlaced images are not delivered line by line */
+    if (interlaced)
+	decoder->modeid = IMAGING_MODE_UNKNOWN;
+
     return (PyObject*) decoder;
 }
 #endif
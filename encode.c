@@ -96,12 +96,24 @@ _dealloc(ImagingEncoderObject* encoder)
     PyObject_Del(encoder);
 }
 
+static long
+traced_pixels(ImagingCodecState state, int y)
+{
+    /* pixels handled since the codec was at line y.  bottom-up codecs
+       jump to the last line on the first call; don't count that. */
+
+    long lines = (state->ystep < 0) ? y - state->y : state->y - y;
+
+    return (lines > 0) ? lines * state->xsize : 0;
+}
+
 static PyObject* 
 _encode(ImagingEncoderObject* encoder, PyObject* args)
 {
     PyObject* buf;
     PyObject* result;
-    int status;
+    int status, y;
+    ImagingTraceCookie trace;
 
     /* Encode to a Python string (allocated by this method) */
 
@@ -114,9 +126,14 @@ _encode(ImagingEncoderObject* encoder, PyObject* args)
     if (!buf)
 	return NULL;
 
+    ImagingTraceBegin(&trace, "encode");
+    y = encoder->state.y;
+
     status = encoder->encode(encoder->im, &encoder->state,
 			     (UINT8*) PyString_AsString(buf), bufsize);
 
+    ImagingTraceEnd(&trace, traced_pixels(&encoder->state, y));
+
     /* adjust string length to avoid slicing in encoder */
     if (_PyString_Resize(&buf, (status > 0) ? status : 0) < 0)
         return NULL;
@@ -132,8 +149,9 @@ static PyObject*
 _encode_to_file(ImagingEncoderObject* encoder, PyObject* args)
 {
     UINT8* buf;
-    int status;
+    int status, y;
     ImagingSectionCookie cookie;
+    ImagingTraceCookie trace;
 
     /* Encode to a file handle */
 
@@ -148,6 +166,9 @@ _encode_to_file(ImagingEncoderObject* encoder, PyObject* args)
     if (!buf)
 	return PyErr_NoMemory();
 
+    ImagingTraceBegin(&trace, "encode");
+    y = encoder->state.y;
+
     ImagingSectionEnter(&cookie);
 
     do {
@@ -168,6 +189,8 @@ _encode_to_file(ImagingEncoderObject* encoder, PyObject* args)
 
     ImagingSectionLeave(&cookie);
 
+    ImagingTraceEnd(&trace, traced_pixels(&encoder->state, y));
+
     free(buf);
 
     return Py_BuildValue("i", encoder->state.errcode);
@@ -12,33 +12,14 @@
 
 #include "Imaging.h"
 
-/* use Tests/make_hash.py to calculate these values */
-#define ACCESS_TABLE_SIZE 21
-#define ACCESS_TABLE_HASH 30197
-
-static struct ImagingAccessInstance access_table[ACCESS_TABLE_SIZE];
-  
-static inline UINT32
-hash(const char* mode)
-{
-    UINT32 i = ACCESS_TABLE_HASH;
-    while (*mode)
-        i = ((i<<5) + i) ^ (UINT8) *mode++;
-    return i % ACCESS_TABLE_SIZE;
-}
+/* indexed by mode identifier */
+static struct ImagingAccessInstance access_table[IMAGING_MODES];
 
 static ImagingAccess
-add_item(const char* mode)
-{
-    UINT32 i = hash(mode);
-    /* printf("hash %s => %d\n", mode, i); */
-    if (access_table[i].mode) {
-        fprintf(stderr, "AccessInit: hash collision: %d for both %s and %s\n",
-                i, mode, access_table[i].mode);
-        exit(1);
-    }
-    access_table[i].mode = mode;
-    return &access_table[i];
+add_item(int id)
+{
+    access_table[id].mode = ImagingModeGet(id)->name;
+    return &access_table[id];
 }
 
 /* fetch pointer to pixel line */
@@ -219,31 +200,34 @@ ImagingAccessInit()
     }
 
     /* populate access table */
-    ADD("1", line_8, get_pixel_8, put_pixel_8);
-    ADD("L", line_8, get_pixel_8, put_pixel_8);
-    ADD("LA", line_32, get_pixel, put_pixel);
-    ADD("I", line_32, get_pixel_32, put_pixel_32);
-    ADD("I;16", line_16, get_pixel_16L, put_pixel_16L);
-    ADD("I;16L", line_16, get_pixel_16L, put_pixel_16L);
-    ADD("I;16B", line_16, get_pixel_16B, put_pixel_16B);
-    ADD("I;32L", line_32, get_pixel_32L, put_pixel_32L);
-    ADD("I;32B", line_32, get_pixel_32B, put_pixel_32B);
-    ADD("F", line_32, get_pixel_32, put_pixel_32);
-    ADD("P", line_8, get_pixel_8, put_pixel_8);
-    ADD("PA", line_32, get_pixel, put_pixel);
-    ADD("RGB", line_32, get_pixel_32, put_pixel_32);
-    ADD("RGBA", line_32, get_pixel_32, put_pixel_32);
-    ADD("RGBa", line_32, get_pixel_32, put_pixel_32);
-    ADD("RGBX", line_32, get_pixel_32, put_pixel_32);
-    ADD("CMYK", line_32, get_pixel_32, put_pixel_32);
-    ADD("YCbCr", line_32, get_pixel_32, put_pixel_32);
+    ADD(IMAGING_MODE_1, line_8, get_pixel_8, put_pixel_8);
+    ADD(IMAGING_MODE_L, line_8, get_pixel_8, put_pixel_8);
+    ADD(IMAGING_MODE_LA, line_32, get_pixel, put_pixel);
+    ADD(IMAGING_MODE_I, line_32, get_pixel_32, put_pixel_32);
+    ADD(IMAGING_MODE_I_16, line_16, get_pixel_16L, put_pixel_16L);
+    ADD(IMAGING_MODE_I_16L, line_16, get_pixel_16L, put_pixel_16L);
+    ADD(IMAGING_MODE_I_16B, line_16, get_pixel_16B, put_pixel_16B);
+    ADD(IMAGING_MODE_I_32L, line_32, get_pixel_32L, put_pixel_32L);
+    ADD(IMAGING_MODE_I_32B, line_32, get_pixel_32B, put_pixel_32B);
+    ADD(IMAGING_MODE_F, line_32, get_pixel_32, put_pixel_32);
+    ADD(IMAGING_MODE_P, line_8, get_pixel_8, put_pixel_8);
+    ADD(IMAGING_MODE_PA, line_32, get_pixel, put_pixel);
+    ADD(IMAGING_MODE_RGB, line_32, get_pixel_32, put_pixel_32);
+    ADD(IMAGING_MODE_RGBA, line_32, get_pixel_32, put_pixel_32);
+    ADD(IMAGING_MODE_RGBa, line_32, get_pixel_32, put_pixel_32);
+    ADD(IMAGING_MODE_RGBX, line_32, get_pixel_32, put_pixel_32);
+    ADD(IMAGING_MODE_CMYK, line_32, get_pixel_32, put_pixel_32);
+    ADD(IMAGING_MODE_YCbCr, line_32, get_pixel_32, put_pixel_32);
 }
 
 ImagingAccess
 ImagingAccessNew(Imaging im)
 {
-    ImagingAccess access = &access_table[hash(im->mode)];
-    if (im->mode[0] != access->mode[0] || strcmp(im->mode, access->mode) != 0)
+    ImagingAccess access;
+    if (im->modeid <= IMAGING_MODE_UNKNOWN || im->modeid >= IMAGING_MODES)
+        return NULL;
+    access = &access_table[im->modeid];
+    if (!access->mode)
         return NULL;
     return access;
 }
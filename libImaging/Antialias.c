@@ -17,6 +17,20 @@
 
 #include <math.h>
 
+/* vectorized versions of the fixed point loops.  SSE2 is used when
+   the compiler targets it; AVX2 is compiled in for GCC-compatible
+   compilers, and selected at run time. */
+#if defined(__SSE2__) || defined(_M_X64)
+#define USE_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || \
+     (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define USE_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
 /* resampling filters (from antialias.py) */
 
 struct filter {
@@ -80,51 +94,55 @@ static inline float bicubic_filter(float x)
 
 static struct filter BICUBIC = { bicubic_filter, 2.0 };
 
-Imaging
-ImagingStretch(Imaging imOut, Imaging imIn, int filter)
-{
-    /* FIXME: this is a quick and straightforward translation from a
-       python prototype.  might need some further C-ification... */
+/* work is split into bands of at least this many multiply-adds */
+#define STRETCH_GRAIN 262144
 
-    ImagingSectionCookie cookie;
-    struct filter *filterp;
-    float support, scale, filterscale;
-    float center, ww, ss, ymin, ymax, xmin, xmax;
-    int xx, yy, x, y, b;
+/* fixed point coefficients for 8-bit images (1.0 == 1<<PRECISION_BITS).
+   this leaves room for 8-bit samples and a filter gain of up to two
+   in a 32-bit accumulator.  16-bit coefficients aren't precise enough
+   for large reduction factors, where each tap gets a tiny weight. */
+#define PRECISION_BITS (32 - 8 - 2)
+
+/* coefficient tables.  for each output coordinate, there's a window
+   start and length in bounds, and ksize unnormalized filter weights
+   in k.  norm holds the reciprocal of the sum of the weights.  kq is
+   either NULL, or holds normalized fixed point versions of the
+   weights.  for the vectorized loops, each fixed point weight is
+   also split into 15-bit low and signed high parts (kq == kh<<15 +
+   kl), zero-padded to kstride entries. */
+
+struct coeffs {
+    int ksize;
+    int *bounds;
     float *k;
+    float *norm;
+    INT32 *kq;
+    int kstride;
+    INT16 *kl;
+    INT16 *kh;
+};
 
-    /* check modes */
-    if (!imOut || !imIn || strcmp(imIn->mode, imOut->mode) != 0)
-	return (Imaging) ImagingError_ModeError();
+static void
+free_coeffs(struct coeffs *c)
+{
+    free(c->bounds);
+    free(c->k);
+    free(c->norm);
+    free(c->kq);
+    free(c->kl);
+    free(c->kh);
+}
 
-    /* check filter */
-    switch (filter) {
-    case IMAGING_TRANSFORM_NEAREST:
-        filterp = &NEAREST;
-        break;
-    case IMAGING_TRANSFORM_ANTIALIAS:
-        filterp = &ANTIALIAS;
-        break;
-    case IMAGING_TRANSFORM_BILINEAR:
-        filterp = &BILINEAR;
-        break;
-    case IMAGING_TRANSFORM_BICUBIC:
-        filterp = &BICUBIC;
-        break;
-    default:
-        return (Imaging) ImagingError_ValueError(
-            "unsupported resampling filter"
-            );
-    }
+static int
+precompute_coeffs(struct coeffs *c, struct filter *filterp,
+                  int inSize, int outSize)
+{
+    float support, scale, filterscale;
+    float center, ww, ss, min, max;
+    float *k;
+    int xx, x;
 
-    if (imIn->ysize == imOut->ysize) {
-        /* prepare for horizontal stretch */
-        filterscale = scale = (float) imIn->xsize / imOut->xsize;
-    } else if (imIn->xsize == imOut->xsize) {
-        /* prepare for vertical stretch */
-        filterscale = scale = (float) imIn->ysize / imOut->ysize;
-    } else
-	return (Imaging) ImagingError_Mismatch();
+    filterscale = scale = (float) inSize / outSize;
 
     /* determine support size (length of resampling filter) */
     support = filterp->support;
@@ -133,175 +151,1078 @@ ImagingStretch(Imaging imOut, Imaging imIn, int filter)
         filterscale = 1.0;
         support = 0.5;
     }
-    
+
     support = support * filterscale;
 
     /* coefficient buffer (with rounding safety margin) */
-    k = malloc(((int) support * 2 + 10) * sizeof(float));
-    if (!k)
-        return (Imaging) ImagingError_MemoryError();
+    c->ksize = (int) support * 2 + 10;
+    c->bounds = malloc(outSize * 2 * sizeof(int));
+    c->k = malloc(outSize * c->ksize * sizeof(float));
+    c->norm = malloc(outSize * sizeof(float));
+    c->kq = NULL;
+    c->kl = c->kh = NULL;
+    if (!c->bounds || !c->k || !c->norm) {
+        free_coeffs(c);
+        return 0;
+    }
 
-    ImagingSectionEnter(&cookie);
-    if (imIn->xsize == imOut->xsize) {
-        /* vertical stretch */
-        for (yy = 0; yy < imOut->ysize; yy++) {
-            center = (yy + 0.5) * scale;
-            ww = 0.0;
-            ss = 1.0 / filterscale;
-            /* calculate filter weights */
-            ymin = floor(center - support);
-            if (ymin < 0.0)
-                ymin = 0.0;
-            ymax = ceil(center + support);
-            if (ymax > (float) imIn->ysize)
-		ymax = (float) imIn->ysize;
-            for (y = (int) ymin; y < (int) ymax; y++) {
-                float w = filterp->filter((y - center + 0.5) * ss) * ss;
-                k[y - (int) ymin] = w;
-                ww = ww + w;
+    for (xx = 0; xx < outSize; xx++) {
+        k = c->k + xx * c->ksize;
+        center = (xx + 0.5) * scale;
+        ww = 0.0;
+        ss = 1.0 / filterscale;
+        min = floor(center - support);
+        if (min < 0.0)
+            min = 0.0;
+        max = ceil(center + support);
+        if (max > (float) inSize)
+            max = (float) inSize;
+        for (x = (int) min; x < (int) max; x++) {
+            float w = filterp->filter((x - center + 0.5) * ss) * ss;
+            k[x - (int) min] = w;
+            ww = ww + w;
+        }
+        if (ww == 0.0)
+            ww = 1.0;
+        else
+            ww = 1.0 / ww;
+        c->bounds[xx*2+0] = (int) min;
+        c->bounds[xx*2+1] = (int) max - (int) min;
+        c->norm[xx] = ww;
+    }
+
+    return 1;
+}
+
+static void
+precompute_fixed(struct coeffs *c, int outSize)
+{
+    /* quantize the normalized weights.  if something goes wrong,
+       kq is left at NULL, and the caller uses the float tables. */
+
+    INT32 *kq;
+    float *k;
+    double v, gain;
+    int xx, x, n, q, sum, big;
+
+    kq = malloc(outSize * c->ksize * sizeof(INT32));
+    if (!kq)
+        return;
+
+    for (xx = 0; xx < outSize; xx++) {
+        k = c->k + xx * c->ksize;
+        n = c->bounds[xx*2+1];
+        sum = big = 0;
+        gain = 0.0;
+        for (x = 0; x < n; x++) {
+            v = k[x] * c->norm[xx];
+            gain += fabs(v);
+            if (gain >= 2.0) {
+                /* might overflow; use floats instead */
+                free(kq);
+                return;
             }
-            if (ww == 0.0)
-                ww = 1.0;
+            v = v * (1 << PRECISION_BITS);
+            if (v >= 0.0)
+                q = (int) (v + 0.5);
             else
-                ww = 1.0 / ww;
-            if (imIn->image8) {
-                /* 8-bit grayscale */
-                for (xx = 0; xx < imOut->xsize; xx++) {
-                    ss = 0.0;
-                    for (y = (int) ymin; y < (int) ymax; y++)
-                        ss = ss + imIn->image8[y][xx] * k[y - (int) ymin];
-                    ss = ss * ww + 0.5;
-                    if (ss < 0.5)
-                        imOut->image8[yy][xx] = 0;
-                    else if (ss >= 255.0)
-                        imOut->image8[yy][xx] = 255;
-                    else
-                        imOut->image8[yy][xx] = (UINT8) ss;
+                q = -(int) (-v + 0.5);
+            kq[xx * c->ksize + x] = q;
+            if (q > kq[xx * c->ksize + big])
+                big = x;
+            sum += q;
+        }
+        /* make sure the weights add up to one, so that flat areas
+           come out unchanged */
+        if (n > 0 && sum != 0)
+            kq[xx * c->ksize + big] += (1 << PRECISION_BITS) - sum;
+    }
+
+    c->kq = kq;
+
+#if defined(USE_SSE2)
+    if (ImagingCpuFeatures() & IMAGING_CPU_SSE2) {
+        /* split tables for the vectorized loops */
+        c->kstride = (c->ksize + 7) & -8;
+        c->kl = calloc(outSize * c->kstride, sizeof(INT16));
+        c->kh = calloc(outSize * c->kstride, sizeof(INT16));
+        if (!c->kl || !c->kh) {
+            free(c->kl);
+            free(c->kh);
+            c->kl = c->kh = NULL;
+            return;
+        }
+        for (xx = 0; xx < outSize; xx++) {
+            n = c->bounds[xx*2+1];
+            for (x = 0; x < n; x++) {
+                q = kq[xx * c->ksize + x];
+                c->kl[xx * c->kstride + x] = (INT16) (q & 0x7fff);
+                c->kh[xx * c->kstride + x] = (INT16) (q >> 15);
+            }
+        }
+    }
+#endif
+}
+
+static inline UINT8
+clipq(INT32 ss)
+{
+    /* round and clip a fixed point 8-bit sample */
+    ss = (ss + (1 << (PRECISION_BITS-1))) >> PRECISION_BITS;
+    if (ss < 0)
+        return 0;
+    else if (ss > 255)
+        return 255;
+    return (UINT8) ss;
+}
+
+static inline UINT8
+clip8(float ss)
+{
+    /* round and clip an 8-bit sample */
+    ss = ss + 0.5;
+    if (ss < 0.5)
+        return 0;
+    else if (ss >= 255.0)
+        return 255;
+    return (UINT8) ss;
+}
+
+struct stretch_context {
+    Imaging imOut;
+    Imaging imIn;
+    struct coeffs c;
+    int error;
+};
+
+static void
+stretch_vertical(void* context, int start, int end)
+{
+    /* vertical stretch, output lines start to end.  the weights are
+       applied to whole source lines, accumulating into a line buffer
+       which is then normalized into the output line. */
+
+    struct stretch_context* ctx = context;
+    Imaging imOut = ctx->imOut;
+    Imaging imIn = ctx->imIn;
+    float ww, w;
+    float *k;
+    float *line;
+    int xx, yy, y, ymin, ysize;
+    int samples;
+
+    if (imIn->image8 || imIn->type != IMAGING_TYPE_UINT8)
+        samples = imOut->xsize;
+    else
+        samples = imOut->xsize * 4;
+
+    line = malloc((samples > 0 ? samples : 1) * sizeof(float));
+    if (!line) {
+        ctx->error = 1;
+        return;
+    }
+
+    for (yy = start; yy < end; yy++) {
+        ymin = ctx->c.bounds[yy*2+0];
+        ysize = ctx->c.bounds[yy*2+1];
+        k = ctx->c.k + yy * ctx->c.ksize;
+        ww = ctx->c.norm[yy];
+        for (xx = 0; xx < samples; xx++)
+            line[xx] = 0.0;
+        if (imIn->image8) {
+            /* 8-bit grayscale */
+            for (y = 0; y < ysize; y++) {
+                UINT8* in = imIn->image8[ymin + y];
+                w = k[y];
+                for (xx = 0; xx < samples; xx++)
+                    line[xx] = line[xx] + in[xx] * w;
+            }
+            for (xx = 0; xx < samples; xx++)
+                imOut->image8[yy][xx] = clip8(line[xx] * ww);
+        } else
+            switch(imIn->type) {
+            case IMAGING_TYPE_UINT8:
+                /* n-bit grayscale */
+                for (y = 0; y < ysize; y++) {
+                    UINT8* in = (UINT8*) imIn->image[ymin + y];
+                    w = k[y];
+                    for (xx = 0; xx < samples; xx++)
+                        line[xx] = line[xx] + in[xx] * w;
                 }
-            } else
-                switch(imIn->type) {
-                case IMAGING_TYPE_UINT8:
-                    /* n-bit grayscale */
-                    for (xx = 0; xx < imOut->xsize*4; xx++) {
-                        /* FIXME: skip over unused pixels */
-                        ss = 0.0;
-                        for (y = (int) ymin; y < (int) ymax; y++)
-                            ss = ss + (UINT8) imIn->image[y][xx] * k[y-(int) ymin];
-                        ss = ss * ww + 0.5;
-                        if (ss < 0.5)
-                            imOut->image[yy][xx] = (UINT8) 0;
-                        else if (ss >= 255.0)
-                            imOut->image[yy][xx] = (UINT8) 255;
-                        else
-                            imOut->image[yy][xx] = (UINT8) ss;
-                    }
-                    break;
-                case IMAGING_TYPE_INT32:
-                    /* 32-bit integer */
-                    for (xx = 0; xx < imOut->xsize; xx++) {
-                        ss = 0.0;
-                        for (y = (int) ymin; y < (int) ymax; y++)
-                            ss = ss + IMAGING_PIXEL_I(imIn, xx, y) * k[y - (int) ymin];
-                        IMAGING_PIXEL_I(imOut, xx, yy) = (int) ss * ww;
-                    }
-                    break;
-                case IMAGING_TYPE_FLOAT32:
-                    /* 32-bit float */
-                    for (xx = 0; xx < imOut->xsize; xx++) {
-                        ss = 0.0;
-                        for (y = (int) ymin; y < (int) ymax; y++)
-                            ss = ss + IMAGING_PIXEL_F(imIn, xx, y) * k[y - (int) ymin];
-                        IMAGING_PIXEL_F(imOut, xx, yy) = ss * ww;
+                for (xx = 0; xx < samples; xx++)
+                    imOut->image[yy][xx] = (char) clip8(line[xx] * ww);
+                break;
+            case IMAGING_TYPE_INT32:
+                /* 32-bit integer */
+                for (y = 0; y < ysize; y++) {
+                    INT32* in = imIn->image32[ymin + y];
+                    w = k[y];
+                    for (xx = 0; xx < samples; xx++)
+                        line[xx] = line[xx] + in[xx] * w;
+                }
+                for (xx = 0; xx < samples; xx++)
+                    IMAGING_PIXEL_I(imOut, xx, yy) = (int) line[xx] * ww;
+                break;
+            case IMAGING_TYPE_FLOAT32:
+                /* 32-bit float */
+                for (y = 0; y < ysize; y++) {
+                    FLOAT32* in = (FLOAT32*) imIn->image32[ymin + y];
+                    w = k[y];
+                    for (xx = 0; xx < samples; xx++)
+                        line[xx] = line[xx] + in[xx] * w;
+                }
+                for (xx = 0; xx < samples; xx++)
+                    IMAGING_PIXEL_F(imOut, xx, yy) = line[xx] * ww;
+                break;
+            }
+    }
+
+    free(line);
+}
+
+static void
+stretch_horizontal(void* context, int start, int end)
+{
+    /* horizontal stretch, output lines start to end (row by row) */
+
+    struct stretch_context* ctx = context;
+    Imaging imOut = ctx->imOut;
+    Imaging imIn = ctx->imIn;
+    float ss, ss0, ss1, ss2, ss3;
+    float ww;
+    float *k;
+    int xx, yy, x, xmin, xsize;
+
+    for (yy = start; yy < end; yy++) {
+        if (imIn->image8) {
+            /* 8-bit grayscale */
+            UINT8* in = imIn->image8[yy];
+            UINT8* out = imOut->image8[yy];
+            for (xx = 0; xx < imOut->xsize; xx++) {
+                xmin = ctx->c.bounds[xx*2+0];
+                xsize = ctx->c.bounds[xx*2+1];
+                k = ctx->c.k + xx * ctx->c.ksize;
+                ww = ctx->c.norm[xx];
+                ss = 0.0;
+                for (x = 0; x < xsize; x++)
+                    ss = ss + in[xmin + x] * k[x];
+                out[xx] = clip8(ss * ww);
+            }
+        } else
+            switch(imIn->type) {
+            case IMAGING_TYPE_UINT8: {
+                /* n-bit grayscale (all four bytes of each pixel) */
+                UINT8* in = (UINT8*) imIn->image[yy];
+                UINT8* out = (UINT8*) imOut->image[yy];
+                for (xx = 0; xx < imOut->xsize; xx++) {
+                    xmin = ctx->c.bounds[xx*2+0];
+                    xsize = ctx->c.bounds[xx*2+1];
+                    k = ctx->c.k + xx * ctx->c.ksize;
+                    ww = ctx->c.norm[xx];
+                    ss0 = ss1 = ss2 = ss3 = 0.0;
+                    for (x = 0; x < xsize; x++) {
+                        UINT8* p = in + (xmin + x) * 4;
+                        ss0 = ss0 + p[0] * k[x];
+                        ss1 = ss1 + p[1] * k[x];
+                        ss2 = ss2 + p[2] * k[x];
+                        ss3 = ss3 + p[3] * k[x];
                     }
-                    break;
-                default:
-                    ImagingSectionLeave(&cookie);
-                    return (Imaging) ImagingError_ModeError();
+                    out[xx*4+0] = clip8(ss0 * ww);
+                    out[xx*4+1] = clip8(ss1 * ww);
+                    out[xx*4+2] = clip8(ss2 * ww);
+                    out[xx*4+3] = clip8(ss3 * ww);
                 }
-        }
-    } else {
-        /* horizontal stretch */
-        for (xx = 0; xx < imOut->xsize; xx++) {
-            center = (xx + 0.5) * scale;
-            ww = 0.0;
-            ss = 1.0 / filterscale;
-            xmin = floor(center - support);
-            if (xmin < 0.0)
-                xmin = 0.0;
-            xmax = ceil(center + support);
-            if (xmax > (float) imIn->xsize)
-		xmax = (float) imIn->xsize;
-            for (x = (int) xmin; x < (int) xmax; x++) {
-                float w = filterp->filter((x - center + 0.5) * ss) * ss;
-                k[x - (int) xmin] = w;
-                ww = ww + w;
+                break;
             }
-            if (ww == 0.0)
-                ww = 1.0;
-            else
-                ww = 1.0 / ww;
-            if (imIn->image8) {
-                /* 8-bit grayscale */
-                for (yy = 0; yy < imOut->ysize; yy++) {
+            case IMAGING_TYPE_INT32: {
+                /* 32-bit integer */
+                INT32* in = imIn->image32[yy];
+                for (xx = 0; xx < imOut->xsize; xx++) {
+                    xmin = ctx->c.bounds[xx*2+0];
+                    xsize = ctx->c.bounds[xx*2+1];
+                    k = ctx->c.k + xx * ctx->c.ksize;
+                    ww = ctx->c.norm[xx];
                     ss = 0.0;
-                    for (x = (int) xmin; x < (int) xmax; x++)
-                        ss = ss + imIn->image8[yy][x] * k[x - (int) xmin];
-                    ss = ss * ww + 0.5;
-                    if (ss < 0.5)
-                        imOut->image8[yy][xx] = (UINT8) 0;
-                    else if (ss >= 255.0)
-                        imOut->image8[yy][xx] = (UINT8) 255;
-                    else
-                        imOut->image8[yy][xx] = (UINT8) ss;
+                    for (x = 0; x < xsize; x++)
+                        ss = ss + in[xmin + x] * k[x];
+                    IMAGING_PIXEL_I(imOut, xx, yy) = (int) ss * ww;
                 }
-            } else
-                switch(imIn->type) {
-                case IMAGING_TYPE_UINT8:
-                    /* n-bit grayscale */
-                    for (yy = 0; yy < imOut->ysize; yy++) {
-                        for (b = 0; b < imIn->bands; b++) {
-                            if (imIn->bands == 2 && b)
-                                b = 3; /* hack to deal with LA images */
-                            ss = 0.0;
-                            for (x = (int) xmin; x < (int) xmax; x++)
-                                ss = ss + (UINT8) imIn->image[yy][x*4+b] * k[x - (int) xmin];
-                            ss = ss * ww + 0.5;
-                            if (ss < 0.5)
-                                imOut->image[yy][xx*4+b] = (UINT8) 0;
-                            else if (ss >= 255.0)
-                                imOut->image[yy][xx*4+b] = (UINT8) 255;
-                            else
-                                imOut->image[yy][xx*4+b] = (UINT8) ss;
-                        }
-                    }
-                    break;
-                case IMAGING_TYPE_INT32:
-                    /* 32-bit integer */
-                    for (yy = 0; yy < imOut->ysize; yy++) {
-                        ss = 0.0;
-                        for (x = (int) xmin; x < (int) xmax; x++)
-                            ss = ss + IMAGING_PIXEL_I(imIn, x, yy) * k[x - (int) xmin];
-                        IMAGING_PIXEL_I(imOut, xx, yy) = (int) ss * ww;
-                    }
-                    break;
-                case IMAGING_TYPE_FLOAT32:
-                    /* 32-bit float */
-                    for (yy = 0; yy < imOut->ysize; yy++) {
-                        ss = 0.0;
-                        for (x = (int) xmin; x < (int) xmax; x++)
-                            ss = ss + IMAGING_PIXEL_F(imIn, x, yy) * k[x - (int) xmin];
-                        IMAGING_PIXEL_F(imOut, xx, yy) = ss * ww;
-                    }
-                    break;
-                default:
-                    ImagingSectionLeave(&cookie);
-                    return (Imaging) ImagingError_ModeError();
+                break;
+            }
+            case IMAGING_TYPE_FLOAT32: {
+                /* 32-bit float */
+                FLOAT32* in = (FLOAT32*) imIn->image32[yy];
+                for (xx = 0; xx < imOut->xsize; xx++) {
+                    xmin = ctx->c.bounds[xx*2+0];
+                    xsize = ctx->c.bounds[xx*2+1];
+                    k = ctx->c.k + xx * ctx->c.ksize;
+                    ww = ctx->c.norm[xx];
+                    ss = 0.0;
+                    for (x = 0; x < xsize; x++)
+                        ss = ss + in[xmin + x] * k[x];
+                    IMAGING_PIXEL_F(imOut, xx, yy) = ss * ww;
+                }
+                break;
+            }
+            }
+    }
+}
+
+#if defined(USE_SSE2)
+
+/* the vectorized loops use 16-bit multiplies on split weights (see
+   struct coeffs), and combine the sums as hi<<15 + lo.  the partial
+   sums may wrap around, but the final 32-bit result is exact, so the
+   output is identical to the portable fixed point code. */
+
+static inline __m128i
+combine_sse2(__m128i lo, __m128i hi)
+{
+    /* combine partial sums, round and shift (see clipq) */
+    __m128i v = _mm_add_epi32(_mm_slli_epi32(hi, 15), lo);
+    v = _mm_add_epi32(v, _mm_set1_epi32(1 << (PRECISION_BITS-1)));
+    return _mm_srai_epi32(v, PRECISION_BITS);
+}
+
+static inline void
+vertical_sse2(UINT8* out, Imaging imIn, int xx, int ymin, int ysize,
+              INT16* kl, INT16* kh)
+{
+    /* 8 samples, starting at xx */
+
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo0 = zero, hi0 = zero, lo1 = zero, hi1 = zero;
+    __m128i a, b, cl, ch;
+    int y;
+
+    for (y = 0; y < ysize; y += 2) {
+        a = _mm_loadl_epi64((__m128i*) (imIn->image[ymin + y] + xx));
+        if (y + 1 < ysize)
+            b = _mm_loadl_epi64((__m128i*) (imIn->image[ymin + y + 1] + xx));
+        else
+            b = zero;
+        /* interleave the two lines, and widen to 16 bits */
+        a = _mm_unpacklo_epi8(a, b);
+        b = _mm_unpackhi_epi8(a, zero);
+        a = _mm_unpacklo_epi8(a, zero);
+        cl = _mm_set1_epi32(*(INT32*) (kl + y));
+        ch = _mm_set1_epi32(*(INT32*) (kh + y));
+        lo0 = _mm_add_epi32(lo0, _mm_madd_epi16(a, cl));
+        hi0 = _mm_add_epi32(hi0, _mm_madd_epi16(a, ch));
+        lo1 = _mm_add_epi32(lo1, _mm_madd_epi16(b, cl));
+        hi1 = _mm_add_epi32(hi1, _mm_madd_epi16(b, ch));
+    }
+
+    a = _mm_packs_epi32(combine_sse2(lo0, hi0), combine_sse2(lo1, hi1));
+    _mm_storel_epi64((__m128i*) (out + xx), _mm_packus_epi16(a, a));
+}
+
+#if defined(USE_AVX2)
+
+__attribute__((target("avx2")))
+static void
+vertical_avx2(UINT8* out, Imaging imIn, int xx, int ymin, int ysize,
+              INT16* kl, INT16* kh)
+{
+    /* 16 samples, starting at xx */
+
+    __m256i zero = _mm256_setzero_si256();
+    __m256i lo0 = zero, hi0 = zero, lo1 = zero, hi1 = zero;
+    __m256i a, b, cl, ch;
+    __m128i p, q;
+    __m256i half = _mm256_set1_epi32(1 << (PRECISION_BITS-1));
+    int y;
+
+    for (y = 0; y < ysize; y += 2) {
+        p = _mm_loadu_si128((__m128i*) (imIn->image[ymin + y] + xx));
+        if (y + 1 < ysize)
+            q = _mm_loadu_si128((__m128i*) (imIn->image[ymin + y + 1] + xx));
+        else
+            q = _mm_setzero_si128();
+        /* interleave the two lines, and widen to 16 bits */
+        a = _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(p, q));
+        b = _mm256_cvtepu8_epi16(_mm_unpackhi_epi8(p, q));
+        cl = _mm256_set1_epi32(*(INT32*) (kl + y));
+        ch = _mm256_set1_epi32(*(INT32*) (kh + y));
+        lo0 = _mm256_add_epi32(lo0, _mm256_madd_epi16(a, cl));
+        hi0 = _mm256_add_epi32(hi0, _mm256_madd_epi16(a, ch));
+        lo1 = _mm256_add_epi32(lo1, _mm256_madd_epi16(b, cl));
+        hi1 = _mm256_add_epi32(hi1, _mm256_madd_epi16(b, ch));
+    }
+
+    lo0 = _mm256_add_epi32(_mm256_slli_epi32(hi0, 15), lo0);
+    lo0 = _mm256_srai_epi32(_mm256_add_epi32(lo0, half), PRECISION_BITS);
+    lo1 = _mm256_add_epi32(_mm256_slli_epi32(hi1, 15), lo1);
+    lo1 = _mm256_srai_epi32(_mm256_add_epi32(lo1, half), PRECISION_BITS);
+
+    /* pack works within 128-bit lanes; put things back in order */
+    a = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo0, lo1), 0xd8);
+    p = _mm_packus_epi16(_mm256_castsi256_si128(a),
+                         _mm256_extracti128_si256(a, 1));
+    _mm_storeu_si128((__m128i*) (out + xx), p);
+}
+
+#endif
+
+static inline UINT8
+horizontal8_sse2(UINT8* in, int xmin, int xsize, int limit,
+                 INT16* kl, INT16* kh, INT32* kq)
+{
+    /* one 8-bit sample.  we can only load 8 pixels at a time as
+       long as we stay within the line (limit) */
+
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = zero, hi = zero;
+    __m128i a;
+    UINT32 ss;
+    int x;
+
+    for (x = 0; x + 8 <= xsize || (x < xsize && xmin + x + 8 <= limit);
+         x += 8) {
+        a = _mm_loadl_epi64((__m128i*) (in + xmin + x));
+        a = _mm_unpacklo_epi8(a, zero);
+        lo = _mm_add_epi32(lo, _mm_madd_epi16(
+            a, _mm_loadu_si128((__m128i*) (kl + x))));
+        hi = _mm_add_epi32(hi, _mm_madd_epi16(
+            a, _mm_loadu_si128((__m128i*) (kh + x))));
+    }
+
+    lo = _mm_add_epi32(_mm_slli_epi32(hi, 15), lo);
+    lo = _mm_add_epi32(lo, _mm_shuffle_epi32(lo, 0x4e));
+    lo = _mm_add_epi32(lo, _mm_shuffle_epi32(lo, 0xb1));
+    ss = (UINT32) _mm_cvtsi128_si32(lo);
+
+    for (; x < xsize; x++)
+        ss += (UINT32) (in[xmin + x] * kq[x]);
+
+    return clipq((INT32) ss);
+}
+
+static inline void
+horizontal32_sse2(UINT8* out, UINT8* in, int xmin, int xsize,
+                  INT16* kl, INT16* kh)
+{
+    /* one 4-byte pixel */
+
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = zero, hi = zero;
+    __m128i a, b;
+    int x;
+
+    in = in + xmin * 4;
+
+    for (x = 0; x < xsize; x += 2) {
+        a = _mm_cvtsi32_si128(*(INT32*) (in + x*4));
+        if (x + 1 < xsize)
+            b = _mm_cvtsi32_si128(*(INT32*) (in + x*4 + 4));
+        else
+            b = zero;
+        /* interleave the two pixels, and widen to 16 bits */
+        a = _mm_unpacklo_epi8(_mm_unpacklo_epi8(a, b), zero);
+        lo = _mm_add_epi32(lo, _mm_madd_epi16(
+            a, _mm_set1_epi32(*(INT32*) (kl + x))));
+        hi = _mm_add_epi32(hi, _mm_madd_epi16(
+            a, _mm_set1_epi32(*(INT32*) (kh + x))));
+    }
+
+    a = _mm_packs_epi32(combine_sse2(lo, hi), zero);
+    *(INT32*) out = _mm_cvtsi128_si32(_mm_packus_epi16(a, a));
+}
+
+#endif
+
+static void
+stretch_vertical_fixed(void* context, int start, int end)
+{
+    /* vertical stretch, 8-bit images, fixed point version */
+
+    struct stretch_context* ctx = context;
+    Imaging imOut = ctx->imOut;
+    Imaging imIn = ctx->imIn;
+    INT32 *k;
+    INT32 *line;
+    INT32 w;
+    int x, xx, yy, y, ymin, ysize;
+    int samples;
+
+    samples = imOut->linesize;
+
+    line = malloc((samples > 0 ? samples : 1) * sizeof(INT32));
+    if (!line) {
+        ctx->error = 1;
+        return;
+    }
+
+    for (yy = start; yy < end; yy++) {
+        UINT8* out = (UINT8*) imOut->image[yy];
+        ymin = ctx->c.bounds[yy*2+0];
+        ysize = ctx->c.bounds[yy*2+1];
+        k = ctx->c.kq + yy * ctx->c.ksize;
+        xx = 0;
+#if defined(USE_SSE2)
+        if (ctx->c.kl) {
+            INT16* kl = ctx->c.kl + yy * ctx->c.kstride;
+            INT16* kh = ctx->c.kh + yy * ctx->c.kstride;
+#if defined(USE_AVX2)
+            if (ImagingCpuFeatures() & IMAGING_CPU_AVX2)
+                for (; xx + 16 <= samples; xx += 16)
+                    vertical_avx2(out, imIn, xx, ymin, ysize, kl, kh);
+#endif
+            for (; xx + 8 <= samples; xx += 8)
+                vertical_sse2(out, imIn, xx, ymin, ysize, kl, kh);
+        }
+#endif
+        if (xx >= samples)
+            continue;
+        for (x = xx; x < samples; x++)
+            line[x] = 0;
+        for (y = 0; y < ysize; y++) {
+            UINT8* in = (UINT8*) imIn->image[ymin + y];
+            w = k[y];
+            for (x = xx; x < samples; x++)
+                line[x] += in[x] * w;
+        }
+        for (x = xx; x < samples; x++)
+            out[x] = clipq(line[x]);
+    }
+
+    free(line);
+}
+
+static void
+stretch_horizontal_fixed(void* context, int start, int end)
+{
+    /* horizontal stretch, 8-bit images, fixed point version */
+
+    struct stretch_context* ctx = context;
+    Imaging imOut = ctx->imOut;
+    Imaging imIn = ctx->imIn;
+    INT32 ss, ss0, ss1, ss2, ss3;
+    INT32 *k;
+    int xx, yy, x, xmin, xsize;
+
+    for (yy = start; yy < end; yy++) {
+        UINT8* in = (UINT8*) imIn->image[yy];
+        UINT8* out = (UINT8*) imOut->image[yy];
+#if defined(USE_SSE2)
+        /* for short 8-bit kernels, the portable code is as fast */
+        if (ctx->c.kl && (!imIn->image8 || ctx->c.ksize >= 8)) {
+            INT16* kl = ctx->c.kl;
+            INT16* kh = ctx->c.kh;
+            int kstride = ctx->c.kstride;
+            if (imIn->image8)
+                for (xx = 0; xx < imOut->xsize; xx++)
+                    out[xx] = horizontal8_sse2(
+                        in, ctx->c.bounds[xx*2+0], ctx->c.bounds[xx*2+1],
+                        imIn->xsize, kl + xx * kstride, kh + xx * kstride,
+                        ctx->c.kq + xx * ctx->c.ksize);
+            else
+                for (xx = 0; xx < imOut->xsize; xx++)
+                    horizontal32_sse2(
+                        out + xx*4, in,
+                        ctx->c.bounds[xx*2+0], ctx->c.bounds[xx*2+1],
+                        kl + xx * kstride, kh + xx * kstride);
+            continue;
+        }
+#endif
+        if (imIn->image8) {
+            for (xx = 0; xx < imOut->xsize; xx++) {
+                xmin = ctx->c.bounds[xx*2+0];
+                xsize = ctx->c.bounds[xx*2+1];
+                k = ctx->c.kq + xx * ctx->c.ksize;
+                ss = 0;
+                for (x = 0; x < xsize; x++)
+                    ss += in[xmin + x] * k[x];
+                out[xx] = clipq(ss);
+            }
+        } else {
+            for (xx = 0; xx < imOut->xsize; xx++) {
+                xmin = ctx->c.bounds[xx*2+0];
+                xsize = ctx->c.bounds[xx*2+1];
+                k = ctx->c.kq + xx * ctx->c.ksize;
+                ss0 = ss1 = ss2 = ss3 = 0;
+                for (x = 0; x < xsize; x++) {
+                    UINT8* p = in + (xmin + x) * 4;
+                    ss0 += p[0] * k[x];
+                    ss1 += p[1] * k[x];
+                    ss2 += p[2] * k[x];
+                    ss3 += p[3] * k[x];
                 }
+                out[xx*4+0] = clipq(ss0);
+                out[xx*4+1] = clipq(ss1);
+                out[xx*4+2] = clipq(ss2);
+                out[xx*4+3] = clipq(ss3);
+            }
         }
     }
+}
+
+static struct filter*
+getfilter(int filter)
+{
+    switch (filter) {
+    case IMAGING_TRANSFORM_NEAREST:
+        return &NEAREST;
+    case IMAGING_TRANSFORM_ANTIALIAS:
+        return &ANTIALIAS;
+    case IMAGING_TRANSFORM_BILINEAR:
+        return &BILINEAR;
+    case IMAGING_TRANSFORM_BICUBIC:
+        return &BICUBIC;
+    }
+    return NULL;
+}
+
+static ImagingWorker
+setup_pass(struct stretch_context* ctx, struct filter *filterp,
+           int vertical)
+{
+    /* precompute coefficients for a stretch from ctx->imIn to
+       ctx->imOut, and pick a worker.  returns NULL if out of
+       memory. */
+
+    Imaging imOut = ctx->imOut;
+    Imaging imIn = ctx->imIn;
+    int ok;
+
+    ctx->error = 0;
+
+    if (vertical)
+        ok = precompute_coeffs(&ctx->c, filterp, imIn->ysize, imOut->ysize);
+    else
+        ok = precompute_coeffs(&ctx->c, filterp, imIn->xsize, imOut->xsize);
+    if (!ok)
+        return NULL;
+
+    /* 8-bit images use fixed point arithmetics, if possible.  the
+       result differs by at most one from the float version. */
+    if (imIn->type == IMAGING_TYPE_UINT8)
+        precompute_fixed(&ctx->c, vertical ? imOut->ysize : imOut->xsize);
+
+    if (ctx->c.kq)
+        return vertical ? stretch_vertical_fixed : stretch_horizontal_fixed;
+    return vertical ? stretch_vertical : stretch_horizontal;
+}
+
+static Imaging
+check_modes(Imaging imOut, Imaging imIn)
+{
+    if (!imOut || !imIn || imIn->modeid != imOut->modeid)
+	return (Imaging) ImagingError_ModeError();
+
+    if (!imIn->image8 && imIn->type != IMAGING_TYPE_UINT8 &&
+        imIn->type != IMAGING_TYPE_INT32 && imIn->type != IMAGING_TYPE_FLOAT32)
+	return (Imaging) ImagingError_ModeError();
+
+    return imOut;
+}
+
+static Imaging
+stretch(Imaging imOut, Imaging imIn, int filter)
+{
+    ImagingSectionCookie cookie;
+    struct stretch_context ctx;
+    struct filter *filterp;
+    ImagingWorker worker;
+    int vertical;
+    int grain;
+
+    /* check modes */
+    if (!check_modes(imOut, imIn))
+        return NULL;
+
+    /* check filter */
+    filterp = getfilter(filter);
+    if (!filterp)
+        return (Imaging) ImagingError_ValueError(
+            "unsupported resampling filter"
+            );
+
+    /* same-size stretches are done vertically */
+    if (imIn->xsize == imOut->xsize)
+        vertical = 1;
+    else if (imIn->ysize == imOut->ysize)
+        vertical = 0;
+    else
+	return (Imaging) ImagingError_Mismatch();
+
+    ctx.imOut = imOut;
+    ctx.imIn = imIn;
+
+    ImagingSectionEnter(&cookie);
+
+    worker = setup_pass(&ctx, filterp, vertical);
+    if (worker) {
+        /* both passes are split into bands of output lines */
+        grain = STRETCH_GRAIN / (imOut->xsize * ctx.c.ksize + 1) + 1;
+        ImagingParallel(worker, &ctx, imOut->ysize, grain);
+        free_coeffs(&ctx.c);
+    }
+
     ImagingSectionLeave(&cookie);
 
-    free(k);
+    if (!worker || ctx.error)
+        return (Imaging) ImagingError_MemoryError();
 
     return imOut;
 }
+
+/* -------------------------------------------------------------------- */
+/* Two-pass resampling.  Instead of going via a full-size intermediate
+   image, each band of output lines is produced from a temporary image
+   that only has storage for a few lines.  With the horizontal pass
+   done first, the temporary lines form a ring buffer holding the
+   horizontally stretched source lines needed by the vertical pass.
+   Otherwise, a single line is enough.  The result is the same as
+   from two calls to ImagingStretch. */
+
+struct resample_context {
+    struct stretch_context h; /* horizontal pass */
+    struct stretch_context v; /* vertical pass */
+    ImagingWorker hworker;
+    ImagingWorker vworker;
+    int vertical_first;
+    int error;
+};
+
+static void
+resample_lines(void* context, int start, int end)
+{
+    struct resample_context* ctx = context;
+    struct stretch_context h = ctx->h;
+    struct stretch_context v = ctx->v;
+    struct ImagingMemoryInstance tmp;
+    Imaging imIn = h.imIn;
+    char** image;
+    char* lines;
+    int lineno, yy, y, ymin, ymax, next;
+
+    /* set up the temporary image */
+    tmp = *imIn;
+    if (ctx->vertical_first) {
+        tmp.xsize = imIn->xsize;
+        tmp.ysize = v.imOut->ysize;
+        lineno = 1;
+        v.imOut = h.imIn = &tmp;
+    } else {
+        tmp.xsize = h.imOut->xsize;
+        tmp.ysize = imIn->ysize;
+        lineno = v.c.ksize;
+        h.imOut = v.imIn = &tmp;
+    }
+    tmp.linesize = tmp.xsize * tmp.pixelsize;
+    tmp.stride = (tmp.linesize + IMAGING_ALIGN - 1) & ~(IMAGING_ALIGN - 1);
+    tmp.palette = NULL;
+    tmp.block = NULL;
+    tmp.destroy = NULL;
+
+    image = malloc((tmp.ysize > 0 ? tmp.ysize : 1) * sizeof(char*));
+    lines = ImagingPoolAlloc(lineno * tmp.stride);
+    if (!image || !lines) {
+        free(image);
+        ImagingPoolFree(lines);
+        ctx->error = 1;
+        return;
+    }
+
+    for (y = 0; y < tmp.ysize; y++)
+        image[y] = lines + (y % lineno) * tmp.stride;
+    tmp.image = image;
+    tmp.image8 = imIn->image8 ? (UINT8**) image : NULL;
+    tmp.image32 = imIn->image32 ? (INT32**) image : NULL;
+
+    next = 0; /* first source line not yet in the ring buffer */
+
+    for (yy = start; yy < end; yy++) {
+        if (ctx->vertical_first) {
+            ctx->vworker(&v, yy, yy+1);
+            ctx->hworker(&h, yy, yy+1);
+        } else {
+            /* add missing lines to the ring buffer; earlier lines
+               are no longer needed */
+            ymin = v.c.bounds[yy*2+0];
+            ymax = ymin + v.c.bounds[yy*2+1];
+            if (next < ymin)
+                next = ymin;
+            if (next < ymax) {
+                ctx->hworker(&h, next, ymax);
+                next = ymax;
+            }
+            ctx->vworker(&v, yy, yy+1);
+        }
+        if (h.error || v.error)
+            break;
+    }
+
+    if (h.error || v.error)
+        ctx->error = 1;
+
+    free(image);
+    ImagingPoolFree(lines);
+}
+
+Imaging
+ImagingStretch(Imaging imOut, Imaging imIn, int filter)
+{
+    ImagingTraceCookie trace;
+
+    ImagingTraceBegin(&trace, "stretch");
+    imOut = stretch(imOut, imIn, filter);
+    ImagingTraceEnd(&trace, imOut ? (long) imOut->xsize * imOut->ysize : 0);
+
+    return imOut;
+}
+
+static Imaging
+resample(Imaging imOut, Imaging imIn, int filter)
+{
+    ImagingSectionCookie cookie;
+    struct resample_context ctx;
+    struct filter *filterp;
+    int grain;
+
+    /* check modes */
+    if (!check_modes(imOut, imIn))
+        return NULL;
+
+    /* check filter */
+    filterp = getfilter(filter);
+    if (!filterp)
+        return (Imaging) ImagingError_ValueError(
+            "unsupported resampling filter"
+            );
+
+    /* do the pass that gives the smaller intermediate image first */
+    ctx.vertical_first = ((double) imIn->xsize * imOut->ysize <
+                          (double) imOut->xsize * imIn->ysize);
+
+    if (imIn->xsize == imOut->xsize) {
+        /* both passes are vertical (see ImagingStretch); use a real
+           intermediate image, to get the same result as before */
+        Imaging imTemp;
+        if (ctx.vertical_first)
+            imTemp = ImagingNew(imIn->mode, imIn->xsize, imOut->ysize);
+        else
+            imTemp = ImagingNew(imIn->mode, imIn->xsize, imIn->ysize);
+        if (!imTemp)
+            return NULL;
+        if (!ImagingStretch(imTemp, imIn, filter) ||
+            !ImagingStretch(imOut, imTemp, filter))
+            imOut = NULL;
+        ImagingDelete(imTemp);
+        return imOut;
+    }
+
+    /* the pass contexts are completed by the worker */
+    ctx.h.imIn = ctx.v.imIn = imIn;
+    ctx.h.imOut = ctx.v.imOut = imOut;
+    ctx.error = 0;
+
+    ImagingSectionEnter(&cookie);
+
+    ctx.hworker = setup_pass(&ctx.h, filterp, 0);
+    ctx.vworker = setup_pass(&ctx.v, filterp, 1);
+
+    if (ctx.hworker && ctx.vworker) {
+        /* bands of output lines; since each band has to fill its own
+           ring buffer, don't make them too small */
+        grain = STRETCH_GRAIN /
+            (imOut->xsize * (ctx.h.c.ksize + ctx.v.c.ksize) + 1) + 1;
+        if (grain < ctx.v.c.ksize)
+            grain = ctx.v.c.ksize;
+        ImagingParallel(resample_lines, &ctx, imOut->ysize, grain);
+    } else
+        ctx.error = 1;
+
+    if (ctx.hworker)
+        free_coeffs(&ctx.h.c);
+    if (ctx.vworker)
+        free_coeffs(&ctx.v.c);
+
+    ImagingSectionLeave(&cookie);
+
+    if (ctx.error)
+        return (Imaging) ImagingError_MemoryError();
+
+    return imOut;
+}
+
+Imaging
+ImagingResample(Imaging imOut, Imaging imIn, int filter)
+{
+    ImagingTraceCookie trace;
+
+    ImagingTraceBegin(&trace, "resample");
+    imOut = resample(imOut, imIn, filter);
+    ImagingTraceEnd(&trace, imOut ? (long) imOut->xsize * imOut->ysize : 0);
+
+    return imOut;
+}
+
+/* -------------------------------------------------------------------- */
+/* Streaming resampler.  Source lines are pushed one at a time, in
+   order.  Each line is stretched horizontally into a ring buffer, and
+   output lines are produced by the vertical pass as soon as all the
+   lines they depend on are in the buffer.  Passes that don't change
+   the size are skipped.  The result is the same as from ImagingResample
+   with the horizontal pass done first. */
+
+struct ImagingResamplerInstance {
+    Imaging imOut;
+    struct stretch_context h; /* horizontal pass */
+    struct stretch_context v; /* vertical pass */
+    ImagingWorker hworker; /* NULL if same width */
+    ImagingWorker vworker; /* NULL if same height */
+    struct ImagingMemoryInstance in; /* source lines, as pushed */
+    struct ImagingMemoryInstance tmp; /* ring buffer */
+    char* lines;
+    int y; /* next source line */
+    int yy; /* next output line */
+};
+
+static void
+init_lines(Imaging im, int xsize, int ysize)
+{
+    im->xsize = xsize;
+    im->ysize = ysize;
+    im->linesize = xsize * im->pixelsize;
+    im->stride = (im->linesize + IMAGING_ALIGN - 1) & ~(IMAGING_ALIGN - 1);
+    im->palette = NULL;
+    im->block = NULL;
+    im->destroy = NULL;
+    im->image = NULL;
+    im->image8 = NULL;
+    im->image32 = NULL;
+}
+
+static int
+alloc_lines(Imaging im, Imaging imTemplate)
+{
+    im->image = calloc((im->ysize > 0 ? im->ysize : 1), sizeof(char*));
+    if (!im->image)
+        return -1;
+    im->image8 = imTemplate->image8 ? (UINT8**) im->image : NULL;
+    im->image32 = imTemplate->image32 ? (INT32**) im->image : NULL;
+    return 0;
+}
+
+ImagingResampler
+ImagingResamplerNew(Imaging imOut, int xsize, int ysize, int filter)
+{
+    ImagingResampler r;
+    struct filter *filterp;
+    int lineno, y;
+
+    if (!check_modes(imOut, imOut))
+        return NULL;
+
+    filterp = getfilter(filter);
+    if (!filterp)
+        return (ImagingResampler) ImagingError_ValueError(
+            "unsupported resampling filter"
+            );
+
+    if (xsize <= 0 || ysize <= 0)
+        return (ImagingResampler) ImagingError_ValueError("bad image size");
+
+    r = calloc(1, sizeof(struct ImagingResamplerInstance));
+    if (!r)
+        return (ImagingResampler) ImagingError_MemoryError();
+
+    r->imOut = imOut;
+    r->in = *imOut;
+    init_lines(&r->in, xsize, ysize);
+    r->tmp = *imOut;
+    init_lines(&r->tmp, imOut->xsize, ysize);
+
+    if (alloc_lines(&r->in, imOut) < 0)
+        goto nomemory;
+
+    if (ysize != imOut->ysize) {
+        r->v.imIn = &r->tmp;
+        r->v.imOut = imOut;
+        r->vworker = setup_pass(&r->v, filterp, 1);
+        if (!r->vworker)
+            goto nomemory;
+        /* the ring buffer holds the lines for one output line */
+        lineno = r->v.c.ksize;
+        r->lines = ImagingPoolAlloc(lineno * r->tmp.stride);
+        if (!r->lines || alloc_lines(&r->tmp, imOut) < 0)
+            goto nomemory;
+        for (y = 0; y < ysize; y++)
+            r->tmp.image[y] = r->lines + (y % lineno) * r->tmp.stride;
+    }
+
+    if (xsize != imOut->xsize) {
+        r->h.imIn = &r->in;
+        r->h.imOut = r->vworker ? &r->tmp : imOut;
+        r->hworker = setup_pass(&r->h, filterp, 0);
+        if (!r->hworker)
+            goto nomemory;
+    }
+
+    return r;
+
+  nomemory:
+    ImagingResamplerDelete(r);
+    return (ImagingResampler) ImagingError_MemoryError();
+}
+
+int
+ImagingResamplerPush(ImagingResampler r, UINT8* line)
+{
+    /* add the next source line.  extra lines are ignored.  returns -1
+       if out of memory (no exception is raised, unless the output
+       image couldn't be detached) */
+
+    Imaging imOut = r->imOut;
+    int y = r->y;
+    int ymax;
+
+    if (y >= r->in.ysize)
+        return 0;
+
+    /* the output image may be shared with a copy */
+    if (ImagingDetach(imOut) < 0)
+        return -1;
+
+    r->in.image[y] = (char*) line;
+
+    if (r->hworker)
+        r->hworker(&r->h, y, y+1);
+    else if (r->vworker)
+        memcpy(r->tmp.image[y], line, r->in.linesize);
+    else
+        memcpy(imOut->image[y], line, r->in.linesize);
+
+    r->y = ++y;
+
+    if (r->vworker)
+        /* emit all output lines that are complete */
+        for (; r->yy < imOut->ysize; r->yy++) {
+            ymax = r->v.c.bounds[r->yy*2+0] + r->v.c.bounds[r->yy*2+1];
+            if (ymax > y)
+                break;
+            r->vworker(&r->v, r->yy, r->yy+1);
+        }
+
+    if (r->h.error || r->v.error)
+        return -1;
+
+    return 0;
+}
+
+void
+ImagingResamplerDelete(ImagingResampler r)
+{
+    if (!r)
+        return;
+    if (r->hworker)
+        free_coeffs(&r->h.c);
+    if (r->vworker)
+        free_coeffs(&r->v.c);
+    free(r->in.image);
+    free(r->tmp.image);
+    ImagingPoolFree(r->lines);
+    free(r);
+}
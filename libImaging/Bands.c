@@ -81,6 +81,9 @@ ImagingPutBand(Imaging imOut, Imaging imIn, int band)
     if (imOut->bands == 1)
 	return ImagingCopy2(imOut, imIn);
 
+    if (ImagingDetach(imOut) < 0)
+	return NULL;
+
     /* Special case for LXXA etc */
     if (imOut->bands == 2 && band == 1)
         band = 3;
@@ -110,6 +113,9 @@ ImagingFillBand(Imaging imOut, int band, int color)
     if (band < 0 || band >= imOut->bands)
 	return (Imaging) ImagingError_ValueError("band index out of range");
 
+    if (ImagingDetach(imOut) < 0)
+	return NULL;
+
     /* Special case for LXXA etc */
     if (imOut->bands == 2 && band == 1)
         band = 3;
@@ -20,9 +20,10 @@
 
 
 Imaging
-ImagingBlend(Imaging imIn1, Imaging imIn2, float alpha)
+ImagingBlend2(Imaging imOut, Imaging imIn1, Imaging imIn2, float alpha)
 {
-    Imaging imOut;
+    /* imOut may be the same image as either input */
+
     int x, y;
 
     /* Check arguments */
@@ -36,11 +37,11 @@ ImagingBlend(Imaging imIn1, Imaging imIn2, float alpha)
 
     /* Shortcuts */
     if (alpha == 0.0)
-	return ImagingCopy(imIn1);
+	return (imOut) ? ImagingCopy2(imOut, imIn1) : ImagingCopy(imIn1);
     else if (alpha == 1.0)
-	return ImagingCopy(imIn2);
+	return (imOut) ? ImagingCopy2(imOut, imIn2) : ImagingCopy(imIn2);
 
-    imOut = ImagingNew(imIn1->mode, imIn1->xsize, imIn1->ysize);
+    imOut = ImagingNew2(imIn1->mode, imOut, imIn1);
     if (!imOut)
 	return NULL;
 
@@ -77,3 +78,9 @@ ImagingBlend(Imaging imIn1, Imaging imIn2, float alpha)
 
     return imOut;
 }
+
+Imaging
+ImagingBlend(Imaging imIn1, Imaging imIn2, float alpha)
+{
+    return ImagingBlend2(NULL, imIn1, imIn2, alpha);
+}
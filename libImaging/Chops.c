@@ -21,8 +21,7 @@
 
 #define	CHOP(operation, mode)\
     int x, y;\
-    Imaging imOut;\
-    imOut = create(imIn1, imIn2, mode);\
+    imOut = create(imOut, imIn1, imIn2, mode);\
     if (!imOut)\
 	return NULL;\
     for (y = 0; y < imOut->ysize; y++) {\
@@ -43,8 +42,7 @@
 
 #define	CHOP2(operation, mode)\
     int x, y;\
-    Imaging imOut;\
-    imOut = create(imIn1, imIn2, mode);\
+    imOut = create(imOut, imIn1, imIn2, mode);\
     if (!imOut)\
 	return NULL;\
     for (y = 0; y < imOut->ysize; y++) {\
@@ -58,8 +56,12 @@
     return imOut;
 
 static Imaging
-create(Imaging im1, Imaging im2, char* mode)
+create(Imaging imOut, Imaging im1, Imaging im2, char* mode)
 {
+    /* the output is as large as the smaller input.  since all
+       operations work pixel by pixel, imOut can be one of the inputs
+       (if they have the same size). */
+
     int xsize, ysize;
 
     if (!im1 || !im2 || im1->type != IMAGING_TYPE_UINT8 ||
@@ -72,77 +74,160 @@ create(Imaging im1, Imaging im2, char* mode)
     xsize = (im1->xsize < im2->xsize) ? im1->xsize : im2->xsize;
     ysize = (im1->ysize < im2->ysize) ? im1->ysize : im2->ysize;
 
+    if (imOut) {
+        if (imOut->modeid != im1->modeid ||
+            imOut->xsize != xsize || imOut->ysize != ysize)
+            return ImagingError_Mismatch();
+        if (ImagingDetach(imOut) < 0)
+            return NULL;
+        return imOut;
+    }
+
     return ImagingNew(im1->mode, xsize, ysize);
 }
 
 Imaging
-ImagingChopLighter(Imaging imIn1, Imaging imIn2)
+ImagingChopLighter2(Imaging imOut, Imaging imIn1, Imaging imIn2)
 {
     CHOP((in1[x] > in2[x]) ? in1[x] : in2[x], NULL);
 }
 
 Imaging
-ImagingChopDarker(Imaging imIn1, Imaging imIn2)
+ImagingChopLighter(Imaging imIn1, Imaging imIn2)
+{
+    return ImagingChopLighter2(NULL, imIn1, imIn2);
+}
+
+Imaging
+ImagingChopDarker2(Imaging imOut, Imaging imIn1, Imaging imIn2)
 {
     CHOP((in1[x] < in2[x]) ? in1[x] : in2[x], NULL);
 }
 
 Imaging
-ImagingChopDifference(Imaging imIn1, Imaging imIn2)
+ImagingChopDarker(Imaging imIn1, Imaging imIn2)
+{
+    return ImagingChopDarker2(NULL, imIn1, imIn2);
+}
+
+Imaging
+ImagingChopDifference2(Imaging imOut, Imaging imIn1, Imaging imIn2)
 {
     CHOP(abs((int) in1[x] - (int) in2[x]), NULL);
 }
 
 Imaging
-ImagingChopMultiply(Imaging imIn1, Imaging imIn2)
+ImagingChopDifference(Imaging imIn1, Imaging imIn2)
+{
+    return ImagingChopDifference2(NULL, imIn1, imIn2);
+}
+
+Imaging
+ImagingChopMultiply2(Imaging imOut, Imaging imIn1, Imaging imIn2)
 {
     CHOP((int) in1[x] * (int) in2[x] / 255, NULL);
 }
 
 Imaging
-ImagingChopScreen(Imaging imIn1, Imaging imIn2)
+ImagingChopMultiply(Imaging imIn1, Imaging imIn2)
+{
+    return ImagingChopMultiply2(NULL, imIn1, imIn2);
+}
+
+Imaging
+ImagingChopScreen2(Imaging imOut, Imaging imIn1, Imaging imIn2)
 {
     CHOP(255 - ((int) (255 - in1[x]) * (int) (255 - in2[x])) / 255, NULL);
 }
 
 Imaging
-ImagingChopAdd(Imaging imIn1, Imaging imIn2, float scale, int offset)
+ImagingChopScreen(Imaging imIn1, Imaging imIn2)
+{
+    return ImagingChopScreen2(NULL, imIn1, imIn2);
+}
+
+Imaging
+ImagingChopAdd2(Imaging imOut, Imaging imIn1, Imaging imIn2,
+                float scale, int offset)
 {
     CHOP(((int) in1[x] + (int) in2[x]) / scale + offset, NULL);
 }
 
 Imaging
-ImagingChopSubtract(Imaging imIn1, Imaging imIn2, float scale, int offset)
+ImagingChopAdd(Imaging imIn1, Imaging imIn2, float scale, int offset)
+{
+    return ImagingChopAdd2(NULL, imIn1, imIn2, scale, offset);
+}
+
+Imaging
+ImagingChopSubtract2(Imaging imOut, Imaging imIn1, Imaging imIn2,
+                     float scale, int offset)
 {
     CHOP(((int) in1[x] - (int) in2[x]) / scale + offset, NULL);
 }
 
 Imaging
-ImagingChopAnd(Imaging imIn1, Imaging imIn2)
+ImagingChopSubtract(Imaging imIn1, Imaging imIn2, float scale, int offset)
+{
+    return ImagingChopSubtract2(NULL, imIn1, imIn2, scale, offset);
+}
+
+Imaging
+ImagingChopAnd2(Imaging imOut, Imaging imIn1, Imaging imIn2)
 {
     CHOP2((in1[x] && in2[x]) ? 255 : 0, "1");
 }
 
 Imaging
-ImagingChopOr(Imaging imIn1, Imaging imIn2)
+ImagingChopAnd(Imaging imIn1, Imaging imIn2)
+{
+    return ImagingChopAnd2(NULL, imIn1, imIn2);
+}
+
+Imaging
+ImagingChopOr2(Imaging imOut, Imaging imIn1, Imaging imIn2)
 {
     CHOP2((in1[x] || in2[x]) ? 255 : 0, "1");
 }
 
 Imaging
-ImagingChopXor(Imaging imIn1, Imaging imIn2)
+ImagingChopOr(Imaging imIn1, Imaging imIn2)
+{
+    return ImagingChopOr2(NULL, imIn1, imIn2);
+}
+
+Imaging
+ImagingChopXor2(Imaging imOut, Imaging imIn1, Imaging imIn2)
 {
     CHOP2(((in1[x] != 0) ^ (in2[x] != 0)) ? 255 : 0, "1");
 }
 
 Imaging
-ImagingChopAddModulo(Imaging imIn1, Imaging imIn2)
+ImagingChopXor(Imaging imIn1, Imaging imIn2)
+{
+    return ImagingChopXor2(NULL, imIn1, imIn2);
+}
+
+Imaging
+ImagingChopAddModulo2(Imaging imOut, Imaging imIn1, Imaging imIn2)
 {
     CHOP2(in1[x] + in2[x], NULL);
 }
 
 Imaging
-ImagingChopSubtractModulo(Imaging imIn1, Imaging imIn2)
+ImagingChopAddModulo(Imaging imIn1, Imaging imIn2)
+{
+    return ImagingChopAddModulo2(NULL, imIn1, imIn2);
+}
+
+Imaging
+ImagingChopSubtractModulo2(Imaging imOut, Imaging imIn1, Imaging imIn2)
 {
     CHOP2(in1[x] - in2[x], NULL);
 }
+
+Imaging
+ImagingChopSubtractModulo(Imaging imIn1, Imaging imIn2)
+{
+    return ImagingChopSubtractModulo2(NULL, imIn1, imIn2);
+}
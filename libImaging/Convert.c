@@ -38,6 +38,9 @@
 #define CLIP(v) ((v) <= 0 ? 0 : (v) >= 255 ? 255 : (v))
 #define CLIP16(v) ((v) <= -32768 ? -32768 : (v) >= 32767 ? 32767 : (v))
 
+/* work is split into bands of at least this many pixels */
+#define CONVERT_GRAIN 262144
+
 /* like (a * b + 127) / 255), but much faster on most platforms */
 #define	MULDIV255(a, b, tmp)\
      	(tmp = (a) * (b) + 128, ((((tmp) >> 8) + (tmp)) >> 8))
@@ -46,6 +49,208 @@
 #define L(rgb)\
     ((INT32) (rgb)[0]*299 + (INT32) (rgb)[1]*587 + (INT32) (rgb)[2]*114)
 
+/* vectorized versions of the most common converters.  SSE2 is used
+   when the compiler targets it; AVX2 is compiled in for GCC-compatible
+   compilers, and selected at run time.  each helper converts as many
+   pixels as it can in whole blocks, and returns the number of pixels
+   done; the portable code takes care of the rest.  the results are
+   identical to the portable code. */
+#if defined(__SSE2__) || defined(_M_X64)
+#define USE_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || \
+     (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define USE_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(USE_SSE2)
+
+#define	HAVE_SSE2 (ImagingCpuFeatures() & IMAGING_CPU_SSE2)
+
+static inline __m128i
+luminance_sse2(__m128i v)
+{
+    /* L() for four pixels, as 32-bit integers */
+
+    __m128i zero = _mm_setzero_si128();
+    __m128i k = _mm_set_epi16(0, 114, 587, 299, 0, 114, 587, 299);
+    __m128 lo, hi;
+
+    /* r*299 + g*587 and b*114 for each pixel */
+    lo = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(v, zero), k));
+    hi = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(v, zero), k));
+
+    return _mm_add_epi32(
+        _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0))),
+        _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)))
+        );
+}
+
+static inline __m128i
+grey_sse2(const UINT8* in)
+{
+    /* L() / 1000 for eight pixels, as bytes in the low half */
+
+    __m128i a, b;
+
+    a = luminance_sse2(_mm_loadu_si128((__m128i*) in));
+    b = luminance_sse2(_mm_loadu_si128((__m128i*) (in + 16)));
+
+    /* x / 1000 == (x >> 3) / 125, and (y * 33555) >> 22 == y / 125
+       for all y below 32768 */
+    a = _mm_packs_epi32(_mm_srli_epi32(a, 3), _mm_srli_epi32(b, 3));
+    a = _mm_srli_epi16(_mm_mulhi_epu16(a, _mm_set1_epi16(33555)), 6);
+
+    return _mm_packus_epi16(a, a);
+}
+
+static inline void
+expand_sse2(UINT8* out, __m128i v, __m128i alpha)
+{
+    /* store eight bytes as "l, l, l, alpha" pixels */
+
+    __m128i a = _mm_unpacklo_epi8(v, v);
+    __m128i b = _mm_unpacklo_epi8(v, alpha);
+    _mm_storeu_si128((__m128i*) out, _mm_unpacklo_epi16(a, b));
+    _mm_storeu_si128((__m128i*) (out + 16), _mm_unpackhi_epi16(a, b));
+}
+
+static int
+rgb2l_sse2(UINT8* out, const UINT8* in, int xsize)
+{
+    int x;
+    for (x = 0; x + 8 <= xsize; x += 8)
+        _mm_storel_epi64((__m128i*) (out + x), grey_sse2(in + x*4));
+    return x;
+}
+
+static int
+rgb2la_sse2(UINT8* out, const UINT8* in, int xsize)
+{
+    __m128i alpha = _mm_set1_epi8((char) 255);
+    int x;
+    for (x = 0; x + 8 <= xsize; x += 8)
+        expand_sse2(out + x*4, grey_sse2(in + x*4), alpha);
+    return x;
+}
+
+#if defined(__SSE_MATH__) || defined(_M_X64)
+/* only if scalar float math is done in SSE registers as well */
+#define USE_SSE2_FLOAT
+
+static int
+rgb2f_sse2(UINT8* out, const UINT8* in, int xsize)
+{
+    __m128 k = _mm_set1_ps(1000.0F);
+    int x;
+    for (x = 0; x + 4 <= xsize; x += 4) {
+        __m128i v = luminance_sse2(_mm_loadu_si128((__m128i*) (in + x*4)));
+        _mm_storeu_ps((float*) out + x, _mm_div_ps(_mm_cvtepi32_ps(v), k));
+    }
+    return x;
+}
+#endif
+
+static int
+l2rgb_sse2(UINT8* out, const UINT8* in, int xsize)
+{
+    __m128i alpha = _mm_set1_epi8((char) 255);
+    int x;
+    for (x = 0; x + 8 <= xsize; x += 8)
+        expand_sse2(out + x*4,
+                    _mm_loadl_epi64((__m128i*) (in + x)), alpha);
+    return x;
+}
+
+static int
+rgb2rgba_sse2(UINT8* out, const UINT8* in, int xsize)
+{
+    /* also used for rgba2rgb */
+    __m128i alpha = _mm_slli_epi32(_mm_set1_epi32(0xff), 24);
+    int x;
+    for (x = 0; x + 4 <= xsize; x += 4) {
+        __m128i v = _mm_loadu_si128((__m128i*) (in + x*4));
+        _mm_storeu_si128((__m128i*) (out + x*4), _mm_or_si128(v, alpha));
+    }
+    return x;
+}
+
+static int
+rgb2cmyk_sse2(UINT8* out, const UINT8* in, int xsize)
+{
+    __m128i mask = _mm_set1_epi32(0x00ffffff);
+    int x;
+    for (x = 0; x + 4 <= xsize; x += 4) {
+        __m128i v = _mm_loadu_si128((__m128i*) (in + x*4));
+        _mm_storeu_si128((__m128i*) (out + x*4), _mm_andnot_si128(v, mask));
+    }
+    return x;
+}
+
+static int
+cmyk2rgb_sse2(UINT8* out, const UINT8* in, int xsize)
+{
+    /* 255 - (c + k), clipped, is the complement of the saturated
+       sum.  the k byte is masked off, so the alpha byte comes out
+       as 255. */
+    __m128i mask = _mm_set1_epi32(0x00ffffff);
+    int x;
+    for (x = 0; x + 4 <= xsize; x += 4) {
+        __m128i v = _mm_loadu_si128((__m128i*) (in + x*4));
+        __m128i k = _mm_srli_epi32(v, 24);
+        k = _mm_or_si128(k, _mm_slli_epi32(k, 8));
+        k = _mm_or_si128(k, _mm_slli_epi32(k, 8));
+        v = _mm_adds_epu8(_mm_and_si128(v, mask), k);
+        _mm_storeu_si128((__m128i*) (out + x*4),
+                         _mm_xor_si128(v, _mm_set1_epi32(-1)));
+    }
+    return x;
+}
+
+static int
+ordered_sse2(UINT8* out, const UINT8* in, const UINT8* row, int width,
+             int xsize)
+{
+    /* threshold 16 pixels at a time (unsigned compare, done as a
+       signed compare on biased values) */
+    __m128i bias = _mm_set1_epi8((char) 0x80);
+    int x;
+    for (x = 0; x + 16 <= xsize; x += 16) {
+        __m128i v = _mm_loadu_si128((__m128i*) (in + x));
+        __m128i t = _mm_loadu_si128((__m128i*) (row + (x & (width-1))));
+        _mm_storeu_si128((__m128i*) (out + x),
+                         _mm_cmpgt_epi8(_mm_xor_si128(v, bias),
+                                        _mm_xor_si128(t, bias)));
+    }
+    return x;
+}
+
+#endif
+
+#if defined(USE_AVX2)
+
+__attribute__((target("avx2")))
+static int
+p2rgba_avx2(UINT8* out, const UINT8* in, int xsize, const UINT8* palette,
+            int alpha)
+{
+    /* look up eight pixels at a time.  if alpha is set, the alpha
+       byte is forced to 255 */
+    __m256i mask = _mm256_slli_epi32(_mm256_set1_epi32(alpha), 24);
+    int x;
+    for (x = 0; x + 8 <= xsize; x += 8) {
+        __m256i i = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*) (in + x)));
+        __m256i v = _mm256_i32gather_epi32((const int*) palette, i, 4);
+        _mm256_storeu_si256((__m256i*) (out + x*4), _mm256_or_si256(v, mask));
+    }
+    return x;
+}
+
+#endif
+
 /* ------------------- */
 /* 1 (bit) conversions */
 /* ------------------- */
@@ -110,8 +315,12 @@ l2bit(UINT8* out, const UINT8* in, int xsize)
 static void
 l2la(UINT8* out, const UINT8* in, int xsize)
 {
-    int x;
-    for (x = 0; x < xsize; x++) {
+    int x = 0;
+#if defined(USE_SSE2)
+    if (HAVE_SSE2)
+        x = l2rgb_sse2(out, in, xsize);
+#endif
+    for (in += x, out += x*4; x < xsize; x++) {
         UINT8 v = *in++;
 	*out++ = v;
 	*out++ = v;
@@ -123,8 +332,12 @@ l2la(UINT8* out, const UINT8* in, int xsize)
 static void
 l2rgb(UINT8* out, const UINT8* in, int xsize)
 {
-    int x;
-    for (x = 0; x < xsize; x++) {
+    int x = 0;
+#if defined(USE_SSE2)
+    if (HAVE_SSE2)
+        x = l2rgb_sse2(out, in, xsize);
+#endif
+    for (in += x, out += x*4; x < xsize; x++) {
         UINT8 v = *in++;
 	*out++ = v;
 	*out++ = v;
@@ -166,8 +379,12 @@ rgb2bit(UINT8* out, const UINT8* in, int xsize)
 static void
 rgb2l(UINT8* out, const UINT8* in, int xsize)
 {
-    int x;
-    for (x = 0; x < xsize; x++, in += 4)
+    int x = 0;
+#if defined(USE_SSE2)
+    if (HAVE_SSE2)
+        x = rgb2l_sse2(out, in, xsize);
+#endif
+    for (in += x*4, out += x; x < xsize; x++, in += 4)
 	/* ITU-R Recommendation 601-2 (assuming nonlinear RGB) */
 	*out++ = L(in) / 1000;
 }
@@ -175,8 +392,12 @@ rgb2l(UINT8* out, const UINT8* in, int xsize)
 static void
 rgb2la(UINT8* out, const UINT8* in, int xsize)
 {
-    int x;
-    for (x = 0; x < xsize; x++, in += 4, out += 4) {
+    int x = 0;
+#if defined(USE_SSE2)
+    if (HAVE_SSE2)
+        x = rgb2la_sse2(out, in, xsize);
+#endif
+    for (in += x*4, out += x*4; x < xsize; x++, in += 4, out += 4) {
 	/* ITU-R Recommendation 601-2 (assuming nonlinear RGB) */
 	out[0] = out[1] = out[2] = L(in) / 1000;
         out[3] = 255;
@@ -195,9 +416,13 @@ rgb2i(UINT8* out_, const UINT8* in, int xsize)
 static void
 rgb2f(UINT8* out_, const UINT8* in, int xsize)
 {
-    int x;
+    int x = 0;
     FLOAT32* out = (FLOAT32*) out_;
-    for (x = 0; x < xsize; x++, in += 4)
+#if defined(USE_SSE2_FLOAT)
+    if (HAVE_SSE2)
+        x = rgb2f_sse2(out_, in, xsize);
+#endif
+    for (in += x*4, out += x; x < xsize; x++, in += 4)
 	*out++ = (float) L(in) / 1000.0F;
 }
 
@@ -243,8 +468,12 @@ rgb2bgr24(UINT8* out, const UINT8* in, int xsize)
 static void
 rgb2rgba(UINT8* out, const UINT8* in, int xsize)
 {
-    int x;
-    for (x = 0; x < xsize; x++) {
+    int x = 0;
+#if defined(USE_SSE2)
+    if (HAVE_SSE2)
+        x = rgb2rgba_sse2(out, in, xsize);
+#endif
+    for (in += x*4, out += x*4; x < xsize; x++) {
         *out++ = *in++;
         *out++ = *in++;
         *out++ = *in++;
@@ -266,8 +495,12 @@ rgba2la(UINT8* out, const UINT8* in, int xsize)
 static void
 rgba2rgb(UINT8* out, const UINT8* in, int xsize)
 {
-    int x;
-    for (x = 0; x < xsize; x++) {
+    int x = 0;
+#if defined(USE_SSE2)
+    if (HAVE_SSE2)
+        x = rgb2rgba_sse2(out, in, xsize);
+#endif
+    for (in += x*4, out += x*4; x < xsize; x++) {
         *out++ = *in++;
         *out++ = *in++;
         *out++ = *in++;
@@ -308,8 +541,12 @@ l2cmyk(UINT8* out, const UINT8* in, int xsize)
 static void
 rgb2cmyk(UINT8* out, const UINT8* in, int xsize)
 {
-    int x;
-    for (x = 0; x < xsize; x++) {
+    int x = 0;
+#if defined(USE_SSE2)
+    if (HAVE_SSE2)
+        x = rgb2cmyk_sse2(out, in, xsize);
+#endif
+    for (in += x*4, out += x*4; x < xsize; x++) {
 	/* Note: no undercolour removal */
         *out++ = ~(*in++);
         *out++ = ~(*in++);
@@ -321,8 +558,12 @@ rgb2cmyk(UINT8* out, const UINT8* in, int xsize)
 static void
 cmyk2rgb(UINT8* out, const UINT8* in, int xsize)
 {
-    int x;
-    for (x = 0; x < xsize; x++, in += 4) {
+    int x = 0;
+#if defined(USE_SSE2)
+    if (HAVE_SSE2)
+        x = cmyk2rgb_sse2(out, in, xsize);
+#endif
+    for (in += x*4, out += x*4; x < xsize; x++, in += 4) {
         *out++ = CLIP(255 - (in[0] + in[3]));
 	*out++ = CLIP(255 - (in[1] + in[3]));
 	*out++ = CLIP(255 - (in[2] + in[3]));
@@ -633,6 +874,34 @@ static struct {
     { NULL }
 };
 
+/* converters, indexed by source and destination mode identifiers */
+static ImagingShuffler converter_table[IMAGING_MODES][IMAGING_MODES];
+
+void
+ImagingConvertInit(void)
+{
+    int i, from, to;
+
+    for (i = 0; converters[i].from; i++) {
+        from = ImagingModeId(converters[i].from);
+        to = ImagingModeId(converters[i].to);
+        if (from && to && !converter_table[from][to])
+            converter_table[from][to] = converters[i].convert;
+    }
+
+    ImagingConvertYCbCrInit();
+    ImagingDitherInit();
+}
+
+ImagingShuffler
+ImagingFindConverter(const char* from, const char* to)
+{
+    /* get line converter between two modes (NULL if not supported).
+       palette conversions are not included. */
+
+    return converter_table[ImagingModeId(from)][ImagingModeId(to)];
+}
+
 /* FIXME: translate indexed versions to pointer versions below this line */
 
 /* ------------------- */
@@ -689,8 +958,12 @@ p2f(UINT8* out_, const UINT8* in, int xsize, const UINT8* palette)
 static void
 p2rgb(UINT8* out, const UINT8* in, int xsize, const UINT8* palette)
 {
-    int x;
-    for (x = 0; x < xsize; x++) {
+    int x = 0;
+#if defined(USE_AVX2)
+    if (ImagingCpuFeatures() & IMAGING_CPU_AVX2)
+        x = p2rgba_avx2(out, in, xsize, palette, 1);
+#endif
+    for (in += x, out += x*4; x < xsize; x++) {
 	const UINT8* rgb = &palette[*in++ * 4];
 	*out++ = rgb[0];
 	*out++ = rgb[1];
@@ -702,8 +975,12 @@ p2rgb(UINT8* out, const UINT8* in, int xsize, const UINT8* palette)
 static void
 p2rgba(UINT8* out, const UINT8* in, int xsize, const UINT8* palette)
 {
-    int x;
-    for (x = 0; x < xsize; x++) {
+    int x = 0;
+#if defined(USE_AVX2)
+    if (ImagingCpuFeatures() & IMAGING_CPU_AVX2)
+        x = p2rgba_avx2(out, in, xsize, palette, 0);
+#endif
+    for (in += x, out += x*4; x < xsize; x++) {
 	const UINT8* rgba = &palette[*in++ * 4];
 	*out++ = rgba[0];
 	*out++ = rgba[1];
@@ -739,12 +1016,60 @@ p2ycbcr(UINT8* out, const UINT8* in, int xsize, const UINT8* palette)
     ImagingConvertRGB2YCbCr(out, out, xsize);
 }
 
+/* -------------------- */
+/* Conversion machinery */
+/* -------------------- */
+
+/* the converters have no state that carries over from one line to
+   the next, so the lines can be converted in parallel */
+
+struct convert_context {
+    Imaging imOut;
+    Imaging imIn;
+    ImagingShuffler convert;
+    void (*convert_palette)(UINT8*, const UINT8*, int, const UINT8*);
+};
+
+static void
+convert_lines(void* context, int start, int end)
+{
+    struct convert_context* ctx = context;
+    int y;
+
+    for (y = start; y < end; y++)
+	(*ctx->convert)((UINT8*) ctx->imOut->image[y],
+			(UINT8*) ctx->imIn->image[y], ctx->imIn->xsize);
+}
+
+static void
+palette_lines(void* context, int start, int end)
+{
+    struct convert_context* ctx = context;
+    int y;
+
+    for (y = start; y < end; y++)
+	(*ctx->convert_palette)((UINT8*) ctx->imOut->image[y],
+				(UINT8*) ctx->imIn->image[y],
+				ctx->imIn->xsize, ctx->imIn->palette->palette);
+}
+
+static void
+convert_parallel(struct convert_context* ctx)
+{
+    ImagingSectionCookie cookie;
+
+    ImagingSectionEnter(&cookie);
+    ImagingParallel((ctx->convert) ? convert_lines : palette_lines,
+		    ctx, ctx->imIn->ysize,
+		    CONVERT_GRAIN / (ctx->imIn->xsize + 1) + 1);
+    ImagingSectionLeave(&cookie);
+}
+
 static Imaging
 frompalette(Imaging imOut, Imaging imIn, const char *mode)
 {
-    ImagingSectionCookie cookie;
+    struct convert_context ctx;
     int alpha;
-    int y;
     void (*convert)(UINT8*, const UINT8*, int, const UINT8*);
 
     /* Map palette image to L, RGB, RGBA, or CMYK */
@@ -752,49 +1077,99 @@ frompalette(Imaging imOut, Imaging imIn, const char *mode)
     if (!imIn->palette)
 	return (Imaging) ImagingError_ValueError("no palette");
 
-    alpha = !strcmp(imIn->mode, "PA");
+    alpha = (imIn->modeid == IMAGING_MODE_PA);
 
-    if (strcmp(mode, "1") == 0)
+    switch (ImagingModeId(mode)) {
+    case IMAGING_MODE_1:
 	convert = p2bit;
-    else if (strcmp(mode, "L") == 0)
+	break;
+    case IMAGING_MODE_L:
 	convert = p2l;
-    else if (strcmp(mode, "LA") == 0)
+	break;
+    case IMAGING_MODE_LA:
 	convert = (alpha) ? pa2la : p2l;
-    else if (strcmp(mode, "I") == 0)
+	break;
+    case IMAGING_MODE_I:
 	convert = p2i;
-    else if (strcmp(mode, "F") == 0)
+	break;
+    case IMAGING_MODE_F:
 	convert = p2f;
-    else if (strcmp(mode, "RGB") == 0)
+	break;
+    case IMAGING_MODE_RGB:
 	convert = p2rgb;
-    else if (strcmp(mode, "RGBA") == 0)
+	break;
+    case IMAGING_MODE_RGBA:
 	convert = (alpha) ? pa2rgba : p2rgba;
-    else if (strcmp(mode, "RGBX") == 0)
+	break;
+    case IMAGING_MODE_RGBX:
 	convert = p2rgba;
-    else if (strcmp(mode, "CMYK") == 0)
+	break;
+    case IMAGING_MODE_CMYK:
 	convert = p2cmyk;
-    else if (strcmp(mode, "YCbCr") == 0)
+	break;
+    case IMAGING_MODE_YCbCr:
 	convert = p2ycbcr;
-    else
+	break;
+    default:
 	return (Imaging) ImagingError_ValueError("conversion not supported");
+    }
 
     imOut = ImagingNew2(mode, imOut, imIn);
     if (!imOut)
         return NULL;
 
-    ImagingSectionEnter(&cookie);
-    for (y = 0; y < imIn->ysize; y++)
-	(*convert)((UINT8*) imOut->image[y], (UINT8*) imIn->image[y],
-		   imIn->xsize, imIn->palette->palette);
-    ImagingSectionLeave(&cookie);
+    ctx.imOut = imOut;
+    ctx.imIn = imIn;
+    ctx.convert = NULL;
+    ctx.convert_palette = convert;
+    convert_parallel(&ctx);
 
     return imOut;
 }
 
+/* unlike error diffusion, ordered dithers don't carry anything over
+   from one pixel to the next, so the lines can be done in parallel */
+
+struct topalette_context {
+    Imaging imOut;
+    Imaging imIn;
+    ImagingPaletteIndex index;
+    const struct ImagingDitherMatrix* matrix; /* NULL for no dither */
+};
+
+static void
+topalette_lines(void* context, int start, int end)
+{
+    struct topalette_context* ctx = context;
+    const struct ImagingDitherMatrix* m = ctx->matrix;
+    const UINT8* row;
+    int x, y, o;
+
+    for (y = start; y < end; y++) {
+        UINT8* in  = (UINT8*) ctx->imIn->image[y];
+        UINT8* out = ctx->imOut->image8[y];
+        if (!m) {
+            for (x = 0; x < ctx->imIn->xsize; x++, in += 4)
+                out[x] = (UINT8) ImagingPaletteIndexLookup(
+                    ctx->index, in[0], in[1], in[2]);
+            continue;
+        }
+        /* offset each pixel by up to half the palette spacing */
+        row = m->threshold + (y & (m->size-1)) * m->width;
+        for (x = 0; x < ctx->imIn->xsize; x++, in += 4) {
+            o = ((2 * row[x & (m->width-1)] - 255) * ctx->index->spacing) / 512;
+            out[x] = (UINT8) ImagingPaletteIndexLookup(
+                ctx->index, CLIP(in[0] + o), CLIP(in[1] + o), CLIP(in[2] + o));
+        }
+    }
+}
+
 static Imaging
 topalette(Imaging imOut, Imaging imIn, ImagingPalette inpalette, int dither)
 {
     ImagingSectionCookie cookie;
     int x, y;
+    int owned = !imOut; /* don't delete the caller's image on errors */
     ImagingPalette palette = inpalette;;
 
     /* Map L or RGB/RGBX/RGBA to palette image */
@@ -834,21 +1209,31 @@ topalette(Imaging imOut, Imaging imIn, ImagingPalette inpalette, int dither)
     } else {
 	/* colour image */
 
-	/* Create mapping cache */
-	if (ImagingPaletteCachePrepare(palette) < 0) {
-	    ImagingDelete(imOut);
+	/* Get (possibly shared) nearest colour index */
+	ImagingPaletteIndex index = ImagingPaletteIndexGet(palette);
+	const struct ImagingDitherMatrix* matrix;
+	if (!index) {
+	    if (owned)
+		ImagingDelete(imOut);
 	    if (palette != inpalette)
 	      ImagingPaletteDelete(palette);
 	    return NULL;
 	}
 
-        if (dither) {
+	/* NULL for error diffusion, or no dither */
+	matrix = ImagingDitherGetMatrix(dither);
+
+        if (dither && !matrix) {
             /* floyd-steinberg dither */
 
             int* errors;
             errors = calloc(imIn->xsize + 1, sizeof(int) * 3);
             if (!errors) {
-                ImagingDelete(imOut);
+                ImagingPaletteIndexRelease(index);
+                if (owned)
+                    ImagingDelete(imOut);
+                if (palette != inpalette)
+                    ImagingPaletteDelete(palette);
                 return ImagingError_MemoryError();
             }
 
@@ -867,22 +1252,19 @@ topalette(Imaging imOut, Imaging imIn, ImagingPalette inpalette, int dither)
                 b = b0 = b1 = b2 = 0;
 
                 for (x = 0; x < imIn->xsize; x++, in += 4) {
-                    int d2;
-                    INT16* cache;
+                    int d2, c;
 
                     r = CLIP(in[0] + (r + e[3+0])/16);
                     g = CLIP(in[1] + (g + e[3+1])/16);
                     b = CLIP(in[2] + (b + e[3+2])/16);
 
                     /* get closest colour */
-                    cache = &ImagingPaletteCache(palette, r, g, b);
-                    if (cache[0] == 0x100)
-                        ImagingPaletteCacheUpdate(palette, r, g, b);
-                    out[x] = (UINT8) cache[0];
+                    c = ImagingPaletteIndexLookup(index, r, g, b);
+                    out[x] = (UINT8) c;
 
-                    r -= (int) palette->palette[cache[0]*4];
-                    g -= (int) palette->palette[cache[0]*4+1];
-                    b -= (int) palette->palette[cache[0]*4+2];
+                    r -= (int) palette->palette[c*4];
+                    g -= (int) palette->palette[c*4+1];
+                    b -= (int) palette->palette[c*4+2];
 
                     /* propagate errors (don't ask ;-) */
                     r2 = r; d2 = r + r; r += d2; e[0] = r + r0;
@@ -906,31 +1288,20 @@ topalette(Imaging imOut, Imaging imIn, ImagingPalette inpalette, int dither)
 
         } else {
 
-            /* closest colour */
+            /* closest colour, or ordered dither */
+            struct topalette_context ctx;
+            ctx.imOut = imOut;
+            ctx.imIn = imIn;
+            ctx.index = index;
+            ctx.matrix = matrix;
             ImagingSectionEnter(&cookie);
-            for (y = 0; y < imIn->ysize; y++) {
-                int r, g, b;
-                UINT8* in  = (UINT8*) imIn->image[y];
-                UINT8* out = imOut->image8[y];
-
-                for (x = 0; x < imIn->xsize; x++, in += 4) {
-                    INT16* cache;
-
-                    r = in[0]; g = in[1]; b = in[2];
-
-                    /* get closest colour */
-                    cache = &ImagingPaletteCache(palette, r, g, b);
-                    if (cache[0] == 0x100)
-                        ImagingPaletteCacheUpdate(palette, r, g, b);
-                    out[x] = (UINT8) cache[0];
-
-                }
-            }
+            ImagingParallel(topalette_lines, &ctx, imIn->ysize,
+                            CONVERT_GRAIN / (imIn->xsize * 4 + 1) + 1);
             ImagingSectionLeave(&cookie);
 
         }
-	if (inpalette != palette)
-	  ImagingPaletteCacheDelete(palette);
+
+        ImagingPaletteIndexRelease(index);
     }
 
     if (inpalette != palette)
@@ -939,24 +1310,90 @@ topalette(Imaging imOut, Imaging imIn, ImagingPalette inpalette, int dither)
     return imOut;
 }
 
+struct tobilevel_context {
+    Imaging imOut;
+    Imaging imIn;
+    const struct ImagingDitherMatrix* matrix;
+    int error;
+};
+
+static void
+tobilevel_lines(void* context, int start, int end)
+{
+    struct tobilevel_context* ctx = context;
+    const struct ImagingDitherMatrix* m = ctx->matrix;
+    Imaging imIn = ctx->imIn;
+    UINT8* grey = NULL;
+    const UINT8* row;
+    int x, y;
+
+    if (imIn->bands != 1) {
+        grey = malloc(imIn->xsize + 1);
+        if (!grey) {
+            ctx->error = 1;
+            return;
+        }
+    }
+
+    for (y = start; y < end; y++) {
+        UINT8* in  = (UINT8*) imIn->image[y];
+        UINT8* out = ctx->imOut->image8[y];
+        if (grey) {
+            rgb2l(grey, in, imIn->xsize);
+            in = grey;
+        }
+        row = m->threshold + (y & (m->size-1)) * m->width;
+        x = 0;
+#if defined(USE_SSE2)
+        if (HAVE_SSE2)
+            x = ordered_sse2(out, in, row, m->width, imIn->xsize);
+#endif
+        for (; x < imIn->xsize; x++)
+            out[x] = (in[x] > row[x & (m->width-1)]) ? 255 : 0;
+    }
+
+    free(grey);
+}
+
 static Imaging
 tobilevel(Imaging imOut, Imaging imIn, int dither)
 {
     ImagingSectionCookie cookie;
+    struct tobilevel_context ctx;
     int x, y;
     int* errors;
+    int owned = !imOut; /* don't delete the caller's image on errors */
 
     /* Map L or RGB to dithered 1 image */
-    if (strcmp(imIn->mode, "L") != 0 && strcmp(imIn->mode, "RGB") != 0)
+    if (imIn->modeid != IMAGING_MODE_L && imIn->modeid != IMAGING_MODE_RGB)
 	return (Imaging) ImagingError_ValueError("conversion not supported");
 
     imOut = ImagingNew2("1", imOut, imIn);
     if (!imOut)
         return NULL;
 
+    ctx.matrix = ImagingDitherGetMatrix(dither);
+    if (ctx.matrix) {
+        /* ordered dither */
+        ctx.imOut = imOut;
+        ctx.imIn = imIn;
+        ctx.error = 0;
+        ImagingSectionEnter(&cookie);
+        ImagingParallel(tobilevel_lines, &ctx, imIn->ysize,
+                        CONVERT_GRAIN / (imIn->xsize + 1) + 1);
+        ImagingSectionLeave(&cookie);
+        if (ctx.error) {
+            if (owned)
+                ImagingDelete(imOut);
+            return ImagingError_MemoryError();
+        }
+        return imOut;
+    }
+
     errors = calloc(imIn->xsize + 1, sizeof(int));
     if (!errors) {
-        ImagingDelete(imOut);
+        if (owned)
+            ImagingDelete(imOut);
         return ImagingError_MemoryError();
     }
 
@@ -1028,9 +1465,9 @@ static Imaging
 convert(Imaging imOut, Imaging imIn, const char *mode,
         ImagingPalette palette, int dither)
 {
-    ImagingSectionCookie cookie;
+    struct convert_context ctx;
     ImagingShuffler convert;
-    int y;
+    int id;
 
     if (!imIn)
 	return (Imaging) ImagingError_ModeError();
@@ -1040,34 +1477,30 @@ convert(Imaging imOut, Imaging imIn, const char *mode,
 	if (!imIn->palette)
 	    return (Imaging) ImagingError_ModeError();
 	mode = imIn->palette->mode;
-    } else
-	/* Same mode? */
-	if (!strcmp(imIn->mode, mode))
-	    return ImagingCopy2(imOut, imIn);
+    }
+
+    id = ImagingModeId(mode);
+
+    /* Same mode? */
+    if (imIn->modeid == id)
+	return ImagingCopy2(imOut, imIn);
 
 
     /* test for special conversions */
 
-    if (strcmp(imIn->mode, "P") == 0 || strcmp(imIn->mode, "PA") == 0)
+    if (imIn->modeid == IMAGING_MODE_P || imIn->modeid == IMAGING_MODE_PA)
 	return frompalette(imOut, imIn, mode);
     
-    if (strcmp(mode, "P") == 0)
+    if (id == IMAGING_MODE_P)
 	return topalette(imOut, imIn, palette, dither);
 
-    if (dither && strcmp(mode, "1") == 0)
+    if (dither && id == IMAGING_MODE_1)
 	return tobilevel(imOut, imIn, dither);
 
 
     /* standard conversion machinery */
 
-    convert = NULL;
-
-    for (y = 0; converters[y].from; y++)
-	if (!strcmp(imIn->mode, converters[y].from) &&
-	    !strcmp(mode, converters[y].to)) {
-	    convert = converters[y].convert;
-	    break;
-	}
+    convert = converter_table[imIn->modeid][id];
 
     if (!convert)
 #ifdef notdef
@@ -1085,11 +1518,11 @@ convert(Imaging imOut, Imaging imIn, const char *mode,
     if (!imOut)
         return NULL;
 
-    ImagingSectionEnter(&cookie);
-    for (y = 0; y < imIn->ysize; y++)
-	(*convert)((UINT8*) imOut->image[y], (UINT8*) imIn->image[y],
-		   imIn->xsize);
-    ImagingSectionLeave(&cookie);
+    ctx.imOut = imOut;
+    ctx.imIn = imIn;
+    ctx.convert = convert;
+    ctx.convert_palette = NULL;
+    convert_parallel(&ctx);
 
     return imOut;
 }
@@ -1098,35 +1531,50 @@ Imaging
 ImagingConvert(Imaging imIn, const char *mode,
                ImagingPalette palette, int dither)
 {
-    return convert(NULL, imIn, mode, palette, dither);
+    ImagingTraceCookie trace;
+    Imaging imOut;
+
+    ImagingTraceBegin(&trace, "convert");
+    imOut = convert(NULL, imIn, mode, palette, dither);
+    ImagingTraceEnd(&trace, imOut ? (long) imIn->xsize * imIn->ysize : 0);
+
+    return imOut;
 }
 
 Imaging
 ImagingConvert2(Imaging imOut, Imaging imIn)
 {
-    return convert(imOut, imIn, imOut->mode, NULL, 0);
+    ImagingTraceCookie trace;
+
+    ImagingTraceBegin(&trace, "convert");
+    imOut = convert(imOut, imIn, imOut->mode, NULL, 0);
+    ImagingTraceEnd(&trace, imOut ? (long) imIn->xsize * imIn->ysize : 0);
+
+    return imOut;
 }
 
 Imaging
 ImagingConvertInPlace(Imaging imIn, const char* mode)
 {
-    ImagingSectionCookie cookie;
+    struct convert_context ctx;
     ImagingShuffler convert;
-    int y;
 
     /* limited support for inplace conversion */
-    if (strcmp(imIn->mode, "L") == 0 && strcmp(mode, "1") == 0)
+    if (imIn->modeid == IMAGING_MODE_L && ImagingModeId(mode) == IMAGING_MODE_1)
         convert = l2bit;
-    else if (strcmp(imIn->mode, "1") == 0 && strcmp(mode, "L") == 0)
+    else if (imIn->modeid == IMAGING_MODE_1 &&
+             ImagingModeId(mode) == IMAGING_MODE_L)
         convert = bit2l;
     else
         return ImagingError_ModeError();
+
+    if (ImagingDetach(imIn) < 0)
+        return NULL;
     
-    ImagingSectionEnter(&cookie);
-    for (y = 0; y < imIn->ysize; y++)
-	(*convert)((UINT8*) imIn->image[y], (UINT8*) imIn->image[y],
-                   imIn->xsize);
-    ImagingSectionLeave(&cookie);
+    ctx.imOut = ctx.imIn = imIn;
+    ctx.convert = convert;
+    ctx.convert_palette = NULL;
+    convert_parallel(&ctx);
 
     return imIn;
 }
@@ -14,6 +14,11 @@
 
 #include "Imaging.h"
 
+#if defined(__SSE2__) || defined(_M_X64)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+
 /*  JPEG/JFIF YCbCr conversions
 
     Y  = R *  0.29900 + G *  0.58700 + B *  0.11400
@@ -333,6 +338,107 @@ static INT16 B_Cb[] = { -14515, -14402, -14288, -14175, -14062,
 12361, 12475, 12588, 12702, 12815, 12929, 13042, 13155, 13269, 13382,
 13496, 13609, 13722, 13836, 13949, 14063, 14176, 14289, 14403 };
 
+#if defined(USE_SSE2)
+
+/* the vectorized versions look up all three contributions of a
+   component at once, from interleaved copies of the tables above, and
+   add them up in 16 bits.  the sums never overflow, so the results are
+   identical to the portable code. */
+
+static INT16 rgb_tables[3][256][4]; /* Y, Cb, Cr for R, G and B */
+static INT16 ycc_tables[2][256][4]; /* R, G, B for Cb and Cr */
+
+#define LOOKUP(table, i) _mm_loadl_epi64((__m128i*) (table)[i])
+
+static int
+rgb2ycbcr_sse2(UINT8* out, const UINT8* in, int pixels)
+{
+    __m128i offset = _mm_set_epi16(0, 128, 128, 0, 0, 128, 128, 0);
+    __m128i alpha = _mm_slli_epi32(_mm_set1_epi32(0xff), 24);
+    __m128i v[2], a, b;
+    int x, i;
+
+    for (x = 0; x + 4 <= pixels; x += 4, in += 16, out += 16) {
+        for (i = 0; i < 2; i++) {
+            const UINT8* p = in + i*8;
+            a = _mm_add_epi16(_mm_add_epi16(LOOKUP(rgb_tables[0], p[0]),
+                                            LOOKUP(rgb_tables[1], p[1])),
+                              LOOKUP(rgb_tables[2], p[2]));
+            b = _mm_add_epi16(_mm_add_epi16(LOOKUP(rgb_tables[0], p[4]),
+                                            LOOKUP(rgb_tables[1], p[5])),
+                              LOOKUP(rgb_tables[2], p[6]));
+            a = _mm_srai_epi16(_mm_unpacklo_epi64(a, b), SCALE);
+            v[i] = _mm_add_epi16(a, offset);
+        }
+        /* the alpha bytes are copied as is */
+        a = _mm_and_si128(_mm_loadu_si128((__m128i*) in), alpha);
+        a = _mm_or_si128(_mm_packus_epi16(v[0], v[1]), a);
+        _mm_storeu_si128((__m128i*) out, a);
+    }
+
+    return x;
+}
+
+static int
+ycbcr2rgb_sse2(UINT8* out, const UINT8* in, int pixels)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i alpha = _mm_slli_epi32(_mm_set1_epi32(0xff), 24);
+    __m128i v[2], a, b, y;
+    int x, i;
+
+    for (x = 0; x + 4 <= pixels; x += 4, in += 16, out += 16) {
+        y = _mm_and_si128(_mm_loadu_si128((__m128i*) in),
+                          _mm_set1_epi32(0xff));
+        for (i = 0; i < 2; i++) {
+            const UINT8* p = in + i*8;
+            a = _mm_add_epi16(LOOKUP(ycc_tables[0], p[1]),
+                              LOOKUP(ycc_tables[1], p[2]));
+            b = _mm_add_epi16(LOOKUP(ycc_tables[0], p[5]),
+                              LOOKUP(ycc_tables[1], p[6]));
+            a = _mm_srai_epi16(_mm_unpacklo_epi64(a, b), SCALE);
+            /* y, y, y, 0 for each of the two pixels */
+            b = (i == 0) ? _mm_unpacklo_epi32(y, zero) :
+                           _mm_unpackhi_epi32(y, zero);
+            b = _mm_shufflelo_epi16(b, _MM_SHUFFLE(1, 0, 0, 0));
+            b = _mm_shufflehi_epi16(b, _MM_SHUFFLE(1, 0, 0, 0));
+            /* packing clips to 0..255 */
+            v[i] = _mm_add_epi16(a, b);
+        }
+        a = _mm_and_si128(_mm_loadu_si128((__m128i*) in), alpha);
+        a = _mm_or_si128(_mm_packus_epi16(v[0], v[1]), a);
+        _mm_storeu_si128((__m128i*) out, a);
+    }
+
+    return x;
+}
+
+#endif
+
+void
+ImagingConvertYCbCrInit(void)
+{
+#if defined(USE_SSE2)
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        rgb_tables[0][i][0] = Y_R[i];
+        rgb_tables[0][i][1] = Cb_R[i];
+        rgb_tables[0][i][2] = Cr_R[i];
+        rgb_tables[1][i][0] = Y_G[i];
+        rgb_tables[1][i][1] = Cb_G[i];
+        rgb_tables[1][i][2] = Cr_G[i];
+        rgb_tables[2][i][0] = Y_B[i];
+        rgb_tables[2][i][1] = Cb_B[i];
+        rgb_tables[2][i][2] = Cr_B[i];
+        ycc_tables[0][i][1] = G_Cb[i];
+        ycc_tables[0][i][2] = B_Cb[i];
+        ycc_tables[1][i][0] = R_Cr[i];
+        ycc_tables[1][i][1] = G_Cr[i];
+    }
+#endif
+}
+
 
 void
 ImagingConvertRGB2YCbCr(UINT8* out, const UINT8* in, int pixels)
@@ -342,7 +448,16 @@ ImagingConvertRGB2YCbCr(UINT8* out, const UINT8* in, int pixels)
     int r, g, b;
     int y, cr, cb;
 
-    for (x = 0; x < pixels; x++, in +=4, out += 4) {
+    x = 0;
+#if defined(USE_SSE2)
+    if (ImagingCpuFeatures() & IMAGING_CPU_SSE2) {
+        x = rgb2ycbcr_sse2(out, in, pixels);
+        in += x*4;
+        out += x*4;
+    }
+#endif
+
+    for (; x < pixels; x++, in +=4, out += 4) {
 
         r = in[0];
         g = in[1];
@@ -368,7 +483,16 @@ ImagingConvertYCbCr2RGB(UINT8* out, const UINT8* in, int pixels)
     int r, g, b;
     int y, cr, cb;
 
-    for (x = 0; x < pixels; x++, in += 4, out += 4) {
+    x = 0;
+#if defined(USE_SSE2)
+    if (ImagingCpuFeatures() & IMAGING_CPU_SSE2) {
+        x = ycbcr2rgb_sse2(out, in, pixels);
+        in += x*4;
+        out += x*4;
+    }
+#endif
+
+    for (; x < pixels; x++, in += 4, out += 4) {
 
         y = in[0];
         cb = in[1];
@@ -28,6 +28,9 @@ _copy(Imaging imOut, Imaging imIn)
     if (!imIn)
 	return (Imaging) ImagingError_ValueError(NULL);
 
+    if (imOut == imIn)
+        return imOut;
+
     imOut = ImagingNew2(imIn->mode, imOut, imIn);
     if (!imOut)
         return NULL;
@@ -35,8 +38,9 @@ _copy(Imaging imOut, Imaging imIn)
     ImagingCopyInfo(imOut, imIn);
 
     ImagingSectionEnter(&cookie);
-    if (imIn->block != NULL && imOut->block != NULL)
-	memcpy(imOut->block, imIn->block, imIn->ysize * imIn->linesize);
+    if (imIn->block != NULL && imOut->block != NULL &&
+        imIn->stride == imOut->stride)
+	memcpy(imOut->block, imIn->block, imIn->ysize * imIn->stride);
     else
         for (y = 0; y < imIn->ysize; y++)
             memcpy(imOut->image[y], imIn->image[y], imIn->linesize);
@@ -48,6 +52,18 @@ _copy(Imaging imOut, Imaging imIn)
 Imaging
 ImagingCopy(Imaging imIn)
 {
+    Imaging imOut;
+
+    /* share the lines if we can; they're copied on the first write */
+    if (imIn) {
+        imOut = ImagingNewShared(imIn, 0, 0, imIn->xsize, imIn->ysize);
+        if (imOut) {
+            ImagingCopyInfo(imOut, imIn);
+            return imOut;
+        }
+        ImagingError_Clear();
+    }
+
     return _copy(NULL, imIn);
 }
 
@@ -0,0 +1,54 @@
+/*
+ * The Python Imaging Library
+ * $Id$
+ *
+ * run-time processor feature detection
+ *
+ * Primitives that have vectorized (SIMD) versions call this to pick
+ * the variant to use.  The vectorized code must produce exactly the
+ * same result as the portable version.
+ *
+ * See the README file for information on usage and redistribution.
+ */
+
+
+#include "Imaging.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__clang__) || (defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8)))
+#define HAVE_CPU_SUPPORTS
+#endif
+#endif
+
+static int features = -1;
+static int mask = -1;
+
+int
+ImagingCpuFeatures(void)
+{
+    if (features < 0) {
+        int f = 0;
+#if defined(HAVE_CPU_SUPPORTS)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2"))
+            f |= IMAGING_CPU_SSE2;
+        if (__builtin_cpu_supports("avx2"))
+            f |= IMAGING_CPU_AVX2;
+#elif defined(_M_X64)
+        f |= IMAGING_CPU_SSE2;
+#endif
+        features = f;
+    }
+    return features & mask;
+}
+
+int
+ImagingSetCpuFeatures(int new_mask)
+{
+    /* restrict the set of features in use (for testing).  returns
+       the old mask. */
+    int old = mask;
+    mask = new_mask;
+    return old;
+}
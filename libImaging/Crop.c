@@ -37,6 +37,17 @@ ImagingCrop(Imaging imIn, int sx0, int sy0, int sx1, int sy1)
     if (ysize < 0)
         ysize = 0;
 
+    /* regions inside the image share the lines with the source; they
+       are copied on the first write */
+    if (sx0 >= 0 && sy0 >= 0 && sx1 <= imIn->xsize && sy1 <= imIn->ysize) {
+        imOut = ImagingNewShared(imIn, sx0, sy0, xsize, ysize);
+        if (imOut) {
+            ImagingCopyInfo(imOut, imIn);
+            return imOut;
+        }
+        ImagingError_Clear();
+    }
+
     imOut = ImagingNew(imIn->mode, xsize, ysize);
     if (!imOut)
 	return NULL;
@@ -0,0 +1,218 @@
+/*
+ * The Python Imaging Library
+ * $Id$
+ *
+ * threshold matrices for ordered dithering
+ *
+ * Each matrix holds a threshold (0..255) for each position in a
+ * size x size tile.  A pixel with value v at (x, y) is set if v is
+ * larger than the threshold at (x % size, y % size).  Rows are
+ * repeated up to a width of at least 16 entries, so that vectorized
+ * code can fetch 16 thresholds in one go; use x % width to index a
+ * row.
+ *
+ * The Bayer matrices are the usual recursive dispersed-dot patterns.
+ * The blue noise matrix is built with the void-and-cluster method
+ * (after Ulichney), which gives a pattern without any low-frequency
+ * structure.  Call ImagingDitherInit once before using the matrices.
+ *
+ * See the README file for information on usage and redistribution.
+ */
+
+
+#include "Imaging.h"
+
+#include <math.h>
+
+#define	NOISE_SIZE	32
+#define	NOISE_SIGMA	1.5
+
+static UINT8 bayer4[4*16];
+static UINT8 bayer8[8*16];
+static UINT8 noise[NOISE_SIZE*NOISE_SIZE];
+
+static const struct ImagingDitherMatrix matrices[] = {
+    { IMAGING_DITHER_ORDERED, 8, 16, bayer8 },
+    { IMAGING_DITHER_BAYER4, 4, 16, bayer4 },
+    { IMAGING_DITHER_BLUENOISE, NOISE_SIZE, NOISE_SIZE, noise },
+    { 0 }
+};
+
+static void
+fill(UINT8* table, const int* rank, int size, int width)
+{
+    /* convert ranks to thresholds, centered in each step */
+
+    int x, y, n = size*size;
+
+    for (y = 0; y < size; y++)
+        for (x = 0; x < width; x++)
+            table[y*width + x] = (UINT8)
+                (((2 * rank[y*size + x % size] + 1) * 128) / n);
+}
+
+static void
+bayer(int* rank, int size)
+{
+    /* recursive Bayer matrix (M2n = [4Mn 4Mn+2; 4Mn+3 4Mn+1]) */
+
+    int x, y, s;
+
+    rank[0] = 0;
+
+    for (s = 1; s < size; s *= 2)
+        for (y = 0; y < s; y++)
+            for (x = 0; x < s; x++) {
+                int r = 4 * rank[y*size + x];
+                rank[y*size + x] = r;
+                rank[y*size + x+s] = r + 2;
+                rank[(y+s)*size + x] = r + 3;
+                rank[(y+s)*size + x+s] = r + 1;
+            }
+}
+
+/* void-and-cluster.  the energy of each position is the sum of a
+   gaussian (wrapping around the tile edges) centered on each set
+   position.  integer weights make the result the same everywhere. */
+
+static int weight[NOISE_SIZE*NOISE_SIZE];
+
+static void
+update(int* energy, int p, int sign)
+{
+    int x, y, dx, dy;
+    int px = p % NOISE_SIZE, py = p / NOISE_SIZE;
+
+    for (y = 0; y < NOISE_SIZE; y++) {
+        dy = (y - py) & (NOISE_SIZE-1);
+        for (x = 0; x < NOISE_SIZE; x++) {
+            dx = (x - px) & (NOISE_SIZE-1);
+            energy[y*NOISE_SIZE + x] += sign * weight[dy*NOISE_SIZE + dx];
+        }
+    }
+}
+
+static int
+cluster(const int* energy, const UINT8* pattern)
+{
+    /* tightest cluster: set position with the highest energy */
+
+    int i, best = -1;
+
+    for (i = 0; i < NOISE_SIZE*NOISE_SIZE; i++)
+        if (pattern[i] && (best < 0 || energy[i] > energy[best]))
+            best = i;
+
+    return best;
+}
+
+static int
+largest_void(const int* energy, const UINT8* pattern)
+{
+    /* largest void: unset position with the lowest energy */
+
+    int i, best = -1;
+
+    for (i = 0; i < NOISE_SIZE*NOISE_SIZE; i++)
+        if (!pattern[i] && (best < 0 || energy[i] < energy[best]))
+            best = i;
+
+    return best;
+}
+
+static void
+bluenoise(int* rank)
+{
+    int n = NOISE_SIZE*NOISE_SIZE;
+    int energy[NOISE_SIZE*NOISE_SIZE], saved[NOISE_SIZE*NOISE_SIZE];
+    UINT8 pattern[NOISE_SIZE*NOISE_SIZE], initial[NOISE_SIZE*NOISE_SIZE];
+    int x, y, dx, dy, i, p, ones, r;
+    UINT32 seed = 1;
+
+    for (y = 0; y < NOISE_SIZE; y++)
+        for (x = 0; x < NOISE_SIZE; x++) {
+            dx = (x < NOISE_SIZE - x) ? x : NOISE_SIZE - x;
+            dy = (y < NOISE_SIZE - y) ? y : NOISE_SIZE - y;
+            weight[y*NOISE_SIZE + x] = (int) (65536.0 * exp(
+                -(dx*dx + dy*dy) / (2 * NOISE_SIGMA * NOISE_SIGMA)) + 0.5);
+        }
+
+    memset(energy, 0, sizeof(energy));
+    memset(pattern, 0, sizeof(pattern));
+
+    /* random initial pattern, with a tenth of the positions set */
+    for (ones = 0; ones < n / 10; ) {
+        seed = seed * 1103515245 + 12345;
+        p = (seed >> 16) % n;
+        if (!pattern[p]) {
+            pattern[p] = 1;
+            update(energy, p, 1);
+            ones++;
+        }
+    }
+
+    /* spread it out, by moving points from the tightest cluster to
+       the largest void until that doesn't change anything */
+    for (i = 0; i < n; i++) {
+        p = cluster(energy, pattern);
+        pattern[p] = 0;
+        update(energy, p, -1);
+        r = largest_void(energy, pattern);
+        pattern[r] = 1;
+        update(energy, r, 1);
+        if (r == p)
+            break;
+    }
+
+    memcpy(initial, pattern, sizeof(pattern));
+    memcpy(saved, energy, sizeof(energy));
+
+    /* rank the initial points, removing tightest clusters first */
+    for (r = ones - 1; r >= 0; r--) {
+        p = cluster(energy, pattern);
+        pattern[p] = 0;
+        update(energy, p, -1);
+        rank[p] = r;
+    }
+
+    /* rank the remaining positions, filling the largest voids
+       first */
+    memcpy(pattern, initial, sizeof(pattern));
+    memcpy(energy, saved, sizeof(energy));
+    for (r = ones; r < n; r++) {
+        p = largest_void(energy, pattern);
+        pattern[p] = 1;
+        update(energy, p, 1);
+        rank[p] = r;
+    }
+}
+
+void
+ImagingDitherInit(void)
+{
+    int rank[NOISE_SIZE*NOISE_SIZE];
+
+    bayer(rank, 4);
+    fill(bayer4, rank, 4, 16);
+
+    bayer(rank, 8);
+    fill(bayer8, rank, 8, 16);
+
+    bluenoise(rank);
+    fill(noise, rank, NOISE_SIZE, NOISE_SIZE);
+}
+
+const struct ImagingDitherMatrix*
+ImagingDitherGetMatrix(int dither)
+{
+    /* get threshold matrix for an ordered dither method (NULL for
+       other methods) */
+
+    int i;
+
+    for (i = 0; matrices[i].size; i++)
+        if (matrices[i].dither == dither)
+            return &matrices[i];
+
+    return NULL;
+}
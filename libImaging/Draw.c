@@ -622,6 +622,8 @@ DRAW draw32rgba = { point32rgba, hline32rgba, line32rgba, polygon32rgba };
 /* -------------------------------------------------------------------- */
 
 #define DRAWINIT()\
+    if (ImagingDetach(im) < 0)\
+        return -1;\
     if (im->image8) {\
         draw = &draw8;\
         ink = INK8(ink_);\
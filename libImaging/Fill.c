@@ -25,6 +25,9 @@ ImagingFill(Imaging im, const void* colour)
 {
     int x, y;
 
+    if (ImagingDetach(im) < 0)
+        return NULL;
+
     if (im->type == IMAGING_TYPE_SPECIAL) {
         /* use generic API */
         ImagingAccess access = ImagingAccessNew(im);
@@ -19,13 +19,14 @@
  */
 
 /*
- * FIXME: Support RGB and RGBA/CMYK modes as well
  * FIXME: Expand image border (current version leaves border as is)
  * FIXME: Implement image processing gradient filters
  */
 
 #include "Imaging.h"
 
+#include <math.h>
+
 Imaging
 ImagingExpand(Imaging imIn, int xmargin, int ymargin, int mode)
 {
@@ -71,109 +72,306 @@ ImagingExpand(Imaging imIn, int xmargin, int ymargin, int mode)
     return imOut;
 }
 
-Imaging
-ImagingFilter(Imaging im, int xsize, int ysize, const FLOAT32* kernel,
-              FLOAT32 offset, FLOAT32 divisor)
-{
+/* kernels are applied line by line.  the source lines needed for an
+   output line are kept in a small ring buffer, as double precision
+   samples (separable kernels store the result of the horizontal pass
+   instead).  for 8-bit images with more than one band, each byte of
+   the pixel is treated as a separate sample.  the border (half the
+   kernel size) is copied from the source image. */
+
+struct filter_context {
+    Imaging im;
     Imaging imOut;
-    int x, y;
-    FLOAT32 sum;
+    int xsize, ysize;		/* kernel size */
+    const FLOAT32* kernel;
+    double* row;		/* separable kernels only */
+    double* col;
+    double offset, divisor;
+    int error;
+};
+
+static void
+load_line(Imaging im, int y, double* out)
+{
+    int x;
+    if (im->type == IMAGING_TYPE_UINT8) {
+	UINT8* in = (UINT8*) im->image[y];
+	for (x = 0; x < im->linesize; x++)
+	    out[x] = in[x];
+    } else if (im->type == IMAGING_TYPE_INT32) {
+	INT32* in = im->image32[y];
+	for (x = 0; x < im->xsize; x++)
+	    out[x] = in[x];
+    } else {
+	FLOAT32* in = (FLOAT32*) im->image32[y];
+	for (x = 0; x < im->xsize; x++)
+	    out[x] = in[x];
+    }
+}
+
+static void
+store_line(Imaging imOut, Imaging im, int y, double* in, int x0, int x1,
+	   double offset, double divisor)
+{
+    /* store samples x0 to x1, and copy the rest from im */
+
+    double v;
+    int x;
+
+    memcpy(imOut->image[y], im->image[y], im->linesize);
+
+    if (im->type == IMAGING_TYPE_UINT8) {
+	UINT8* out = (UINT8*) imOut->image[y];
+	for (x = x0; x < x1; x++) {
+	    v = in[x] / divisor + offset;
+	    if (v <= 0)
+		out[x] = 0;
+	    else if (v >= 255)
+		out[x] = 255;
+	    else
+		out[x] = (UINT8) v;
+	}
+    } else if (im->type == IMAGING_TYPE_INT32) {
+	INT32* out = imOut->image32[y];
+	for (x = x0; x < x1; x++) {
+	    v = in[x] / divisor + offset;
+	    if (v <= -2147483648.0)
+		out[x] = -2147483647 - 1;
+	    else if (v >= 2147483647.0)
+		out[x] = 2147483647;
+	    else
+		out[x] = (INT32) floor(v + 0.5);
+	}
+    } else {
+	FLOAT32* out = (FLOAT32*) imOut->image32[y];
+	for (x = x0; x < x1; x++)
+	    out[x] = (FLOAT32) (in[x] / divisor + offset);
+    }
+}
+
+static void
+filter_lines(void* context, int start, int end)
+{
+    /* output lines start to end, counting from the first line that
+       has the full kernel inside the image */
+
+    struct filter_context* ctx = context;
+    Imaging im = ctx->im;
+    int xr = ctx->xsize / 2, yr = ctx->ysize / 2;
+    int step, samples, x0, x1;
+    int x, y, kx, ky, next, off;
+    double *ring, *line, *acc, *in, *out;
+    double w;
+
+    /* samples per line, and distance between adjacent pixels */
+    if (im->type == IMAGING_TYPE_UINT8) {
+	step = im->pixelsize;
+	samples = im->linesize;
+    } else {
+	step = 1;
+	samples = im->xsize;
+    }
+    x0 = xr * step;
+    x1 = samples - xr * step;
+
+    ring = malloc(ctx->ysize * samples * sizeof(double));
+    line = malloc(samples * sizeof(double));
+    acc = malloc(samples * sizeof(double));
+    if (!ring || !line || !acc) {
+	ctx->error = 1;
+	goto done;
+    }
+
+#define	RING(y) (ring + ((y) % ctx->ysize) * samples)
+
+    next = start;
+
+    for (y = start + yr; y < end + yr; y++) {
 
-    if (!im || strcmp(im->mode, "L") != 0)
+	/* make sure lines y-yr to y+yr are in the ring buffer */
+	for (; next <= y + yr; next++) {
+	    if (!ctx->row) {
+		load_line(im, next, RING(next));
+		continue;
+	    }
+	    /* horizontal pass */
+	    load_line(im, next, line);
+	    out = RING(next);
+	    for (x = x0; x < x1; x++)
+		out[x] = 0.0;
+	    for (kx = 0; kx < ctx->xsize; kx++) {
+		w = ctx->row[kx];
+		in = line + (kx - xr) * step;
+		for (x = x0; x < x1; x++)
+		    out[x] += in[x] * w;
+	    }
+	}
+
+	for (x = x0; x < x1; x++)
+	    acc[x] = 0.0;
+
+	/* the first kernel line applies to the line below y */
+	for (ky = 0; ky < ctx->ysize; ky++) {
+	    if (ctx->col) {
+		w = ctx->col[ky];
+		in = RING(y + yr - ky);
+		for (x = x0; x < x1; x++)
+		    acc[x] += in[x] * w;
+	    } else
+		for (kx = 0; kx < ctx->xsize; kx++) {
+		    w = ctx->kernel[ky * ctx->xsize + kx];
+		    off = (kx - xr) * step;
+		    in = RING(y + yr - ky) + off;
+		    for (x = x0; x < x1; x++)
+			acc[x] += in[x] * w;
+		}
+	}
+
+	store_line(ctx->imOut, im, y, acc, x0, x1, ctx->offset, ctx->divisor);
+    }
+
+#undef RING
+
+  done:
+    free(ring);
+    free(line);
+    free(acc);
+}
+
+static int
+separate(struct filter_context* ctx)
+{
+    /* if the kernel is an outer product of a column and a row vector
+       (so that the products reproduce it exactly), set up a two-pass
+       filter.  returns -1 if out of memory. */
+
+    const FLOAT32* k = ctx->kernel;
+    int xsize = ctx->xsize, ysize = ctx->ysize;
+    int i, j, p = 0;
+
+    ctx->row = ctx->col = NULL;
+
+    /* not worth it */
+    if (xsize * ysize <= xsize + ysize)
+	return 0;
+
+    /* pivot on the largest coefficient */
+    for (i = 1; i < xsize * ysize; i++)
+	if (fabs(k[i]) > fabs(k[p]))
+	    p = i;
+    if (k[p] == 0.0)
+	return 0;
+
+    ctx->row = malloc(xsize * sizeof(double));
+    ctx->col = malloc(ysize * sizeof(double));
+    if (!ctx->row || !ctx->col) {
+	free(ctx->row);
+	free(ctx->col);
+	ctx->row = ctx->col = NULL;
+	return -1;
+    }
+
+    for (j = 0; j < xsize; j++)
+	ctx->row[j] = k[(p / xsize) * xsize + j];
+    for (i = 0; i < ysize; i++)
+	ctx->col[i] = (double) k[i * xsize + p % xsize] / k[p];
+
+    for (i = 0; i < ysize; i++)
+	for (j = 0; j < xsize; j++)
+	    if (ctx->col[i] * ctx->row[j] != k[i * xsize + j]) {
+		free(ctx->row);
+		free(ctx->col);
+		ctx->row = ctx->col = NULL;
+		return 0;
+	    }
+
+    return 1;
+}
+
+static Imaging
+filter_image(Imaging imOut, Imaging im, int xsize, int ysize,
+             const FLOAT32* kernel, FLOAT32 offset, FLOAT32 divisor)
+{
+    ImagingSectionCookie cookie;
+    struct filter_context ctx;
+    int created = (imOut == NULL);
+    int y, lines;
+
+    if (!im || im->type == IMAGING_TYPE_SPECIAL ||
+	im->modeid == IMAGING_MODE_1 || im->modeid == IMAGING_MODE_P)
 	return (Imaging) ImagingError_ModeError();
 
+    if (imOut == im)
+	return (Imaging) ImagingError_ValueError("cannot filter in place");
+
     if (im->xsize < xsize || im->ysize < ysize)
-        return ImagingCopy(im);
+        return (imOut) ? ImagingCopy2(imOut, im) : ImagingCopy(im);
 
-    if ((xsize != 3 && xsize != 5) || xsize != ysize)
+    if (xsize < 1 || ysize < 1 || !(xsize & 1) || !(ysize & 1))
 	return (Imaging) ImagingError_ValueError("bad kernel size");
 
-    imOut = ImagingNew(im->mode, im->xsize, im->ysize);
+    imOut = ImagingNew2(im->mode, imOut, im);
     if (!imOut)
 	return NULL;
 
-    /* brute force kernel implementations */
-#define	KERNEL3x3(image, kernel, d) ( \
-    (int) image[y+1][x-d] * kernel[0] + \
-    (int) image[y+1][x]   * kernel[1] + \
-    (int) image[y+1][x+d] * kernel[2] + \
-    (int) image[y][x-d]   * kernel[3] + \
-    (int) image[y][x]     * kernel[4] + \
-    (int) image[y][x+d]   * kernel[5] + \
-    (int) image[y-1][x-d] * kernel[6] + \
-    (int) image[y-1][x]   * kernel[7] + \
-    (int) image[y-1][x+d] * kernel[8])
-
-#define	KERNEL5x5(image, kernel, d) ( \
-    (int) image[y+2][x-d-d] * kernel[0] + \
-    (int) image[y+2][x-d]   * kernel[1] + \
-    (int) image[y+2][x]     * kernel[2] + \
-    (int) image[y+2][x+d]   * kernel[3] + \
-    (int) image[y+2][x+d+d] * kernel[4] + \
-    (int) image[y+1][x-d-d] * kernel[5] + \
-    (int) image[y+1][x-d]   * kernel[6] + \
-    (int) image[y+1][x]     * kernel[7] + \
-    (int) image[y+1][x+d]   * kernel[8] + \
-    (int) image[y+1][x+d+d] * kernel[9] + \
-    (int) image[y][x-d-d]   * kernel[10] + \
-    (int) image[y][x-d]     * kernel[11] + \
-    (int) image[y][x]       * kernel[12] + \
-    (int) image[y][x+d]     * kernel[13] + \
-    (int) image[y][x+d+d]   * kernel[14] + \
-    (int) image[y-1][x-d-d] * kernel[15] + \
-    (int) image[y-1][x-d]   * kernel[16] + \
-    (int) image[y-1][x]     * kernel[17] + \
-    (int) image[y-1][x+d]   * kernel[18] + \
-    (int) image[y-1][x+d+d] * kernel[19] + \
-    (int) image[y-2][x-d-d] * kernel[20] + \
-    (int) image[y-2][x-d]   * kernel[21] + \
-    (int) image[y-2][x]     * kernel[22] + \
-    (int) image[y-2][x+d]   * kernel[23] + \
-    (int) image[y-2][x+d+d] * kernel[24])
-
-    if (xsize == 3) {
-	/* 3x3 kernel. */
-	for (x = 0; x < im->xsize; x++)
-	    imOut->image[0][x] = im->image8[0][x];
-	for (y = 1; y < im->ysize-1; y++) {
-	    imOut->image[y][0] = im->image8[y][0];
-	    for (x = 1; x < im->xsize-1; x++) {
-		sum = KERNEL3x3(im->image8, kernel, 1) / divisor + offset;
-		if (sum <= 0)
-		    imOut->image8[y][x] = 0;
-		else if (sum >= 255)
-		    imOut->image8[y][x] = 255;
-		else
-		    imOut->image8[y][x] = (UINT8) sum;
-	     }
-	    imOut->image8[y][x] = im->image8[y][x];
-	}
-	for (x = 0; x < im->xsize; x++)
-	    imOut->image8[y][x] = im->image8[y][x];
-    } else {
-	/* 5x5 kernel. */
-	for (y = 0; y < 2; y++)
-	    for (x = 0; x < im->xsize; x++)
-		imOut->image8[y][x] = im->image8[y][x];
-	for (; y < im->ysize-2; y++) {
-	    for (x = 0; x < 2; x++)
-		imOut->image8[y][x] = im->image8[y][x];
-	    for (; x < im->xsize-2; x++) {
-		sum = KERNEL5x5(im->image8, kernel, 1) / divisor + offset;
-		if (sum <= 0)
-		    imOut->image8[y][x] = 0;
-		else if (sum >= 255)
-		    imOut->image8[y][x] = 255;
-		else
-		    imOut->image8[y][x] = (UINT8) sum;
-	    }
-	    for (; x < im->xsize; x++)
-		imOut->image8[y][x] = im->image8[y][x];
-	}
-	for (; y < im->ysize; y++)
-	    for (x = 0; x < im->xsize; x++)
-		imOut->image8[y][x] = im->image8[y][x];
+    ctx.im = im;
+    ctx.imOut = imOut;
+    ctx.xsize = xsize;
+    ctx.ysize = ysize;
+    ctx.kernel = kernel;
+    ctx.offset = offset;
+    ctx.divisor = divisor;
+    ctx.error = 0;
+
+    if (separate(&ctx) < 0) {
+	if (created)
+	    ImagingDelete(imOut);
+	return (Imaging) ImagingError_MemoryError();
+    }
+
+    ImagingSectionEnter(&cookie);
+
+    /* top and bottom borders */
+    for (y = 0; y < ysize / 2; y++) {
+	memcpy(imOut->image[y], im->image[y], im->linesize);
+	memcpy(imOut->image[im->ysize-1-y], im->image[im->ysize-1-y],
+	       im->linesize);
     }
+
+    lines = im->ysize - (ysize / 2) * 2;
+    ImagingParallel(filter_lines, &ctx, lines,
+		    65536 / (im->xsize * xsize * ysize + 1) + 1);
+
+    ImagingSectionLeave(&cookie);
+
+    free(ctx.row);
+    free(ctx.col);
+
+    if (ctx.error) {
+	if (created)
+	    ImagingDelete(imOut);
+	return (Imaging) ImagingError_MemoryError();
+    }
+
+    return imOut;
+}
+
+Imaging
+ImagingFilter2(Imaging imOut, Imaging im, int xsize, int ysize,
+               const FLOAT32* kernel, FLOAT32 offset, FLOAT32 divisor)
+{
+    ImagingTraceCookie trace;
+
+    ImagingTraceBegin(&trace, "filter");
+    imOut = filter_image(imOut, im, xsize, ysize, kernel, offset, divisor);
+    ImagingTraceEnd(&trace, imOut ? (long) imOut->xsize * imOut->ysize : 0);
+
     return imOut;
 }
 
+Imaging
+ImagingFilter(Imaging im, int xsize, int ysize, const FLOAT32* kernel,
+              FLOAT32 offset, FLOAT32 divisor)
+{
+    return ImagingFilter2(NULL, im, xsize, ysize, kernel, offset, divisor);
+}
@@ -30,6 +30,14 @@
 /* Undef if you don't need resampling filters */
 #define WITH_FILTERS
 
+/* work is split into bands of at least this many pixels */
+#define TRANSFORM_GRAIN 16384
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+
 #define COORD(v) ((v) < 0.0 ? -1 : ((int)(v)))
 #define FLOOR(v) ((v) < 0.0 ? ((int)floor(v)) : ((int)(v)))
 
@@ -42,7 +50,7 @@ ImagingFlipLeftRight(Imaging imOut, Imaging imIn)
     ImagingSectionCookie cookie;
     int x, y, xr;
 
-    if (!imOut || !imIn || strcmp(imIn->mode, imOut->mode) != 0)
+    if (!imOut || !imIn || imIn->modeid != imOut->modeid)
 	return (Imaging) ImagingError_ModeError();
     if (imIn->xsize != imOut->xsize || imIn->ysize != imOut->ysize)
 	return (Imaging) ImagingError_Mismatch();
@@ -75,7 +83,7 @@ ImagingFlipTopBottom(Imaging imOut, Imaging imIn)
     ImagingSectionCookie cookie;
     int y, yr;
 
-    if (!imOut || !imIn || strcmp(imIn->mode, imOut->mode) != 0)
+    if (!imOut || !imIn || imIn->modeid != imOut->modeid)
 	return (Imaging) ImagingError_ModeError();
     if (imIn->xsize != imOut->xsize || imIn->ysize != imOut->ysize)
 	return (Imaging) ImagingError_Mismatch();
@@ -100,7 +108,7 @@ ImagingRotate90(Imaging imOut, Imaging imIn)
     ImagingSectionCookie cookie;
     int x, y, xr;
 
-    if (!imOut || !imIn || strcmp(imIn->mode, imOut->mode) != 0)
+    if (!imOut || !imIn || imIn->modeid != imOut->modeid)
 	return (Imaging) ImagingError_ModeError();
     if (imIn->xsize != imOut->ysize || imIn->ysize != imOut->xsize)
 	return (Imaging) ImagingError_Mismatch();
@@ -133,7 +141,7 @@ ImagingRotate180(Imaging imOut, Imaging imIn)
     ImagingSectionCookie cookie;
     int x, y, xr, yr;
 
-    if (!imOut || !imIn || strcmp(imIn->mode, imOut->mode) != 0)
+    if (!imOut || !imIn || imIn->modeid != imOut->modeid)
 	return (Imaging) ImagingError_ModeError();
     if (imIn->xsize != imOut->xsize || imIn->ysize != imOut->ysize)
 	return (Imaging) ImagingError_Mismatch();
@@ -168,7 +176,7 @@ ImagingRotate270(Imaging imOut, Imaging imIn)
     ImagingSectionCookie cookie;
     int x, y, yr;
 
-    if (!imOut || !imIn || strcmp(imIn->mode, imOut->mode) != 0)
+    if (!imOut || !imIn || imIn->modeid != imOut->modeid)
 	return (Imaging) ImagingError_ModeError();
     if (imIn->xsize != imOut->ysize || imIn->ysize != imOut->xsize)
 	return (Imaging) ImagingError_Mismatch();
@@ -514,6 +522,138 @@ bicubic_filter32RGB(void* out, Imaging im, double xin, double yin, void* data)
     return 1;
 }
 
+#if defined(USE_SSE2)
+
+/* vectorized versions of the RGB filters.  each pixel is handled as
+   two pairs of doubles, using the same operations (in the same order)
+   as the portable versions, so the results are identical. */
+
+static inline void
+load_pixel_sse2(__m128d* v, UINT8* in)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i p = _mm_cvtsi32_si128(*(INT32*) in);
+    p = _mm_unpacklo_epi16(_mm_unpacklo_epi8(p, zero), zero);
+    v[0] = _mm_cvtepi32_pd(p);
+    v[1] = _mm_cvtepi32_pd(_mm_shuffle_epi32(p, 0x4e));
+}
+
+static inline void
+store_pixel_sse2(void* out, Imaging im, __m128d* v)
+{
+    /* truncate and clip to 0..255 */
+    UINT32 pixel;
+    __m128i p = _mm_unpacklo_epi64(_mm_cvttpd_epi32(v[0]),
+                                   _mm_cvttpd_epi32(v[1]));
+    p = _mm_packs_epi32(p, p);
+    pixel = (UINT32) _mm_cvtsi128_si32(_mm_packus_epi16(p, p));
+    memcpy(out, &pixel, im->bands);
+}
+
+static inline void
+bilinear_sse2(__m128d* v, __m128d* a, __m128d* b, __m128d d)
+{
+    int h;
+    for (h = 0; h < 2; h++)
+        v[h] = _mm_add_pd(a[h], _mm_mul_pd(_mm_sub_pd(b[h], a[h]), d));
+}
+
+static int
+bilinear_filter32RGB_sse2(void* out, Imaging im, double xin, double yin,
+                          void* data)
+{
+    int x, y;
+    int x0, x1;
+    double dx, dy;
+    UINT8 *in0, *in1;
+    __m128d a[2], b[2], v1[2], v2[2];
+    if (xin < 0.0 || xin >= im->xsize || yin < 0.0 || yin >= im->ysize)
+        return 0;
+    xin -= 0.5;
+    yin -= 0.5;
+    x = FLOOR(xin);
+    y = FLOOR(yin);
+    dx = xin - x;
+    dy = yin - y;
+    x0 = XCLIP(im, x+0)*4;
+    x1 = XCLIP(im, x+1)*4;
+    in0 = (UINT8*) im->image[YCLIP(im, y)];
+    if (y+1 >= 0 && y+1 < im->ysize)
+        in1 = (UINT8*) im->image[y+1];
+    else
+        in1 = in0;
+    load_pixel_sse2(a, in0 + x0);
+    load_pixel_sse2(b, in0 + x1);
+    bilinear_sse2(v1, a, b, _mm_set1_pd(dx));
+    load_pixel_sse2(a, in1 + x0);
+    load_pixel_sse2(b, in1 + x1);
+    bilinear_sse2(v2, a, b, _mm_set1_pd(dx));
+    bilinear_sse2(v1, v1, v2, _mm_set1_pd(dy));
+    store_pixel_sse2(out, im, v1);
+    return 1;
+}
+
+static inline void
+bicubic_sse2(__m128d* v, __m128d* v1, __m128d* v2, __m128d* v3, __m128d* v4,
+             __m128d d)
+{
+    __m128d p2, p3, p4;
+    int h;
+    for (h = 0; h < 2; h++) {
+        p2 = _mm_sub_pd(v3[h], v1[h]);
+        p3 = _mm_add_pd(_mm_sub_pd(v1[h], v2[h]), _mm_sub_pd(v1[h], v2[h]));
+        p3 = _mm_sub_pd(_mm_add_pd(p3, v3[h]), v4[h]);
+        p4 = _mm_add_pd(_mm_sub_pd(_mm_sub_pd(v2[h], v1[h]), v3[h]), v4[h]);
+        p4 = _mm_add_pd(p3, _mm_mul_pd(d, p4));
+        p4 = _mm_add_pd(p2, _mm_mul_pd(d, p4));
+        v[h] = _mm_add_pd(v2[h], _mm_mul_pd(d, p4));
+    }
+}
+
+static int
+bicubic_filter32RGB_sse2(void* out, Imaging im, double xin, double yin,
+                         void* data)
+{
+    int x, y, i;
+    int x0, x1, x2, x3;
+    double dx, dy;
+    UINT8* in[4];
+    __m128d d, a[2], b[2], c[2], e[2], v[4][2];
+    if (xin < 0.0 || xin >= im->xsize || yin < 0.0 || yin >= im->ysize)
+        return 0;
+    xin -= 0.5;
+    yin -= 0.5;
+    x = FLOOR(xin);
+    y = FLOOR(yin);
+    dx = xin - x;
+    dy = yin - y;
+    x--; y--;
+    x0 = XCLIP(im, x+0)*4;
+    x1 = XCLIP(im, x+1)*4;
+    x2 = XCLIP(im, x+2)*4;
+    x3 = XCLIP(im, x+3)*4;
+    /* lines outside the image repeat the previous line */
+    in[0] = (UINT8*) im->image[YCLIP(im, y)];
+    for (i = 1; i < 4; i++)
+        if (y+i >= 0 && y+i < im->ysize)
+            in[i] = (UINT8*) im->image[y+i];
+        else
+            in[i] = in[i-1];
+    d = _mm_set1_pd(dx);
+    for (i = 0; i < 4; i++) {
+        load_pixel_sse2(a, in[i] + x0);
+        load_pixel_sse2(b, in[i] + x1);
+        load_pixel_sse2(c, in[i] + x2);
+        load_pixel_sse2(e, in[i] + x3);
+        bicubic_sse2(v[i], a, b, c, e, d);
+    }
+    bicubic_sse2(v[0], v[0], v[1], v[2], v[3], _mm_set1_pd(dy));
+    store_pixel_sse2(out, im, v[0]);
+    return 1;
+}
+
+#endif
+
 static ImagingTransformFilter
 getfilter(Imaging im, int filterid)
 {
@@ -544,8 +684,11 @@ getfilter(Imaging im, int filterid)
             case IMAGING_TYPE_UINT8:
                 if (im->bands == 2)
                     return (ImagingTransformFilter) bilinear_filter32LA;
-                else
-                    return (ImagingTransformFilter) bilinear_filter32RGB;
+#if defined(USE_SSE2)
+                if (ImagingCpuFeatures() & IMAGING_CPU_SSE2)
+                    return (ImagingTransformFilter) bilinear_filter32RGB_sse2;
+#endif
+                return (ImagingTransformFilter) bilinear_filter32RGB;
             case IMAGING_TYPE_INT32:
                 return (ImagingTransformFilter) bilinear_filter32I;
             case IMAGING_TYPE_FLOAT32:
@@ -561,8 +704,11 @@ getfilter(Imaging im, int filterid)
             case IMAGING_TYPE_UINT8:
                 if (im->bands == 2)
                     return (ImagingTransformFilter) bicubic_filter32LA;
-                else
-                    return (ImagingTransformFilter) bicubic_filter32RGB;
+#if defined(USE_SSE2)
+                if (ImagingCpuFeatures() & IMAGING_CPU_SSE2)
+                    return (ImagingTransformFilter) bicubic_filter32RGB_sse2;
+#endif
+                return (ImagingTransformFilter) bicubic_filter32RGB;
             case IMAGING_TYPE_INT32:
                 return (ImagingTransformFilter) bicubic_filter32I;
             case IMAGING_TYPE_FLOAT32:
@@ -581,6 +727,40 @@ getfilter(Imaging im, int filterid)
 
 /* transformation engines */
 
+struct transform_context {
+    Imaging imOut;
+    Imaging imIn;
+    int x0, y0, x1;
+    ImagingTransformMap transform;
+    void* transform_data;
+    ImagingTransformFilter filter;
+    void* filter_data;
+    int fill;
+};
+
+static void
+transform_lines(void* context, int start, int end)
+{
+    struct transform_context* ctx = context;
+    Imaging imOut = ctx->imOut;
+    int x, y;
+    char *out;
+    double xx, yy;
+
+    for (y = ctx->y0 + start; y < ctx->y0 + end; y++) {
+	out = imOut->image[y] + ctx->x0*imOut->pixelsize;
+	for (x = ctx->x0; x < ctx->x1; x++) {
+	    if (!ctx->transform(&xx, &yy, x-ctx->x0, y-ctx->y0,
+                                ctx->transform_data) ||
+                !ctx->filter(out, ctx->imIn, xx, yy, ctx->filter_data)) {
+                if (ctx->fill)
+                    memset(out, 0, imOut->pixelsize);
+            }
+            out += imOut->pixelsize;
+	}
+    }
+}
+
 Imaging
 ImagingTransform(
     Imaging imOut, Imaging imIn, int x0, int y0, int x1, int y1, 
@@ -592,13 +772,14 @@ ImagingTransform(
        ImagingScaleAffine where possible. */
 
     ImagingSectionCookie cookie;
-    int x, y;
-    char *out;
-    double xx, yy;
+    ImagingTraceCookie trace;
+    struct transform_context ctx;
 
-    if (!imOut || !imIn || strcmp(imIn->mode, imOut->mode) != 0)
+    if (!imOut || !imIn || imIn->modeid != imOut->modeid)
 	return (Imaging) ImagingError_ModeError();
 
+    ImagingTraceBegin(&trace, "transform");
+
     ImagingCopyInfo(imOut, imIn);
 
     ImagingSectionEnter(&cookie);
@@ -612,20 +793,27 @@ ImagingTransform(
     if (y1 > imOut->ysize)
         y1 = imOut->ysize;
 
-    for (y = y0; y < y1; y++) {
-	out = imOut->image[y] + x0*imOut->pixelsize;
-	for (x = x0; x < x1; x++) {
-	    if (!transform(&xx, &yy, x-x0, y-y0, transform_data) ||
-                !filter(out, imIn, xx, yy, filter_data)) {
-                if (fill)
-                    memset(out, 0, imOut->pixelsize);
-            }
-            out += imOut->pixelsize;
-	}
-    }
+    ctx.imOut = imOut;
+    ctx.imIn = imIn;
+    ctx.x0 = x0;
+    ctx.y0 = y0;
+    ctx.x1 = x1;
+    ctx.transform = transform;
+    ctx.transform_data = transform_data;
+    ctx.filter = filter;
+    ctx.filter_data = filter_data;
+    ctx.fill = fill;
+
+    /* the callbacks are pure C; run bands of lines in parallel */
+    if (x1 > x0)
+        ImagingParallel(transform_lines, &ctx, y1 - y0,
+                        TRANSFORM_GRAIN / (x1 - x0) + 1);
 
     ImagingSectionLeave(&cookie);
 
+    ImagingTraceEnd(&trace, (x1 > x0 && y1 > y0) ?
+                    (long) (x1 - x0) * (y1 - y0) : 0);
+
     return imOut;
 }
 
@@ -643,7 +831,7 @@ ImagingScaleAffine(Imaging imOut, Imaging imIn,
     int xmin, xmax;
     int *xintab;
 
-    if (!imOut || !imIn || strcmp(imIn->mode, imOut->mode) != 0)
+    if (!imOut || !imIn || imIn->modeid != imOut->modeid)
 	return (Imaging) ImagingError_ModeError();
 
     ImagingCopyInfo(imOut, imIn);
@@ -773,10 +961,10 @@ affine_fixed(Imaging imOut, Imaging imIn,
     return imOut;
 }
 
-Imaging
-ImagingTransformAffine(Imaging imOut, Imaging imIn,
-                       int x0, int y0, int x1, int y1,
-                       double a[6], int filterid, int fill)
+static Imaging
+transform_affine(Imaging imOut, Imaging imIn,
+                 int x0, int y0, int x1, int y1,
+                 double a[6], int filterid, int fill)
 {
     /* affine transform, nearest neighbour resampling, floating point
        arithmetics*/
@@ -804,7 +992,7 @@ ImagingTransformAffine(Imaging imOut, Imaging imIn,
 	/* Scaling */
 	return ImagingScaleAffine(imOut, imIn, x0, y0, x1, y1, a, fill);
 
-    if (!imOut || !imIn || strcmp(imIn->mode, imOut->mode) != 0)
+    if (!imOut || !imIn || imIn->modeid != imOut->modeid)
 	return (Imaging) ImagingError_ModeError();
 
     if (x0 < 0)
@@ -869,6 +1057,20 @@ ImagingTransformAffine(Imaging imOut, Imaging imIn,
     return imOut;
 }
 
+Imaging
+ImagingTransformAffine(Imaging imOut, Imaging imIn,
+                       int x0, int y0, int x1, int y1,
+                       double a[6], int filterid, int fill)
+{
+    ImagingTraceCookie trace;
+
+    ImagingTraceBegin(&trace, "affine");
+    imOut = transform_affine(imOut, imIn, x0, y0, x1, y1, a, filterid, fill);
+    ImagingTraceEnd(&trace, imOut ? (long) imOut->xsize * imOut->ysize : 0);
+
+    return imOut;
+}
+
 Imaging
 ImagingTransformPerspective(Imaging imOut, Imaging imIn,
                             int x0, int y0, int x1, int y1,
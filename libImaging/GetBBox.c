@@ -164,7 +164,7 @@ ImagingGetExtrema(Imaging im, void *extrema)
         ((FLOAT32*) extrema)[1] = fmax;
         break;
     case IMAGING_TYPE_SPECIAL:
-      if (strcmp(im->mode, "I;16") == 0) {
+      if (im->modeid == IMAGING_MODE_I_16) {
           imin = imax = ((UINT16*) im->image8[0])[0];
           for (y = 0; y < im->ysize; y++) {
               UINT16* in = (UINT16 *) im->image[y];
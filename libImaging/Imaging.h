@@ -62,6 +62,9 @@ typedef struct ImagingAccessInstance* ImagingAccess;
 typedef struct ImagingHistogramInstance* ImagingHistogram;
 typedef struct ImagingOutlineInstance* ImagingOutline;
 typedef struct ImagingPaletteInstance* ImagingPalette;
+typedef struct ImagingPaletteIndexInstance* ImagingPaletteIndex;
+typedef struct ImagingPipelineInstance* ImagingPipeline;
+typedef struct ImagingResamplerInstance* ImagingResampler;
 
 /* handle magics (used with PyCObject). */
 #define IMAGING_MAGIC "PIL Imaging"
@@ -72,10 +75,41 @@ typedef struct ImagingPaletteInstance* ImagingPalette;
 #define IMAGING_TYPE_FLOAT32 2
 #define IMAGING_TYPE_SPECIAL 3 /* check mode for details */
 
+/* mode identifiers (see Mode.c) */
+#define IMAGING_MODE_UNKNOWN 0
+#define IMAGING_MODE_1 1
+#define IMAGING_MODE_L 2
+#define IMAGING_MODE_LA 3
+#define IMAGING_MODE_P 4
+#define IMAGING_MODE_PA 5
+#define IMAGING_MODE_I 6
+#define IMAGING_MODE_F 7
+#define IMAGING_MODE_I_16 8
+#define IMAGING_MODE_I_16L 9
+#define IMAGING_MODE_I_16B 10
+#define IMAGING_MODE_I_32L 11
+#define IMAGING_MODE_I_32B 12
+#define IMAGING_MODE_RGB 13
+#define IMAGING_MODE_RGBA 14
+#define IMAGING_MODE_RGBa 15
+#define IMAGING_MODE_RGBX 16
+#define IMAGING_MODE_CMYK 17
+#define IMAGING_MODE_YCbCr 18
+#define IMAGING_MODE_BGR_15 19
+#define IMAGING_MODE_BGR_16 20
+#define IMAGING_MODE_BGR_24 21
+#define IMAGING_MODE_BGR_32 22
+#define IMAGING_MODES 23
+
+/* lines allocated by ImagingNew start on this boundary (unless they
+   are shorter than this) */
+#define IMAGING_ALIGN 64
+
 struct ImagingMemoryInstance {
 
     /* Format */
     char mode[4+1];	/* Band names ("1", "L", "P", "RGB", "RGBA", "CMYK") */
+    int modeid;		/* Mode identifier (IMAGING_MODE_*) */
     int type;		/* Data type (IMAGING_TYPE_*) */
     int depth;		/* Depth (ignored in this version) */
     int bands;		/* Number of bands (1, 2, 3, or 4) */
@@ -95,6 +129,11 @@ struct ImagingMemoryInstance {
 
     int pixelsize;	/* Size of a pixel, in bytes (1, 2 or 4) */
     int linesize;	/* Size of a line, in bytes (xsize * pixelsize) */
+    int stride;		/* Size of a line including padding, in bytes.
+			   For block storage, this is also the distance
+			   between the lines.  Lines in images that share
+			   a region of another image may be unaligned. */
+    int readonly;	/* Set if the pixels must not be modified */
 
     /* Virtual methods */
     void (*destroy)(Imaging im);
@@ -117,6 +156,17 @@ struct ImagingMemoryInstance {
 #define IMAGING_PIXEL_INT32(im,x,y) ((im)->image32[(y)][(x)])
 #define IMAGING_PIXEL_FLOAT32(im,x,y) (((FLOAT32*)(im)->image32[y])[x])
 
+struct ImagingModeInstance {
+    const char* name;	/* Mode name, as used in ImagingMemoryInstance */
+    int id;		/* Mode identifier (IMAGING_MODE_*) */
+    int type;		/* Data type (IMAGING_TYPE_*) */
+    int bands;		/* Number of bands */
+    int pixelsize;	/* Size of a pixel, in bytes */
+    int padded;		/* Set if lines are padded to 4 bytes */
+    int palette;	/* Set if images have a palette */
+    int storage;	/* Set if images can be created in this mode */
+};
+
 struct ImagingAccessInstance {
   const char* mode;
   void* (*line)(Imaging im, int x, int y);
@@ -161,9 +211,28 @@ extern void    ImagingDelete(Imaging im);
 
 extern Imaging ImagingNewBlock(const char* mode, int xsize, int ysize);
 extern Imaging ImagingNewArray(const char* mode, int xsize, int ysize);
+extern Imaging ImagingNewVirtual(const char* mode, int xsize, int ysize);
+extern Imaging ImagingNewShared(Imaging imIn, int x0, int y0,
+                                int xsize, int ysize);
+extern int ImagingDetach(Imaging im);
+extern int ImagingPin(Imaging im);
+extern void ImagingUnpin(Imaging im);
+extern Imaging ImagingNewExternal(const char* mode, int xsize, int ysize,
+                                  char* data, int stride, int readonly,
+                                  void (*release)(void* context),
+                                  void* context);
 extern Imaging ImagingNewMap(const char* filename, int readonly,
                              const char* mode, int xsize, int ysize);
 
+/* access hints for mapped images */
+#define IMAGING_ACCESS_NORMAL 0
+#define IMAGING_ACCESS_SEQUENTIAL 1
+#define IMAGING_ACCESS_RANDOM 2
+#define IMAGING_ACCESS_WILLNEED 3
+#define IMAGING_ACCESS_DONTNEED 4
+
+extern int ImagingMapAdvise(Imaging im, int advice);
+
 extern Imaging ImagingNewPrologue(const char *mode,
                                   unsigned xsize, unsigned ysize);
 extern Imaging ImagingNewPrologueSubtype(const char *mode,
@@ -171,10 +240,61 @@ extern Imaging ImagingNewPrologueSubtype(const char *mode,
                                   int structure_size);
 extern Imaging ImagingNewEpilogue(Imaging im);
 
+extern long ImagingGetVirtualThreshold(void);
+extern long ImagingSetVirtualThreshold(long bytes);
+
 extern void ImagingCopyInfo(Imaging destination, Imaging source);
 
+/* Memory accounting (see Storage.c) */
+#define IMAGING_STORAGE_BLOCK 0
+#define IMAGING_STORAGE_ARRAY 1
+#define IMAGING_STORAGE_MAP 2
+#define IMAGING_STORAGE_TYPES 3
+#define IMAGING_SIZE_BUCKETS 32
+
+struct ImagingMemoryStats {
+    long live_bytes;	/* pixel memory held by all images */
+    long peak_bytes;	/* largest live_bytes since the last reset */
+    long bytes[IMAGING_STORAGE_TYPES]; /* live bytes per storage type */
+    long images[IMAGING_STORAGE_TYPES]; /* live rasters per type */
+    long budget;	/* heap budget (0 means unlimited) */
+    long refused;	/* allocations refused by the budget */
+    /* allocation sizes; bucket i counts [2**i, 2**(i+1)) bytes */
+    long sizes[IMAGING_SIZE_BUCKETS];
+};
+
+extern void ImagingMemoryGetStats(struct ImagingMemoryStats* stats);
+extern void ImagingMemoryResetPeak(void);
+extern long ImagingMemorySetBudget(long bytes);
+
+/* Memory pool (see Pool.c) */
+struct ImagingPoolStats {
+    long hits;		/* allocations served from the pool */
+    long misses;	/* allocations passed on to malloc */
+    long retained_blocks;
+    long retained_bytes;
+    long max_bytes;	/* retention limits */
+    long max_block;
+};
+
+extern void* ImagingPoolAlloc(size_t size);
+extern void* ImagingPoolCalloc(size_t size);
+extern int   ImagingPoolFree(void* block);
+extern size_t ImagingPoolSize(void* block);
+extern void  ImagingPoolRef(void* block);
+extern int   ImagingPoolShared(void* block);
+extern void  ImagingPoolPin(void* block, int pin);
+extern int   ImagingPoolPinned(void* block);
+extern void  ImagingPoolSetLimits(long max_bytes, long max_block);
+extern void  ImagingPoolGetStats(struct ImagingPoolStats* stats);
+extern void  ImagingPoolClear(void);
+
 extern void ImagingHistogramDelete(ImagingHistogram histogram);
 
+extern void ImagingModeInit(void);
+extern int ImagingModeId(const char* mode);
+extern const struct ImagingModeInstance* ImagingModeGet(int id);
+
 extern void ImagingAccessInit(void);
 extern ImagingAccess ImagingAccessNew(Imaging im);
 extern void _ImagingAccessDelete(Imaging im, ImagingAccess access);
@@ -195,6 +315,36 @@ extern void ImagingPaletteCacheDelete(ImagingPalette palette);
 #define	ImagingPaletteCache(p, r, g, b)\
     p->cache[(r>>2) + (g>>2)*64 + (b>>2)*64*64]
 
+/* Exact nearest colour lookup.  For each 8x8x8 box of colour space,
+   the index holds the palette entries that can be closest to some
+   colour in that box (see Palette.c).  Indexes are shared between
+   palettes with the same contents. */
+#define IMAGING_PALETTE_BOXES (32*32*32)
+
+struct ImagingPaletteIndexInstance {
+    UINT8 palette[1024];	/* palette contents (lookup key) */
+    UINT32 hash;
+    int refcount;
+    UINT8* boxes[IMAGING_PALETTE_BOXES]; /* candidates for box, or NULL */
+    UINT8 unique[256];		/* entries that aren't duplicates */
+    int unique_count;
+    UINT32* axis_min;		/* min distances along each axis */
+    UINT32* axis_max;		/* max distances along each axis */
+    UINT8* chunks;		/* storage for candidate lists */
+    int chunk_used;
+    int spacing;		/* mean distance to the nearest other entry */
+    ImagingPaletteIndex next;
+};
+
+#define ImagingPaletteBox(r, g, b)\
+    (((r)>>3)<<10 | ((g)>>3)<<5 | ((b)>>3))
+
+extern ImagingPaletteIndex ImagingPaletteIndexGet(ImagingPalette palette);
+extern int  ImagingPaletteIndexLookup(ImagingPaletteIndex index,
+				      int r, int g, int b);
+extern void ImagingPaletteIndexRelease(ImagingPaletteIndex index);
+extern void ImagingPaletteIndexClear(void);
+
 extern Imaging ImagingQuantize(Imaging im, int colours, int mode, int kmeans);
 
 /* Threading */
@@ -205,6 +355,71 @@ typedef void* ImagingSectionCookie;
 extern void ImagingSectionEnter(ImagingSectionCookie* cookie);
 extern void ImagingSectionLeave(ImagingSectionCookie* cookie);
 
+/* Worker pool (see Parallel.c).  Workers are called without the
+   interpreter lock, and must not use the Python API. */
+typedef void (*ImagingWorker)(void* context, int start, int end);
+
+extern void ImagingParallel(ImagingWorker worker, void* context,
+                            int count, int grain);
+extern int ImagingGetThreads(void);
+extern int ImagingSetThreads(int threads);
+
+/* Processor features */
+/* ------------------ */
+
+#define IMAGING_CPU_SSE2 1
+#define IMAGING_CPU_AVX2 2
+
+extern int ImagingCpuFeatures(void);
+extern int ImagingSetCpuFeatures(int mask);
+
+/* Tracing (see Trace.c).  Instrumented operations record their wall
+   time, the number of pixels processed, and the image memory they
+   allocated in a per-thread ring buffer.  Tracing is off by default;
+   build with WITHOUT_TRACING to remove it altogether. */
+
+#ifndef WITHOUT_TRACING
+#define WITH_TRACING
+#endif
+
+typedef struct {
+    const char* op;	/* operation name (a static string) */
+    int thread;		/* tracing thread number */
+    double start;	/* seconds since the epoch */
+    double time;	/* wall time, in seconds */
+    long pixels;	/* pixels processed */
+    long bytes;		/* image memory allocated */
+} ImagingTraceRecord;
+
+typedef struct {
+    int active;
+    const char* op;
+    double start;
+    long bytes;
+} ImagingTraceCookie;
+
+extern int ImagingTraceEnabled;
+
+extern int  ImagingSetTrace(int enabled);
+extern int  ImagingTraceCollect(ImagingTraceRecord* records, int count);
+extern void ImagingTraceStart(ImagingTraceCookie* cookie, const char* op);
+extern void ImagingTraceStop(ImagingTraceCookie* cookie, long pixels);
+extern void ImagingTraceAllocated(long bytes);
+
+#ifdef WITH_TRACING
+#define ImagingTraceBegin(cookie, op)\
+    ((cookie)->active = 0,\
+     ImagingTraceEnabled ? ImagingTraceStart((cookie), (op)) : (void) 0)
+#define ImagingTraceEnd(cookie, pixels)\
+    ((cookie)->active ? ImagingTraceStop((cookie), (pixels)) : (void) 0)
+#define ImagingTraceBytes(bytes)\
+    (ImagingTraceEnabled ? ImagingTraceAllocated(bytes) : (void) 0)
+#else
+#define ImagingTraceBegin(cookie, op) ((void) (cookie))
+#define ImagingTraceEnd(cookie, pixels) ((void) (cookie), (void) sizeof (pixels))
+#define ImagingTraceBytes(bytes) ((void) 0)
+#endif
+
 /* Exceptions */
 /* ---------- */
 
@@ -230,6 +445,25 @@ extern void ImagingError_Clear(void);
 #define IMAGING_TRANSFORM_BILINEAR 2
 #define IMAGING_TRANSFORM_BICUBIC 3
 
+/* dither methods */
+#define IMAGING_DITHER_NONE 0
+#define IMAGING_DITHER_ORDERED 1 /* 8x8 Bayer matrix */
+#define IMAGING_DITHER_RASTERIZE 2 /* not implemented (same as 3) */
+#define IMAGING_DITHER_FLOYDSTEINBERG 3
+#define IMAGING_DITHER_BAYER4 4
+#define IMAGING_DITHER_BLUENOISE 5
+
+/* threshold matrices for ordered dithering (see Dither.c) */
+struct ImagingDitherMatrix {
+    int dither;			/* dither method */
+    int size;			/* tile size (a power of two) */
+    int width;			/* row length (a power of two, >= 16) */
+    const UINT8* threshold;	/* size rows of width thresholds */
+};
+
+extern void ImagingDitherInit(void);
+extern const struct ImagingDitherMatrix* ImagingDitherGetMatrix(int dither);
+
 typedef int (*ImagingTransformMap)(double* X, double* Y,
                                    int x, int y, void* data);
 typedef int (*ImagingTransformFilter)(void* out, Imaging im,
@@ -243,6 +477,7 @@ extern Imaging ImagingBlend(Imaging imIn1, Imaging imIn2, float alpha);
 extern Imaging ImagingCopy(Imaging im);
 extern Imaging ImagingConvert(Imaging im, const char* mode, ImagingPalette palette, int dither);
 extern Imaging ImagingConvertInPlace(Imaging im, const char* mode);
+extern void ImagingConvertInit(void);
 extern Imaging ImagingConvertMatrix(Imaging im, const char *mode, float m[]);
 extern Imaging ImagingCrop(Imaging im, int x0, int y0, int x1, int y1);
 extern Imaging ImagingExpand(Imaging im, int x, int y, int mode);
@@ -280,6 +515,7 @@ extern Imaging ImagingPointTransform(
     Imaging imIn, double scale, double offset);
 extern Imaging ImagingPutBand(Imaging im, Imaging imIn, int band);
 extern Imaging ImagingRankFilter(Imaging im, int size, int rank);
+extern Imaging ImagingResample(Imaging imOut, Imaging imIn, int filter);
 extern Imaging ImagingResize(Imaging imOut, Imaging imIn, int filter);
 extern Imaging ImagingRotate(
     Imaging imOut, Imaging imIn, double theta, int filter);
@@ -287,6 +523,10 @@ extern Imaging ImagingRotate90(Imaging imOut, Imaging imIn);
 extern Imaging ImagingRotate180(Imaging imOut, Imaging imIn);
 extern Imaging ImagingRotate270(Imaging imOut, Imaging imIn);
 extern Imaging ImagingStretch(Imaging imOut, Imaging imIn, int filter);
+extern ImagingResampler ImagingResamplerNew(
+    Imaging imOut, int xsize, int ysize, int filter);
+extern int ImagingResamplerPush(ImagingResampler resampler, UINT8* line);
+extern void ImagingResamplerDelete(ImagingResampler resampler);
 extern Imaging ImagingTransformPerspective(
     Imaging imOut, Imaging imIn, int x0, int y0, int x1, int y1, 
     double a[8], int filter, int fill);
@@ -304,8 +544,24 @@ extern Imaging ImagingTransform(
 extern Imaging ImagingUnsharpMask(
     Imaging im, Imaging imOut, float radius, int percent, int threshold);
 
+/* Variants that write to an existing image (or allocate a new one,
+   if imOut is NULL).  Blend, negative, point and the channel
+   operations can be done in place (imOut being an input). */
 extern Imaging ImagingCopy2(Imaging imOut, Imaging imIn);
 extern Imaging ImagingConvert2(Imaging imOut, Imaging imIn);
+extern Imaging ImagingBlend2(
+    Imaging imOut, Imaging imIn1, Imaging imIn2, float alpha);
+extern Imaging ImagingFilter2(
+    Imaging imOut, Imaging im, int xsize, int ysize,
+    const FLOAT32* kernel, FLOAT32 offset, FLOAT32 divisor);
+extern Imaging ImagingNegative2(Imaging imOut, Imaging im);
+extern Imaging ImagingOffset2(
+    Imaging imOut, Imaging im, int xoffset, int yoffset);
+extern Imaging ImagingPoint2(Imaging imOut, Imaging im, const void* table);
+extern Imaging ImagingPointTransform2(
+    Imaging imOut, Imaging imIn, double scale, double offset);
+extern Imaging ImagingRankFilter2(
+    Imaging imOut, Imaging im, int size, int rank);
 
 /* Channel operations */
 /* any mode, except "F" */
@@ -326,6 +582,29 @@ extern Imaging ImagingChopAnd(Imaging imIn1, Imaging imIn2);
 extern Imaging ImagingChopOr(Imaging imIn1, Imaging imIn2);
 extern Imaging ImagingChopXor(Imaging imIn1, Imaging imIn2);
 
+/* same, writing to imOut (see above) */
+extern Imaging ImagingChopLighter2(
+    Imaging imOut, Imaging imIn1, Imaging imIn2);
+extern Imaging ImagingChopDarker2(
+    Imaging imOut, Imaging imIn1, Imaging imIn2);
+extern Imaging ImagingChopDifference2(
+    Imaging imOut, Imaging imIn1, Imaging imIn2);
+extern Imaging ImagingChopMultiply2(
+    Imaging imOut, Imaging imIn1, Imaging imIn2);
+extern Imaging ImagingChopScreen2(
+    Imaging imOut, Imaging imIn1, Imaging imIn2);
+extern Imaging ImagingChopAdd2(
+    Imaging imOut, Imaging imIn1, Imaging imIn2, float scale, int offset);
+extern Imaging ImagingChopSubtract2(
+    Imaging imOut, Imaging imIn1, Imaging imIn2, float scale, int offset);
+extern Imaging ImagingChopAddModulo2(
+    Imaging imOut, Imaging imIn1, Imaging imIn2);
+extern Imaging ImagingChopSubtractModulo2(
+    Imaging imOut, Imaging imIn1, Imaging imIn2);
+extern Imaging ImagingChopAnd2(Imaging imOut, Imaging imIn1, Imaging imIn2);
+extern Imaging ImagingChopOr2(Imaging imOut, Imaging imIn1, Imaging imIn2);
+extern Imaging ImagingChopXor2(Imaging imOut, Imaging imIn1, Imaging imIn2);
+
 /* Image measurement */
 extern void ImagingCrack(Imaging im, int x0, int y0);
 
@@ -463,13 +742,40 @@ extern void ImagingUnpackYCC(UINT8* out, const UINT8* in, int pixels);
 extern void ImagingUnpackYCCA(UINT8* out, const UINT8* in, int pixels);
 extern void ImagingUnpackYCbCr(UINT8* out, const UINT8* in, int pixels);
 
+extern void ImagingConvertYCbCrInit(void);
 extern void ImagingConvertRGB2YCbCr(UINT8* out, const UINT8* in, int pixels);
 extern void ImagingConvertYCbCr2RGB(UINT8* out, const UINT8* in, int pixels);
 
+extern void ImagingPackInit(void);
+extern void ImagingUnpackInit(void);
 extern ImagingShuffler ImagingFindUnpacker(const char* mode,
                                            const char* rawmode, int* bits_out);
 extern ImagingShuffler ImagingFindPacker(const char* mode,
                                          const char* rawmode, int* bits_out);
+extern ImagingShuffler ImagingFindConverter(const char* from, const char* to);
+
+/* Streaming convert and resize (see Pipeline.c) */
+struct ImagingPipelineInstance {
+    Imaging imOut;		/* destination image */
+    int modeid;			/* source mode */
+    int xsize, ysize;		/* source size */
+    int y;			/* next source line */
+    ImagingShuffler convert;	/* source to destination mode, or NULL */
+    ImagingResampler resampler;	/* source to destination size, or NULL */
+    UINT8* buffer;		/* converted line (when resampling) */
+    int error;
+    /* decoder support */
+    ImagingShuffler unpack;	/* raw data to source mode */
+    struct ImagingMemoryInstance staging; /* all lines point to line */
+    UINT8* line;		/* follows this header */
+};
+
+extern ImagingPipeline ImagingPipelineNew(
+    Imaging imOut, const char* mode, int xsize, int ysize, int filter);
+extern int ImagingPipelinePush(ImagingPipeline pipeline, const UINT8* line);
+extern int ImagingPipelinePushImage(ImagingPipeline pipeline, Imaging im);
+extern void ImagingPipelineFeed(UINT8* out, const UINT8* in, int pixels);
+extern void ImagingPipelineDelete(ImagingPipeline pipeline);
 
 struct ImagingCodecStateInstance {
     int count;
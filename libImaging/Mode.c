@@ -0,0 +1,99 @@
+/*
+ * The Python Imaging Library
+ * $Id$
+ *
+ * mode descriptors
+ *
+ * Each image mode is described by a static descriptor, and identified
+ * by a small integer (IMAGING_MODE_*).  The identifier is stored in
+ * the image when it is created, so that code that dispatches on the
+ * mode can use a switch or a table index instead of comparing mode
+ * strings.  ImagingModeId maps a mode string to its identifier; call
+ * ImagingModeInit once before using it.
+ *
+ * See the README file for information on usage and redistribution.
+ */
+
+
+#include "Imaging.h"
+
+static const struct ImagingModeInstance modes[IMAGING_MODES] = {
+    /* name	id			type		    bands size pad pal storage */
+    { NULL,	IMAGING_MODE_UNKNOWN,	IMAGING_TYPE_UINT8,   0, 0, 0, 0, 0 },
+    { "1",	IMAGING_MODE_1,		IMAGING_TYPE_UINT8,   1, 1, 0, 0, 1 },
+    { "L",	IMAGING_MODE_L,		IMAGING_TYPE_UINT8,   1, 1, 0, 0, 1 },
+    { "LA",	IMAGING_MODE_LA,	IMAGING_TYPE_UINT8,   2, 4, 0, 0, 1 },
+    { "P",	IMAGING_MODE_P,		IMAGING_TYPE_UINT8,   1, 1, 0, 1, 1 },
+    { "PA",	IMAGING_MODE_PA,	IMAGING_TYPE_UINT8,   2, 4, 0, 1, 1 },
+    { "I",	IMAGING_MODE_I,		IMAGING_TYPE_INT32,   1, 4, 0, 0, 1 },
+    { "F",	IMAGING_MODE_F,		IMAGING_TYPE_FLOAT32, 1, 4, 0, 0, 1 },
+    /* EXPERIMENTAL: 16-bit raw integer images */
+    { "I;16",	IMAGING_MODE_I_16,	IMAGING_TYPE_SPECIAL, 1, 2, 0, 0, 1 },
+    { "I;16L",	IMAGING_MODE_I_16L,	IMAGING_TYPE_SPECIAL, 1, 2, 0, 0, 1 },
+    { "I;16B",	IMAGING_MODE_I_16B,	IMAGING_TYPE_SPECIAL, 1, 2, 0, 0, 1 },
+    /* 32-bit raw integers; pixel access only */
+    { "I;32L",	IMAGING_MODE_I_32L,	IMAGING_TYPE_SPECIAL, 1, 4, 0, 0, 0 },
+    { "I;32B",	IMAGING_MODE_I_32B,	IMAGING_TYPE_SPECIAL, 1, 4, 0, 0, 0 },
+    { "RGB",	IMAGING_MODE_RGB,	IMAGING_TYPE_UINT8,   3, 4, 0, 0, 1 },
+    { "RGBA",	IMAGING_MODE_RGBA,	IMAGING_TYPE_UINT8,   4, 4, 0, 0, 1 },
+    /* EXPERIMENTAL: premultiplied alpha */
+    { "RGBa",	IMAGING_MODE_RGBa,	IMAGING_TYPE_UINT8,   4, 4, 0, 0, 1 },
+    { "RGBX",	IMAGING_MODE_RGBX,	IMAGING_TYPE_UINT8,   4, 4, 0, 0, 1 },
+    { "CMYK",	IMAGING_MODE_CMYK,	IMAGING_TYPE_UINT8,   4, 4, 0, 0, 1 },
+    { "YCbCr",	IMAGING_MODE_YCbCr,	IMAGING_TYPE_UINT8,   3, 4, 0, 0, 1 },
+    /* EXPERIMENTAL: reversed true colour */
+    { "BGR;15",	IMAGING_MODE_BGR_15,	IMAGING_TYPE_SPECIAL, 1, 2, 1, 0, 1 },
+    { "BGR;16",	IMAGING_MODE_BGR_16,	IMAGING_TYPE_SPECIAL, 1, 2, 1, 0, 1 },
+    { "BGR;24",	IMAGING_MODE_BGR_24,	IMAGING_TYPE_SPECIAL, 1, 3, 1, 0, 1 },
+    { "BGR;32",	IMAGING_MODE_BGR_32,	IMAGING_TYPE_SPECIAL, 1, 4, 1, 0, 1 },
+};
+
+/* open hash table, mapping names to identifiers (0 marks a free slot) */
+#define HASH_SIZE 64
+
+static UINT8 hash_table[HASH_SIZE];
+
+static UINT32
+hash(const char* mode)
+{
+    UINT32 i = 5381;
+    while (*mode)
+        i = ((i<<5) + i) ^ (UINT8) *mode++;
+    return i;
+}
+
+void
+ImagingModeInit(void)
+{
+    UINT32 i;
+    int id;
+
+    for (id = 1; id < IMAGING_MODES; id++) {
+        for (i = hash(modes[id].name); hash_table[i % HASH_SIZE]; i++)
+            ;
+        hash_table[i % HASH_SIZE] = (UINT8) id;
+    }
+}
+
+int
+ImagingModeId(const char* mode)
+{
+    /* get identifier for mode (IMAGING_MODE_UNKNOWN if not known) */
+
+    UINT32 i;
+    int id;
+
+    for (i = hash(mode); (id = hash_table[i % HASH_SIZE]) != 0; i++)
+        if (modes[id].name[0] == mode[0] && strcmp(modes[id].name, mode) == 0)
+            return id;
+
+    return IMAGING_MODE_UNKNOWN;
+}
+
+const struct ImagingModeInstance*
+ImagingModeGet(int id)
+{
+    if (id <= IMAGING_MODE_UNKNOWN || id >= IMAGING_MODES)
+        return NULL;
+    return &modes[id];
+}
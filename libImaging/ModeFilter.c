@@ -15,15 +15,98 @@
 
 #include "Imaging.h"
 
+/* the histogram is updated incrementally as the window slides along
+   each line; the pixels in the column leaving the window are removed,
+   and the pixels in the column entering it are added.  the most
+   frequent value is tracked as we go, so we only have to scan the
+   histogram when its count drops. */
+
+struct mode_context {
+    Imaging im;
+    Imaging imOut;
+    int size;
+};
+
+static inline void
+find_mode(int histogram[256], int* maxcount, int* maxpixel)
+{
+    int i;
+    *maxpixel = 0;
+    *maxcount = histogram[0];
+    for (i = 1; i < 256; i++)
+	if (histogram[i] > *maxcount) {
+	    *maxcount = histogram[i];
+	    *maxpixel = i;
+	}
+}
+
+static void
+mode_lines(void* context, int start, int end)
+{
+    struct mode_context* ctx = context;
+    Imaging im = ctx->im;
+    int size = ctx->size;
+    int x, y, yy, y0, y1, xin, xout;
+    int maxcount, maxpixel, count, pixel;
+    int histogram[256];
+
+    for (y = start; y < end; y++) {
+	UINT8* out = &IMAGING_PIXEL_L(ctx->imOut, 0, y);
+
+	/* lines in the window */
+	y0 = (y - size < 0) ? 0 : y - size;
+	y1 = (y + size >= im->ysize) ? im->ysize - 1 : y + size;
+
+	/* initial window */
+	memset(histogram, 0, sizeof(histogram));
+	for (yy = y0; yy <= y1; yy++)
+	    for (x = 0; x <= size && x < im->xsize; x++)
+		histogram[IMAGING_PIXEL_L(im, x, yy)]++;
+	find_mode(histogram, &maxcount, &maxpixel);
+
+	for (x = 0; x < im->xsize; x++) {
+
+	    if (x > 0) {
+		xout = x - size - 1;
+		xin = x + size;
+		if (xout >= 0)
+		    for (yy = y0; yy <= y1; yy++)
+			histogram[IMAGING_PIXEL_L(im, xout, yy)]--;
+		if (xin < im->xsize)
+		    for (yy = y0; yy <= y1; yy++)
+			histogram[IMAGING_PIXEL_L(im, xin, yy)]++;
+		if (histogram[maxpixel] >= maxcount) {
+		    /* the old mode beats all values not added to the
+		       window; check the new ones */
+		    maxcount = histogram[maxpixel];
+		    if (xin < im->xsize)
+			for (yy = y0; yy <= y1; yy++) {
+			    pixel = IMAGING_PIXEL_L(im, xin, yy);
+			    count = histogram[pixel];
+			    if (count > maxcount ||
+				(count == maxcount && pixel < maxpixel)) {
+				maxcount = count;
+				maxpixel = pixel;
+			    }
+			}
+		} else
+		    find_mode(histogram, &maxcount, &maxpixel);
+	    }
+
+	    if (maxcount > 2)
+		out[x] = (UINT8) maxpixel;
+	    else
+		out[x] = IMAGING_PIXEL_L(im, x, y);
+	}
+    }
+}
+
 Imaging
 ImagingModeFilter(Imaging im, int size)
 {
+    ImagingSectionCookie cookie;
+    struct mode_context ctx;
     Imaging imOut;
-    int x, y, i;
-    int xx, yy;
-    int maxcount;
-    UINT8 maxpixel;
-    int histogram[256];
 
     if (!im || im->bands != 1 || im->type != IMAGING_TYPE_UINT8)
 	return (Imaging) ImagingError_ModeError();
@@ -32,45 +115,16 @@ ImagingModeFilter(Imaging im, int size)
     if (!imOut)
 	return NULL;
 
-    size = size / 2;
-
-    for (y = 0; y < imOut->ysize; y++) {
-        UINT8* out = &IMAGING_PIXEL_L(imOut, 0, y);
-        for (x = 0; x < imOut->xsize; x++) {
-
-            /* calculate histogram over current area */
-
-            /* FIXME: brute force! to improve, update the histogram
-               incrementally.  may also add a "frequent list", like in
-               the old implementation, but I'm not sure that's worth
-               the added complexity... */
-
-            memset(histogram, 0, sizeof(histogram));
-            for (yy = y - size; yy <= y + size; yy++)
-                if (yy >= 0 && yy < imOut->ysize) {
-                    UINT8* in = &IMAGING_PIXEL_L(im, 0, yy);
-                    for (xx = x - size; xx <= x + size; xx++)
-                        if (xx >= 0 && xx < imOut->xsize)
-                            histogram[in[xx]]++;
-                }
-
-            /* find most frequent pixel value in this region */
-            maxpixel = 0;
-            maxcount = histogram[maxpixel];
-            for (i = 1; i < 256; i++)
-                if (histogram[i] > maxcount) {
-                    maxcount = histogram[i];
-                    maxpixel = (UINT8) i;
-                }
-
-            if (maxcount > 2)
-                out[x] = maxpixel;
-            else
-                out[x] = IMAGING_PIXEL_L(im, x, y);
-
-        }
-        
-    }
+    ctx.im = im;
+    ctx.imOut = imOut;
+    ctx.size = size / 2;
+
+    ImagingSectionEnter(&cookie);
+
+    ImagingParallel(mode_lines, &ctx, im->ysize,
+		    65536 / (im->xsize * (ctx.size + 1) + 1) + 1);
+
+    ImagingSectionLeave(&cookie);
 
     ImagingCopyInfo(imOut, im);
 
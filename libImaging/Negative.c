@@ -21,15 +21,16 @@
 
 
 Imaging
-ImagingNegative(Imaging im)
+ImagingNegative2(Imaging imOut, Imaging im)
 {
-    Imaging imOut;
+    /* imOut may be the same image as im */
+
     int x, y;
 
     if (!im)
 	return (Imaging) ImagingError_ModeError();
 
-    imOut = ImagingNew(im->mode, im->xsize, im->ysize);
+    imOut = ImagingNew2(im->mode, imOut, im);
     if (!imOut)
 	return NULL;
 
@@ -40,3 +41,9 @@ ImagingNegative(Imaging im)
     return imOut;
 }
 
+Imaging
+ImagingNegative(Imaging im)
+{
+    return ImagingNegative2(NULL, im);
+}
+
@@ -19,15 +19,17 @@
 
 
 Imaging
-ImagingOffset(Imaging im, int xoffset, int yoffset)
+ImagingOffset2(Imaging imOut, Imaging im, int xoffset, int yoffset)
 {
     int x, y;
-    Imaging imOut;
 
     if (!im)
 	return (Imaging) ImagingError_ModeError();
 
-    imOut = ImagingNew(im->mode, im->xsize, im->ysize);
+    if (imOut == im)
+	return (Imaging) ImagingError_ValueError("cannot offset in place");
+
+    imOut = ImagingNew2(im->mode, imOut, im);
     if (!imOut)
 	return NULL;
 
@@ -59,3 +61,9 @@ ImagingOffset(Imaging im, int xoffset, int yoffset)
 
     return imOut;
 }
+
+Imaging
+ImagingOffset(Imaging im, int xoffset, int yoffset)
+{
+    return ImagingOffset2(NULL, im, xoffset, yoffset);
+}
@@ -549,18 +549,38 @@ static struct {
 };
 
 
+#define	ENTRIES	(sizeof(packers) / sizeof(packers[0]))
+
+/* entries for each mode, chained in table order (index+1, 0 ends) */
+static int pack_first[IMAGING_MODES];
+static int pack_next[ENTRIES];
+
+void
+ImagingPackInit(void)
+{
+    int i, id;
+
+    for (i = (int) ENTRIES - 2; i >= 0; i--) {
+        id = ImagingModeId(packers[i].mode);
+        if (id == IMAGING_MODE_UNKNOWN)
+            continue;
+        pack_next[i] = pack_first[id];
+        pack_first[id] = i + 1;
+    }
+}
+
 ImagingShuffler
 ImagingFindPacker(const char* mode, const char* rawmode, int* bits_out)
 {
     int i;
 
     /* find a suitable pixel packer */
-    for (i = 0; packers[i].rawmode; i++)
-	if (strcmp(packers[i].mode, mode) == 0 &&
-            strcmp(packers[i].rawmode, rawmode) == 0) {
+    for (i = pack_first[ImagingModeId(mode)]; i; i = pack_next[i-1])
+        if (strcmp(packers[i-1].rawmode, rawmode) == 0) {
 	    if (bits_out)
-		*bits_out = packers[i].bits;
-	    return packers[i].pack;
+		*bits_out = packers[i-1].bits;
+	    return packers[i-1].pack;
 	}
+
     return NULL;
 }
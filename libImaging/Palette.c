@@ -314,3 +314,334 @@ ImagingPaletteCacheDelete(ImagingPalette palette)
 	palette->cache = NULL;
     }
 }
+
+
+/* -------------------------------------------------------------------- */
+/* Palette indexes							*/
+/* -------------------------------------------------------------------- */
+
+/* An index maps colours to the exactly nearest palette entry.  Colour
+   space is split into 32x32x32 boxes, and for each box, the index
+   lists the entries that can be closest to some colour in the box:
+   those whose min distance to the box doesn't exceed the smallest max
+   distance of any entry (after Heckbert).  A lookup only has to check
+   the candidates for its box; most boxes have a single candidate.
+
+   The candidate list for a box is built on the first lookup in that
+   box, so small images only pay for the boxes they use.  Indexes are
+   kept in a small list, keyed by palette contents, so repeated
+   conversions to the same palette reuse the lists built so far. */
+
+#if defined(WITH_THREAD) && defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+#define	LOCK()		pthread_mutex_lock(&index_lock)
+#define	UNLOCK()	pthread_mutex_unlock(&index_lock)
+#else
+#define	LOCK()
+#define	UNLOCK()
+#endif
+
+/* number of indexes to keep */
+#define	MAX_INDEXES	8
+
+/* candidate lists are stored in chunks of this size */
+#define	CHUNK_SIZE	8192
+
+#define	AXIS(table, c, i, j) table[((c)*n + (i))*32 + (j)]
+
+static ImagingPaletteIndex indexes = NULL;
+
+static UINT32
+palette_hash(const UINT8* palette)
+{
+    UINT32 h = 2166136261U;
+    int i;
+    for (i = 0; i < 1024; i++)
+	h = (h ^ palette[i]) * 16777619U;
+    return h;
+}
+
+static void
+index_delete(ImagingPaletteIndex index)
+{
+    UINT8* chunk;
+
+    /* each chunk starts with a pointer to the previous one */
+    while (index->chunks) {
+	chunk = index->chunks;
+	index->chunks = *(UINT8**) chunk;
+	free(chunk);
+    }
+
+    free(index->axis_min);
+    free(index->axis_max);
+    free(index);
+}
+
+static ImagingPaletteIndex
+index_new(ImagingPalette palette, UINT32 hash)
+{
+    ImagingPaletteIndex index;
+    UINT8* unique;
+    int i, j, n, c, v, lo, hi;
+
+    index = calloc(1, sizeof(struct ImagingPaletteIndexInstance));
+    if (!index)
+	return (ImagingPaletteIndex) ImagingError_MemoryError();
+
+    memcpy(index->palette, palette->palette, 1024);
+    index->hash = hash;
+
+    /* duplicate entries never win (ties go to the lowest entry) */
+    unique = index->unique;
+    for (i = n = 0; i < 256; i++) {
+	for (j = 0; j < i; j++)
+	    if (palette->palette[j*4+0] == palette->palette[i*4+0] &&
+		palette->palette[j*4+1] == palette->palette[i*4+1] &&
+		palette->palette[j*4+2] == palette->palette[i*4+2])
+		break;
+	if (j == i)
+	    unique[n++] = (UINT8) i;
+    }
+    index->unique_count = n;
+
+    /* typical distance between entries (used by ordered dithers) */
+    if (n > 1) {
+	double sum = 0.0;
+	for (i = 0; i < n; i++) {
+	    UINT8* p = palette->palette + unique[i]*4;
+	    UINT32 d, dbest = (UINT32) ~0;
+	    for (j = 0; j < n; j++) {
+		UINT8* q = palette->palette + unique[j]*4;
+		if (j == i)
+		    continue;
+		d = (p[0]-q[0])*(p[0]-q[0]) + (p[1]-q[1])*(p[1]-q[1]) +
+		    (p[2]-q[2])*(p[2]-q[2]);
+		if (d < dbest)
+		    dbest = d;
+	    }
+	    sum += sqrt((double) dbest);
+	}
+	index->spacing = (int) (sum / n + 0.5);
+    }
+
+    /* min and max distances along each axis, from each entry to
+       each box position */
+    index->axis_min = malloc(3 * n * 32 * sizeof(UINT32));
+    index->axis_max = malloc(3 * n * 32 * sizeof(UINT32));
+    if (!index->axis_min || !index->axis_max) {
+	index_delete(index);
+	return (ImagingPaletteIndex) ImagingError_MemoryError();
+    }
+
+    for (c = 0; c < 3; c++)
+	for (i = 0; i < n; i++) {
+	    v = palette->palette[unique[i]*4+c];
+	    for (j = 0; j < 32; j++) {
+		lo = j * 8; hi = lo + 7;
+		AXIS(index->axis_min, c, i, j) =
+		    (v < lo) ? (lo-v)*(lo-v) : (v > hi) ? (v-hi)*(v-hi) : 0;
+		AXIS(index->axis_max, c, i, j) =
+		    (v-lo > hi-v) ? (v-lo)*(v-lo) : (hi-v)*(hi-v);
+	    }
+	}
+
+    return index;
+}
+
+static UINT8*
+index_box(ImagingPaletteIndex index, int box)
+{
+    /* build the candidate list for a box: the number of candidates
+       minus one, followed by the candidates in entry order.  returns
+       NULL if we're out of memory */
+
+    UINT8 list[1+256];
+    UINT8* entries;
+    UINT32 *dmin, *dmax;
+    UINT32 d, dlimit;
+    int i, n, r, g, b, count;
+
+    n = index->unique_count;
+    dmin = index->axis_min;
+    dmax = index->axis_max;
+    r = box >> 10; g = (box >> 5) & 31; b = box & 31;
+
+    /* smallest max distance to the box */
+    dlimit = (UINT32) ~0;
+    for (i = 0; i < n; i++) {
+	d = AXIS(dmax, 0, i, r) + AXIS(dmax, 1, i, g) + AXIS(dmax, 2, i, b);
+	if (d < dlimit)
+	    dlimit = d;
+    }
+
+    count = 0;
+    for (i = 0; i < n; i++) {
+	d = AXIS(dmin, 0, i, r) + AXIS(dmin, 1, i, g) + AXIS(dmin, 2, i, b);
+	if (d <= dlimit)
+	    list[1 + count++] = index->unique[i];
+    }
+    list[0] = (UINT8) (count - 1);
+
+    /* publish the list, unless another thread got there first.  lists
+       never move once they're published, so lookups can use them
+       without the lock */
+    LOCK();
+    if (!index->boxes[box]) {
+	if (!index->chunks || index->chunk_used + count + 1 > CHUNK_SIZE) {
+	    entries = malloc(CHUNK_SIZE);
+	    if (!entries) {
+		UNLOCK();
+		return NULL;
+	    }
+	    *(UINT8**) entries = index->chunks;
+	    index->chunks = entries;
+	    index->chunk_used = sizeof(UINT8*);
+	}
+	entries = index->chunks + index->chunk_used;
+	memcpy(entries, list, count + 1);
+	index->chunk_used += count + 1;
+	index->boxes[box] = entries;
+    }
+    entries = index->boxes[box];
+    UNLOCK();
+
+    return entries;
+}
+
+#undef	AXIS
+
+ImagingPaletteIndex
+ImagingPaletteIndexGet(ImagingPalette palette)
+{
+    /* get a (new reference to an) index for this palette */
+
+    ImagingPaletteIndex index, prev, drop, new_index;
+    UINT32 hash;
+    int i;
+
+    hash = palette_hash(palette->palette);
+
+    LOCK();
+    prev = NULL;
+    for (index = indexes; index; prev = index, index = index->next)
+	if (index->hash == hash &&
+	    memcmp(index->palette, palette->palette, 1024) == 0) {
+	    /* move to front */
+	    if (prev) {
+		prev->next = index->next;
+		index->next = indexes;
+		indexes = index;
+	    }
+	    index->refcount++;
+	    UNLOCK();
+	    return index;
+	}
+    UNLOCK();
+
+    /* build a new index.  if some other thread builds an index for
+       the same palette at the same time, the older one is eventually
+       dropped from the list. */
+    new_index = index = index_new(palette, hash);
+    if (!index)
+	return NULL;
+
+    LOCK();
+    index->refcount = 2; /* one for the caller, one for the list */
+    index->next = indexes;
+    indexes = index;
+    /* drop the least recently used indexes */
+    for (i = 1; i < MAX_INDEXES && index->next; i++)
+	index = index->next;
+    drop = index->next;
+    index->next = NULL;
+    UNLOCK();
+
+    while (drop) {
+	index = drop;
+	drop = drop->next;
+	ImagingPaletteIndexRelease(index);
+    }
+
+    return new_index;
+}
+
+int
+ImagingPaletteIndexLookup(ImagingPaletteIndex index, int r, int g, int b)
+{
+    /* get nearest palette entry.  ties go to the lowest entry */
+
+    UINT8* entry;
+    UINT8* end;
+    UINT8* p;
+    int box, best, d, dbest;
+
+    box = ImagingPaletteBox(r, g, b);
+    entry = index->boxes[box];
+    if (!entry)
+	entry = index_box(index, box);
+
+    if (entry) {
+	end = entry + entry[0] + 2;
+	entry++;
+    } else {
+	/* out of memory; check all entries */
+	entry = index->unique;
+	end = entry + index->unique_count;
+    }
+
+    best = *entry;
+    if (++entry == end)
+	return best;
+
+    p = index->palette + best*4;
+    dbest = (r-p[0])*(r-p[0]) + (g-p[1])*(g-p[1]) + (b-p[2])*(b-p[2]);
+
+    for (; entry < end; entry++) {
+	p = index->palette + *entry*4;
+	d = (r-p[0])*(r-p[0]) + (g-p[1])*(g-p[1]) + (b-p[2])*(b-p[2]);
+	if (d < dbest) {
+	    dbest = d;
+	    best = *entry;
+	}
+    }
+
+    return best;
+}
+
+void
+ImagingPaletteIndexRelease(ImagingPaletteIndex index)
+{
+    int released;
+
+    if (!index)
+	return;
+
+    LOCK();
+    released = --index->refcount <= 0;
+    UNLOCK();
+
+    if (released)
+	index_delete(index);
+}
+
+void
+ImagingPaletteIndexClear(void)
+{
+    /* drop all retained indexes (indexes in use stay alive until
+       they're released) */
+
+    ImagingPaletteIndex index, drop;
+
+    LOCK();
+    drop = indexes;
+    indexes = NULL;
+    UNLOCK();
+
+    while (drop) {
+	index = drop;
+	drop = drop->next;
+	ImagingPaletteIndexRelease(index);
+    }
+}
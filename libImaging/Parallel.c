@@ -0,0 +1,221 @@
+/*
+ * The Python Imaging Library
+ * $Id$
+ *
+ * worker pool for row band processing
+ *
+ * Long-running primitives split their output into bands of rows (or
+ * columns), and hand them to ImagingParallel.  The bands are executed
+ * by a small pool of worker threads, with the calling thread taking
+ * part in the work.  Worker functions must not touch the Python API;
+ * they should only read the source image and write their own part of
+ * the destination image.
+ *
+ * If a second job is posted while the pool is busy (or from inside a
+ * worker), it is executed serially by the caller.  On platforms
+ * without POSIX threads, all jobs are executed serially.
+ *
+ * See the README file for information on usage and redistribution.
+ */
+
+
+#include "Imaging.h"
+
+#if defined(WITH_THREAD) && defined(HAVE_PTHREAD_H)
+#define WITH_WORKER_POOL
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define	MAX_THREADS	64
+
+/* requested number of threads (0 means not yet initialized) */
+static int threads = 0;
+
+int
+ImagingGetThreads(void)
+{
+    if (threads <= 0) {
+        int n = 1;
+#if defined(WITH_WORKER_POOL) && defined(_SC_NPROCESSORS_ONLN)
+        n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        if (n < 1)
+            n = 1;
+        else if (n > 16)
+            n = 16; /* be nice to the other processes on the box */
+        threads = n;
+    }
+    return threads;
+}
+
+int
+ImagingSetThreads(int count)
+{
+    int old = ImagingGetThreads();
+
+    if (count < 1)
+        count = 1;
+    else if (count > MAX_THREADS)
+        count = MAX_THREADS;
+
+    threads = count;
+
+    return old;
+}
+
+#ifdef WITH_WORKER_POOL
+
+/* only one job can run at any time */
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* protects the pool state below */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;
+
+static int workers = 0; /* number of running worker threads */
+static int atfork_installed = 0;
+
+/* current job */
+static ImagingWorker job_worker;
+static void* job_context;
+static int job_count, job_step;
+static int job_next, job_bands, job_pending;
+
+static void
+run_bands(void)
+{
+    /* execute bands from the current job (pool_lock must be held) */
+
+    ImagingWorker worker;
+    void* context;
+    int start, end;
+
+    while (job_next < job_bands) {
+
+        worker = job_worker;
+        context = job_context;
+
+        start = job_next++ * job_step;
+        end = start + job_step;
+        if (end > job_count)
+            end = job_count;
+
+        pthread_mutex_unlock(&pool_lock);
+
+        worker(context, start, end);
+
+        pthread_mutex_lock(&pool_lock);
+
+        if (--job_pending == 0)
+            pthread_cond_broadcast(&work_done);
+    }
+}
+
+static void*
+worker_main(void* arg)
+{
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        while (job_next >= job_bands)
+            pthread_cond_wait(&work_ready, &pool_lock);
+        run_bands();
+    }
+    return NULL;
+}
+
+static void
+atfork_child(void)
+{
+    /* the worker threads don't survive a fork; start over */
+    pthread_mutex_init(&job_lock, NULL);
+    pthread_mutex_init(&pool_lock, NULL);
+    pthread_cond_init(&work_ready, NULL);
+    pthread_cond_init(&work_done, NULL);
+    workers = 0;
+    job_next = job_bands = job_pending = 0;
+}
+
+static void
+start_workers(int count)
+{
+    /* make sure there are at least count workers (pool_lock must be
+       held).  if we cannot start more threads, we'll use what we
+       have. */
+
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (workers >= count)
+        return;
+
+    if (!atfork_installed) {
+        pthread_atfork(NULL, NULL, atfork_child);
+        atfork_installed = 1;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (workers < count) {
+        if (pthread_create(&thread, &attr, worker_main, NULL) != 0)
+            break;
+        workers++;
+    }
+
+    pthread_attr_destroy(&attr);
+}
+
+#endif
+
+void
+ImagingParallel(ImagingWorker worker, void* context, int count, int grain)
+{
+    /* call worker for each band in [0, count).  bands contain at
+       least grain items. */
+
+    int bands;
+
+    if (count <= 0)
+        return;
+
+    if (grain < 1)
+        grain = 1;
+
+    bands = count / grain;
+    if (bands > ImagingGetThreads())
+        bands = ImagingGetThreads();
+
+#ifdef WITH_WORKER_POOL
+    if (bands > 1 && pthread_mutex_trylock(&job_lock) == 0) {
+
+        pthread_mutex_lock(&pool_lock);
+
+        start_workers(bands - 1);
+
+        job_worker = worker;
+        job_context = context;
+        job_count = count;
+        job_step = (count + bands - 1) / bands;
+        job_bands = job_pending = (count + job_step - 1) / job_step;
+        job_next = 0;
+
+        pthread_cond_broadcast(&work_ready);
+
+        /* lend a hand */
+        run_bands();
+
+        while (job_pending > 0)
+            pthread_cond_wait(&work_done, &pool_lock);
+
+        pthread_mutex_unlock(&pool_lock);
+
+        pthread_mutex_unlock(&job_lock);
+
+        return;
+    }
+#endif
+
+    worker(context, 0, count);
+}
@@ -210,9 +210,9 @@ paste_mask_RGBa(Imaging imOut, Imaging imIn, Imaging imMask,
     }
 }
     
-int
-ImagingPaste(Imaging imOut, Imaging imIn, Imaging imMask,
-	     int dx0, int dy0, int dx1, int dy1)
+static int
+paste_image(Imaging imOut, Imaging imIn, Imaging imMask,
+            int dx0, int dy0, int dx1, int dy1)
 {
     int xsize, ysize;
     int pixelsize;
@@ -254,30 +254,33 @@ ImagingPaste(Imaging imOut, Imaging imIn, Imaging imMask,
     if (xsize <= 0 || ysize <= 0)
 	return 0;
 
+    if (ImagingDetach(imOut) < 0)
+	return -1;
+
     if (!imMask) {
         ImagingSectionEnter(&cookie);
         paste(imOut, imIn, dx0, dy0, sx0, sy0, xsize, ysize, pixelsize);
         ImagingSectionLeave(&cookie);
 
-    } else if (strcmp(imMask->mode, "1") == 0) {
+    } else if (imMask->modeid == IMAGING_MODE_1) {
         ImagingSectionEnter(&cookie);
         paste_mask_1(imOut, imIn, imMask, dx0, dy0, sx0, sy0,
                      xsize, ysize, pixelsize);
         ImagingSectionLeave(&cookie);
 
-    } else if (strcmp(imMask->mode, "L") == 0) {
+    } else if (imMask->modeid == IMAGING_MODE_L) {
         ImagingSectionEnter(&cookie);
         paste_mask_L(imOut, imIn, imMask, dx0, dy0, sx0, sy0,
                      xsize, ysize, pixelsize);
         ImagingSectionLeave(&cookie);
 
-    } else if (strcmp(imMask->mode, "RGBA") == 0) {
+    } else if (imMask->modeid == IMAGING_MODE_RGBA) {
         ImagingSectionEnter(&cookie);
         paste_mask_RGBA(imOut, imIn, imMask, dx0, dy0, sx0, sy0,
                         xsize, ysize, pixelsize);
         ImagingSectionLeave(&cookie);
 
-    } else if (strcmp(imMask->mode, "RGBa") == 0) {
+    } else if (imMask->modeid == IMAGING_MODE_RGBa) {
         ImagingSectionEnter(&cookie);
         paste_mask_RGBa(imOut, imIn, imMask, dx0, dy0, sx0, sy0,
                         xsize, ysize, pixelsize);
@@ -291,6 +294,20 @@ ImagingPaste(Imaging imOut, Imaging imIn, Imaging imMask,
     return 0;
 }
 
+int
+ImagingPaste(Imaging imOut, Imaging imIn, Imaging imMask,
+	     int dx0, int dy0, int dx1, int dy1)
+{
+    ImagingTraceCookie trace;
+    int status;
+
+    ImagingTraceBegin(&trace, "paste");
+    status = paste_image(imOut, imIn, imMask, dx0, dy0, dx1, dy1);
+    ImagingTraceEnd(&trace, (status == 0) ? (long) (dx1-dx0) * (dy1-dy0) : 0);
+
+    return status;
+}
+
 static inline void
 fill(Imaging imOut, const void* ink_, int dx, int dy,
      int xsize, int ysize, int pixelsize)
@@ -517,30 +534,33 @@ ImagingFill2(Imaging imOut, const void* ink, Imaging imMask,
     if (xsize <= 0 || ysize <= 0)
 	return 0;
 
+    if (ImagingDetach(imOut) < 0)
+	return -1;
+
     if (!imMask) {
         ImagingSectionEnter(&cookie);
         fill(imOut, ink, dx0, dy0, xsize, ysize, pixelsize);
         ImagingSectionLeave(&cookie);
 
-    } else if (strcmp(imMask->mode, "1") == 0) {
+    } else if (imMask->modeid == IMAGING_MODE_1) {
         ImagingSectionEnter(&cookie);
         fill_mask_1(imOut, ink, imMask, dx0, dy0, sx0, sy0,
                     xsize, ysize, pixelsize);
         ImagingSectionLeave(&cookie);
 
-    } else if (strcmp(imMask->mode, "L") == 0) {
+    } else if (imMask->modeid == IMAGING_MODE_L) {
         ImagingSectionEnter(&cookie);
         fill_mask_L(imOut, ink, imMask, dx0, dy0, sx0, sy0,
                     xsize, ysize, pixelsize);
         ImagingSectionLeave(&cookie);
 
-    } else if (strcmp(imMask->mode, "RGBA") == 0) {
+    } else if (imMask->modeid == IMAGING_MODE_RGBA) {
         ImagingSectionEnter(&cookie);
         fill_mask_RGBA(imOut, ink, imMask, dx0, dy0, sx0, sy0,
                        xsize, ysize, pixelsize);
         ImagingSectionLeave(&cookie);
 
-    } else if (strcmp(imMask->mode, "RGBa") == 0) {
+    } else if (imMask->modeid == IMAGING_MODE_RGBa) {
         ImagingSectionEnter(&cookie);
         fill_mask_RGBa(imOut, ink, imMask, dx0, dy0, sx0, sy0,
                        xsize, ysize, pixelsize);
@@ -0,0 +1,207 @@
+/*
+ * The Python Imaging Library
+ * $Id$
+ *
+ * streaming convert and resize
+ *
+ * A pipeline takes source lines one at a time, in order, converts
+ * them to the destination mode, and hands them to a streaming
+ * resampler (see Antialias.c), which writes the destination image.
+ * Only a few lines are buffered at any time, so converting and
+ * resizing a large image doesn't need any full-size intermediates.
+ *
+ * Decoders can feed a pipeline directly: install the staging image
+ * as the decoder target, and ImagingPipelineFeed as the shuffler.
+ * All staging lines point to a single line buffer that follows the
+ * pipeline header, which is how the shuffler finds its pipeline.
+ * This only works for decoders that deliver complete lines, top to
+ * bottom.
+ *
+ * See the README file for information on usage and redistribution.
+ */
+
+
+#include "Imaging.h"
+
+ImagingPipeline
+ImagingPipelineNew(Imaging imOut, const char* mode, int xsize, int ysize,
+                   int filter)
+{
+    ImagingPipeline pipeline;
+    const struct ImagingModeInstance* descr;
+    ImagingShuffler convert = NULL;
+    int y;
+
+    if (!imOut)
+        return (ImagingPipeline) ImagingError_ModeError();
+
+    descr = ImagingModeGet(ImagingModeId(mode));
+    if (!descr || !descr->storage)
+        return (ImagingPipeline) ImagingError_ModeError();
+
+    if (xsize <= 0 || ysize <= 0)
+        return (ImagingPipeline) ImagingError_ValueError("bad image size");
+
+    if (descr->id != imOut->modeid) {
+        convert = ImagingFindConverter(mode, imOut->mode);
+        if (!convert)
+            return (ImagingPipeline) ImagingError_ValueError(
+                "conversion not supported"
+                );
+    }
+
+    pipeline = calloc(1, sizeof(struct ImagingPipelineInstance) +
+                      xsize * descr->pixelsize);
+    if (!pipeline)
+        return (ImagingPipeline) ImagingError_MemoryError();
+
+    pipeline->imOut = imOut;
+    pipeline->modeid = descr->id;
+    pipeline->xsize = xsize;
+    pipeline->ysize = ysize;
+    pipeline->convert = convert;
+    pipeline->line = (UINT8*) (pipeline + 1);
+
+    if (xsize != imOut->xsize || ysize != imOut->ysize) {
+        pipeline->resampler = ImagingResamplerNew(imOut, xsize, ysize, filter);
+        if (!pipeline->resampler) {
+            ImagingPipelineDelete(pipeline);
+            return NULL;
+        }
+        if (convert) {
+            pipeline->buffer = ImagingPoolAlloc(xsize * imOut->pixelsize);
+            if (!pipeline->buffer)
+                goto nomemory;
+        }
+    }
+
+    /* set up the staging image */
+    strcpy(pipeline->staging.mode, descr->name);
+    pipeline->staging.modeid = descr->id;
+    pipeline->staging.type = descr->type;
+    pipeline->staging.bands = descr->bands;
+    pipeline->staging.pixelsize = descr->pixelsize;
+    pipeline->staging.xsize = xsize;
+    pipeline->staging.ysize = ysize;
+    pipeline->staging.linesize = xsize * descr->pixelsize;
+    pipeline->staging.stride = pipeline->staging.linesize;
+    pipeline->staging.image = malloc(ysize * sizeof(char*));
+    if (!pipeline->staging.image)
+        goto nomemory;
+    for (y = 0; y < ysize; y++)
+        pipeline->staging.image[y] = (char*) pipeline->line;
+    if (descr->pixelsize == 1)
+        pipeline->staging.image8 = (UINT8**) pipeline->staging.image;
+    else if (descr->pixelsize == 4)
+        pipeline->staging.image32 = (INT32**) pipeline->staging.image;
+
+    return pipeline;
+
+  nomemory:
+    ImagingPipelineDelete(pipeline);
+    return (ImagingPipeline) ImagingError_MemoryError();
+}
+
+int
+ImagingPipelinePush(ImagingPipeline pipeline, const UINT8* line)
+{
+    /* add the next source line.  extra lines are ignored.  returns -1
+       if out of memory, and sets the error flag (an exception may or
+       may not be raised) */
+
+    Imaging imOut = pipeline->imOut;
+    UINT8* out;
+    int y = pipeline->y;
+
+    if (y >= pipeline->ysize)
+        return 0;
+
+    /* the output image may be shared with a copy (the resampler takes
+       care of this itself) */
+    if (!pipeline->resampler && ImagingDetach(imOut) < 0) {
+        pipeline->error = 1;
+        return -1;
+    }
+
+    if (pipeline->convert) {
+        if (pipeline->resampler)
+            out = pipeline->buffer;
+        else
+            out = (UINT8*) imOut->image[y];
+        pipeline->convert(out, line, pipeline->xsize);
+        line = out;
+    } else if (!pipeline->resampler)
+        memcpy(imOut->image[y], line, imOut->linesize);
+
+    if (pipeline->resampler &&
+        ImagingResamplerPush(pipeline->resampler, (UINT8*) line) < 0) {
+        pipeline->error = 1;
+        return -1;
+    }
+
+    pipeline->y++;
+
+    return 0;
+}
+
+int
+ImagingPipelinePushImage(ImagingPipeline pipeline, Imaging im)
+{
+    /* add all lines from an image */
+
+    ImagingSectionCookie cookie;
+    int y, status = 0;
+
+    if (!im || im->modeid != pipeline->modeid) {
+        (void) ImagingError_ModeError();
+        return -1;
+    }
+
+    if (im->xsize != pipeline->xsize) {
+        (void) ImagingError_Mismatch();
+        return -1;
+    }
+
+    /* detach here, while we can still raise an exception; nothing can
+       share the output image while we're pushing lines */
+    if (ImagingDetach(pipeline->imOut) < 0)
+        return -1;
+
+    ImagingSectionEnter(&cookie);
+
+    for (y = 0; y < im->ysize && status == 0; y++)
+        status = ImagingPipelinePush(pipeline, (UINT8*) im->image[y]);
+
+    ImagingSectionLeave(&cookie);
+
+    if (status < 0)
+        (void) ImagingError_MemoryError();
+
+    return status;
+}
+
+void
+ImagingPipelineFeed(UINT8* out, const UINT8* in, int pixels)
+{
+    /* shuffler for decoders; out is the line buffer */
+
+    ImagingPipeline pipeline = (ImagingPipeline) out - 1;
+
+    pipeline->unpack(out, in, pixels);
+
+    /* the decoder cannot report errors; they're reported when the
+       image is fetched instead */
+    if (!pipeline->error && ImagingPipelinePush(pipeline, out) < 0)
+        ImagingError_Clear();
+}
+
+void
+ImagingPipelineDelete(ImagingPipeline pipeline)
+{
+    if (!pipeline)
+        return;
+    ImagingResamplerDelete(pipeline->resampler);
+    ImagingPoolFree(pipeline->buffer);
+    free(pipeline->staging.image);
+    free(pipeline);
+}
@@ -128,13 +128,13 @@ im_point_32_8(Imaging imOut, Imaging imIn, im_point_context* context)
     }
 }
 
-Imaging
-ImagingPoint(Imaging imIn, const char* mode, const void* table)
+static Imaging
+point_image(Imaging imOut, Imaging imIn, const char* mode, const void* table)
 {
-    /* lookup table transform */
+    /* lookup table transform.  all handlers work pixel by pixel, so
+       imOut can be the same image as imIn */
 
     ImagingSectionCookie cookie;
-    Imaging imOut;
     im_point_context context;
     void (*point)(Imaging imIn, Imaging imOut, im_point_context* context);
 
@@ -150,7 +150,7 @@ ImagingPoint(Imaging imIn, const char* mode, const void* table)
     } else if (!imIn->image8 && strcmp(imIn->mode, mode) != 0)
         goto mode_mismatch;
 
-    imOut = ImagingNew(mode, imIn->xsize, imIn->ysize);
+    imOut = ImagingNew2(mode, imOut, imIn);
     if (!imOut)
 	return NULL;
 
@@ -197,22 +197,40 @@ ImagingPoint(Imaging imIn, const char* mode, const void* table)
         );
 }
 
+Imaging
+ImagingPoint(Imaging imIn, const char* mode, const void* table)
+{
+    return point_image(NULL, imIn, mode, table);
+}
 
 Imaging
-ImagingPointTransform(Imaging imIn, double scale, double offset)
+ImagingPoint2(Imaging imOut, Imaging imIn, const void* table)
+{
+    /* the output mode is given by imOut */
+
+    if (!imOut)
+	return (Imaging) ImagingError_ValueError(NULL);
+
+    return point_image(imOut, imIn, imOut->mode, table);
+}
+
+
+Imaging
+ImagingPointTransform2(Imaging imOut, Imaging imIn,
+                       double scale, double offset)
 {
-    /* scale/offset transform */
+    /* scale/offset transform (imOut may be the same image as imIn) */
 
     ImagingSectionCookie cookie;
-    Imaging imOut;
+    int created = (imOut == NULL);
     int x, y;
 
-    if (!imIn || (strcmp(imIn->mode, "I") != 0 && 
-                  strcmp(imIn->mode, "I;16") != 0 && 
-                  strcmp(imIn->mode, "F") != 0))
+    if (!imIn || (imIn->modeid != IMAGING_MODE_I && 
+                  imIn->modeid != IMAGING_MODE_I_16 && 
+                  imIn->modeid != IMAGING_MODE_F))
 	return (Imaging) ImagingError_ModeError();
 
-    imOut = ImagingNew(imIn->mode, imIn->xsize, imIn->ysize);
+    imOut = ImagingNew2(imIn->mode, imOut, imIn);
     if (!imOut)
 	return NULL;
 
@@ -241,7 +259,7 @@ ImagingPointTransform(Imaging imIn, double scale, double offset)
         ImagingSectionLeave(&cookie);
         break;
     case IMAGING_TYPE_SPECIAL:
-        if (strcmp(imIn->mode,"I;16") == 0) {
+        if (imIn->modeid == IMAGING_MODE_I_16) {
             ImagingSectionEnter(&cookie);
             for (y = 0; y < imIn->ysize; y++) {
                 UINT16* in  = (UINT16 *)imIn->image[y];
@@ -255,9 +273,16 @@ ImagingPointTransform(Imaging imIn, double scale, double offset)
 	}
         /* FALL THROUGH */
     default:
-        ImagingDelete(imOut);
+        if (created)
+            ImagingDelete(imOut);
         return (Imaging) ImagingError_ValueError("internal error");
     }
 
     return imOut;
 }
+
+Imaging
+ImagingPointTransform(Imaging imIn, double scale, double offset)
+{
+    return ImagingPointTransform2(NULL, imIn, scale, offset);
+}
@@ -0,0 +1,316 @@
+/*
+ * The Python Imaging Library
+ * $Id$
+ *
+ * memory pool for image storage
+ *
+ * Pixel blocks, line buffers and pointer arrays are taken from (and
+ * returned to) a set of size classes.  Each class holds a free list
+ * of blocks of exactly the same size.  Classes are spaced four to an
+ * octave, so a block wastes at most 25% of its size.  All blocks
+ * start on an IMAGING_ALIGN byte boundary.
+ *
+ * Blocks are reference counted, so that several images can share the
+ * same lines.  ImagingPoolFree releases one reference.  Pinned blocks
+ * (e.g. blocks exported through the buffer interface) must not get
+ * any new references.
+ *
+ * Freed blocks are kept for reuse as long as the retention limits
+ * allow; the rest are returned to the C library.  No single class may
+ * use more than a quarter of the retained bytes, so that deleting a
+ * large line-array image doesn't crowd out everything else.  Blocks
+ * larger than the largest class are never pooled.
+ *
+ * See the README file for information on usage and redistribution.
+ */
+
+
+#include "Imaging.h"
+
+#if defined(WITH_THREAD) && defined(HAVE_PTHREAD_H)
+#define WITH_POOL_LOCK
+#include <pthread.h>
+#endif
+
+/* smallest class is 1 << MIN_SHIFT bytes, largest 2 << MAX_SHIFT */
+#define	MIN_SHIFT	6
+#define	MAX_SHIFT	28
+#define	CLASSES		((MAX_SHIFT - MIN_SHIFT + 1) * 4 + 1)
+
+/* default retention limits */
+#define	DEFAULT_MAX_BYTES	(32*1024*1024)
+#define	DEFAULT_MAX_BLOCK	(8*1024*1024)
+
+/* block header, stored right before the aligned user data */
+typedef struct {
+    void* base; /* as returned by malloc */
+    void* next; /* free list link */
+    size_t size; /* requested size */
+    int klass; /* size class, or -1 for unpooled blocks */
+    int refcount;
+    int pins;
+} Header;
+
+static Header* free_list[CLASSES];
+static long free_bytes[CLASSES];
+
+static struct ImagingPoolStats stats = {
+    0, 0, 0, 0, DEFAULT_MAX_BYTES, DEFAULT_MAX_BLOCK
+};
+
+#ifdef WITH_POOL_LOCK
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+#define	LOCK()		pthread_mutex_lock(&lock)
+#define	UNLOCK()	pthread_mutex_unlock(&lock)
+#else
+#define	LOCK()
+#define	UNLOCK()
+#endif
+
+static size_t
+class_size(int klass)
+{
+    /* 4, 5, 6, 7 << (shift-2) */
+    return (size_t) (4 + (klass & 3)) << (MIN_SHIFT - 2 + (klass >> 2));
+}
+
+static int
+size_class(size_t size)
+{
+    /* return smallest class that can hold size bytes, or -1 */
+
+    int shift;
+    size_t step;
+
+    if (size <= ((size_t) 1 << MIN_SHIFT))
+        return 0;
+
+    for (shift = MIN_SHIFT; shift <= MAX_SHIFT; shift++)
+        if (size <= ((size_t) 1 << (shift + 1)))
+            break;
+
+    if (shift > MAX_SHIFT)
+        return -1;
+
+    /* size is in (1 << shift, 2 << shift] */
+    step = (size_t) 1 << (shift - 2);
+
+    return (shift - MIN_SHIFT) * 4 + (int) ((size - 1) / step) - 3;
+}
+
+void*
+ImagingPoolAlloc(size_t size)
+{
+    Header* block;
+    char* base;
+    int klass;
+
+    klass = size_class(size);
+
+    if (klass >= 0) {
+
+        LOCK();
+        block = free_list[klass];
+        if (block) {
+            free_list[klass] = block->next;
+            free_bytes[klass] -= class_size(klass);
+            stats.hits++;
+            stats.retained_blocks--;
+            stats.retained_bytes -= class_size(klass);
+        } else
+            stats.misses++;
+        UNLOCK();
+
+        if (block) {
+            block->size = size;
+            block->refcount = 1;
+            block->pins = 0;
+            return block + 1;
+        }
+
+    } else {
+
+        LOCK();
+        stats.misses++;
+        UNLOCK();
+
+    }
+
+    base = malloc(sizeof(Header) + IMAGING_ALIGN - 1 +
+                  ((klass >= 0) ? class_size(klass) : size));
+    if (!base)
+        return NULL;
+
+    block = (Header*) (((size_t) base + sizeof(Header) + IMAGING_ALIGN - 1) &
+                       ~(size_t) (IMAGING_ALIGN - 1)) - 1;
+    block->base = base;
+    block->size = size;
+    block->klass = klass;
+    block->refcount = 1;
+    block->pins = 0;
+
+    return block + 1;
+}
+
+void*
+ImagingPoolCalloc(size_t size)
+{
+    void* p = ImagingPoolAlloc(size);
+    if (p)
+        memset(p, 0, size);
+    return p;
+}
+
+int
+ImagingPoolFree(void* p)
+{
+    /* release one reference.  returns 1 if this was the last one */
+
+    Header* block;
+    size_t size;
+    int klass, released;
+
+    if (!p)
+        return 0;
+
+    block = (Header*) p - 1;
+    klass = block->klass;
+
+    LOCK();
+    released = --block->refcount <= 0;
+    if (!released)
+        block = NULL; /* still in use */
+    else if (klass >= 0) {
+        size = class_size(klass);
+        if (size <= (size_t) stats.max_block &&
+            stats.retained_bytes + size <= (size_t) stats.max_bytes &&
+            free_bytes[klass] + size <= (size_t) stats.max_bytes / 4) {
+            block->next = free_list[klass];
+            free_list[klass] = block;
+            free_bytes[klass] += size;
+            stats.retained_blocks++;
+            stats.retained_bytes += size;
+            block = NULL;
+        }
+    }
+    UNLOCK();
+
+    if (block)
+        free(block->base);
+
+    return released;
+}
+
+size_t
+ImagingPoolSize(void* p)
+{
+    /* get the size requested for a block */
+
+    return ((Header*) p - 1)->size;
+}
+
+void
+ImagingPoolRef(void* p)
+{
+    /* add a reference to a block */
+
+    LOCK();
+    ((Header*) p - 1)->refcount++;
+    UNLOCK();
+}
+
+int
+ImagingPoolShared(void* p)
+{
+    /* check if a block has more than one reference */
+
+    int shared;
+
+    LOCK();
+    shared = ((Header*) p - 1)->refcount > 1;
+    UNLOCK();
+
+    return shared;
+}
+
+void
+ImagingPoolPin(void* p, int pin)
+{
+    /* pin (or unpin, if pin is negative) a block */
+
+    LOCK();
+    ((Header*) p - 1)->pins += pin;
+    UNLOCK();
+}
+
+int
+ImagingPoolPinned(void* p)
+{
+    int pinned;
+
+    LOCK();
+    pinned = ((Header*) p - 1)->pins > 0;
+    UNLOCK();
+
+    return pinned;
+}
+
+static void
+trim(void)
+{
+    /* release blocks until the pool is within its limits (lock must
+       be held).  big blocks go first. */
+
+    Header* block;
+    int klass;
+
+    for (klass = CLASSES-1; klass >= 0; klass--)
+        while ((block = free_list[klass]) &&
+               (class_size(klass) > (size_t) stats.max_block ||
+                free_bytes[klass] > stats.max_bytes / 4 ||
+                stats.retained_bytes > stats.max_bytes)) {
+            free_list[klass] = block->next;
+            free_bytes[klass] -= class_size(klass);
+            stats.retained_blocks--;
+            stats.retained_bytes -= class_size(klass);
+            free(block->base);
+        }
+}
+
+void
+ImagingPoolSetLimits(long max_bytes, long max_block)
+{
+    /* negative values leave the corresponding limit unchanged */
+
+    LOCK();
+    if (max_bytes >= 0)
+        stats.max_bytes = max_bytes;
+    if (max_block >= 0)
+        stats.max_block = max_block;
+    trim();
+    UNLOCK();
+}
+
+void
+ImagingPoolGetStats(struct ImagingPoolStats* out)
+{
+    LOCK();
+    *out = stats;
+    UNLOCK();
+}
+
+void
+ImagingPoolClear(void)
+{
+    /* release all retained blocks, and reset the counters */
+
+    long max_bytes;
+
+    LOCK();
+    max_bytes = stats.max_bytes;
+    stats.max_bytes = 0;
+    trim();
+    stats.max_bytes = max_bytes;
+    stats.hits = stats.misses = 0;
+    UNLOCK();
+}
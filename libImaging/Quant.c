@@ -1473,8 +1473,8 @@ error_1:
    return 0;
 }
 
-Imaging
-ImagingQuantize(Imaging im, int colors, int mode, int kmeans)
+static Imaging
+quantize_image(Imaging im, int colors, int mode, int kmeans)
 {
     int i, j;
     int x, y, v;
@@ -1608,3 +1608,16 @@ ImagingQuantize(Imaging im, int colors, int mode, int kmeans)
 
     }
 }
+
+Imaging
+ImagingQuantize(Imaging im, int colors, int mode, int kmeans)
+{
+    ImagingTraceCookie trace;
+    Imaging imOut;
+
+    ImagingTraceBegin(&trace, "quantize");
+    imOut = quantize_image(im, colors, mode, kmeans);
+    ImagingTraceEnd(&trace, imOut ? (long) imOut->xsize * imOut->ysize : 0);
+
+    return imOut;
+}
@@ -47,14 +47,146 @@ MakeRankFunction(UINT8)
 MakeRankFunction(INT32)
 MakeRankFunction(FLOAT32)
 
+/* Constant time rank filter for 8-bit images (after Perreault and
+   Hebert, "Median Filtering in Constant Time").  Each column has a
+   histogram of the size pixels currently in the window, and the
+   window histogram is maintained by adding and removing column
+   histograms as it slides along the line.  Histograms have two
+   levels: 16 coarse bins, which are kept up to date, and 256 fine
+   bins, where each group of 16 is only brought up to date when the
+   rank search needs it.  Each byte of a multiband pixel is filtered
+   separately. */
+
+struct rank_context {
+    Imaging im;
+    Imaging imOut;
+    int size;
+    int rank;
+    int error;
+};
+
+static void
+rank_lines8(void* context, int start, int end)
+{
+    struct rank_context* ctx = context;
+    Imaging im = ctx->im;
+    Imaging imOut = ctx->imOut;
+    int size = ctx->size;
+    int rank = ctx->rank;
+    int ps = im->pixelsize;
+    int xsize = im->xsize;
+    UINT16 *colf, *colc, *a, *b;
+    int hc[16], hf[256], last[16];
+    int band, x, y, i, k, cum;
+    UINT8 *in, *out;
+
+    /* column histograms (fine and coarse) */
+    colf = malloc(xsize * 256 * sizeof(UINT16));
+    colc = malloc(xsize * 16 * sizeof(UINT16));
+    if (!colf || !colc) {
+	ctx->error = 1;
+	goto done;
+    }
+
+    for (band = 0; band < ps; band++) {
+
+	memset(colf, 0, xsize * 256 * sizeof(UINT16));
+	memset(colc, 0, xsize * 16 * sizeof(UINT16));
+	for (y = start; y < start + size; y++) {
+	    in = (UINT8*) im->image[y] + band;
+	    for (x = 0; x < xsize; x++) {
+		colf[x*256 + in[x*ps]]++;
+		colc[x*16 + (in[x*ps] >> 4)]++;
+	    }
+	}
+
+	for (y = start; y < end; y++) {
+
+	    if (y > start) {
+		/* move the column histograms down one line */
+		UINT8* old = (UINT8*) im->image[y-1] + band;
+		in = (UINT8*) im->image[y+size-1] + band;
+		for (x = 0; x < xsize; x++) {
+		    colf[x*256 + old[x*ps]]--;
+		    colc[x*16 + (old[x*ps] >> 4)]--;
+		    colf[x*256 + in[x*ps]]++;
+		    colc[x*16 + (in[x*ps] >> 4)]++;
+		}
+	    }
+
+	    for (k = 0; k < 16; k++) {
+		hc[k] = 0;
+		last[k] = -size; /* fine bins out of date */
+	    }
+	    for (x = 0; x < size; x++)
+		for (k = 0; k < 16; k++)
+		    hc[k] += colc[x*16 + k];
+
+	    out = (UINT8*) imOut->image[y] + band;
+
+	    for (x = 0; x < imOut->xsize; x++) {
+
+		if (x > 0) {
+		    a = colc + (x+size-1)*16;
+		    b = colc + (x-1)*16;
+		    for (k = 0; k < 16; k++)
+			hc[k] += a[k] - b[k];
+		}
+
+		/* find the coarse bin */
+		cum = 0;
+		for (k = 0; k < 15; k++) {
+		    if (cum + hc[k] > rank)
+			break;
+		    cum += hc[k];
+		}
+
+		/* update the fine bins for that coarse bin */
+		if (x - last[k] >= size) {
+		    for (i = 0; i < 16; i++)
+			hf[k*16+i] = 0;
+		    for (a = colf + x*256 + k*16; a < colf + (x+size)*256;
+			 a += 256)
+			for (i = 0; i < 16; i++)
+			    hf[k*16+i] += a[i];
+		} else
+		    for (; last[k] < x; last[k]++) {
+			a = colf + (last[k]+size)*256 + k*16;
+			b = colf + last[k]*256 + k*16;
+			for (i = 0; i < 16; i++)
+			    hf[k*16+i] += a[i] - b[i];
+		    }
+		last[k] = x;
+
+		/* find the fine bin */
+		for (i = 0; i < 15; i++) {
+		    cum += hf[k*16+i];
+		    if (cum > rank)
+			break;
+		}
+
+		out[x*ps] = (UINT8) (k*16 + i);
+	    }
+	}
+    }
+
+  done:
+    free(colf);
+    free(colc);
+}
+
 Imaging
-ImagingRankFilter(Imaging im, int size, int rank)
+ImagingRankFilter2(Imaging imOut, Imaging im, int size, int rank)
 {
-    Imaging imOut = NULL;
+    /* the output is size-1 pixels smaller than the input in each
+       direction.  cannot be done in place. */
+
+    int created = (imOut == NULL);
     int x, y;
     int i, margin, size2;
 
-    if (!im || im->bands != 1 || im->type == IMAGING_TYPE_SPECIAL)
+    if (!im || im->type == IMAGING_TYPE_SPECIAL ||
+	(im->bands != 1 && im->type != IMAGING_TYPE_UINT8))
 	return (Imaging) ImagingError_ModeError();
 
     if (!(size & 1))
@@ -66,9 +198,23 @@ ImagingRankFilter(Imaging im, int size, int rank)
     if (rank < 0 || rank >= size2)
 	return (Imaging) ImagingError_ValueError("bad rank value");
 
-    imOut = ImagingNew(im->mode, im->xsize - 2*margin, im->ysize - 2*margin);
-    if (!imOut)
-	return NULL;
+    if (imOut) {
+        if (imOut == im)
+            return (Imaging) ImagingError_ValueError(
+                "cannot filter in place"
+                );
+        if (imOut->modeid != im->modeid ||
+            imOut->xsize != im->xsize - 2*margin ||
+            imOut->ysize != im->ysize - 2*margin)
+            return ImagingError_Mismatch();
+        if (ImagingDetach(imOut) < 0)
+            return NULL;
+    } else {
+        imOut = ImagingNew(im->mode, im->xsize - 2*margin,
+                           im->ysize - 2*margin);
+        if (!imOut)
+            return NULL;
+    }
 
 #define RANK_BODY(type) do {\
     type* buf = malloc(size2 * sizeof(type));\
@@ -83,7 +229,22 @@ ImagingRankFilter(Imaging im, int size, int rank)
         }\
 } while (0)
 
-    if (im->image8)
+    if (im->type == IMAGING_TYPE_UINT8 && (size > 3 || !im->image8)) {
+        ImagingSectionCookie cookie;
+        struct rank_context ctx;
+        ctx.im = im;
+        ctx.imOut = imOut;
+        ctx.size = size;
+        ctx.rank = rank;
+        ctx.error = 0;
+        ImagingSectionEnter(&cookie);
+        /* each band has to set up its own column histograms */
+        ImagingParallel(rank_lines8, &ctx, imOut->ysize,
+                        size + 65536 / (imOut->xsize + 1));
+        ImagingSectionLeave(&cookie);
+        if (ctx.error)
+            goto nomemory;
+    } else if (im->image8)
         RANK_BODY(UINT8);
     else if (im->type == IMAGING_TYPE_INT32)
         RANK_BODY(INT32);
@@ -91,7 +252,8 @@ ImagingRankFilter(Imaging im, int size, int rank)
         RANK_BODY(FLOAT32);
     else {
         /* safety net (we shouldn't end up here) */
-        ImagingDelete(imOut);
+        if (created)
+            ImagingDelete(imOut);
         return (Imaging) ImagingError_ModeError();
     }
     
@@ -100,6 +262,13 @@ ImagingRankFilter(Imaging im, int size, int rank)
     return imOut;
 
 nomemory:
-    ImagingDelete(imOut);
+    if (created)
+        ImagingDelete(imOut);
     return (Imaging) ImagingError_MemoryError();
 }
+
+Imaging
+ImagingRankFilter(Imaging im, int size, int rank)
+{
+    return ImagingRankFilter2(NULL, im, size, rank);
+}
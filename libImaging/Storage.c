@@ -37,9 +37,124 @@
 
 #include "Imaging.h"
 
+#if defined(HAVE_MMAP) && defined(HAVE_UNISTD_H)
+#define WITH_MAPPED_STORAGE
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#if defined(WITH_THREAD) && defined(HAVE_PTHREAD_H)
+#define WITH_STORAGE_LOCK
+#include <pthread.h>
+#endif
+
 
 int ImagingNewCount = 0;
 
+
+/* --------------------------------------------------------------------
+ * Memory accounting.  Each raster is charged to its storage type when
+ * it's allocated, and credited when the last image using it goes away
+ * (rasters shared by copies are only counted once).  The budget only
+ * applies to heap storage (block and array); mapped images are paged
+ * by the operating system.
+ */
+
+static struct ImagingMemoryStats memory;
+
+#ifdef WITH_STORAGE_LOCK
+static pthread_mutex_t memory_lock = PTHREAD_MUTEX_INITIALIZER;
+#define	LOCK()		pthread_mutex_lock(&memory_lock)
+#define	UNLOCK()	pthread_mutex_unlock(&memory_lock)
+#else
+#define	LOCK()
+#define	UNLOCK()
+#endif
+
+static int
+charge(int type, long bytes)
+{
+    /* returns 0 if the allocation would exceed the budget */
+
+    int bucket;
+
+    LOCK();
+
+    if (memory.budget > 0 && type != IMAGING_STORAGE_MAP &&
+        memory.bytes[IMAGING_STORAGE_BLOCK] +
+        memory.bytes[IMAGING_STORAGE_ARRAY] + bytes > memory.budget) {
+        memory.refused++;
+        UNLOCK();
+        return 0;
+    }
+
+    memory.live_bytes += bytes;
+    if (memory.live_bytes > memory.peak_bytes)
+        memory.peak_bytes = memory.live_bytes;
+
+    memory.bytes[type] += bytes;
+    memory.images[type]++;
+
+    ImagingTraceBytes(bytes);
+
+    for (bucket = 0; bucket < IMAGING_SIZE_BUCKETS-1; bucket++)
+        if ((bytes >> (bucket + 1)) == 0)
+            break;
+    memory.sizes[bucket]++;
+
+    UNLOCK();
+
+    return 1;
+}
+
+static void
+credit(int type, long bytes)
+{
+    LOCK();
+    memory.live_bytes -= bytes;
+    memory.bytes[type] -= bytes;
+    memory.images[type]--;
+    UNLOCK();
+}
+
+void
+ImagingMemoryGetStats(struct ImagingMemoryStats* out)
+{
+    LOCK();
+    *out = memory;
+    UNLOCK();
+}
+
+void
+ImagingMemoryResetPeak(void)
+{
+    LOCK();
+    memory.peak_bytes = memory.live_bytes;
+    UNLOCK();
+}
+
+long
+ImagingMemorySetBudget(long bytes)
+{
+    /* set heap budget (0 means unlimited).  returns the old budget */
+
+    long old;
+
+    if (bytes < 0)
+        bytes = 0;
+
+    LOCK();
+    old = memory.budget;
+    memory.budget = bytes;
+    UNLOCK();
+
+    return old;
+}
+
 /* --------------------------------------------------------------------
  * Standard image object.
  */
@@ -49,6 +164,7 @@ ImagingNewPrologueSubtype(const char *mode, unsigned xsize, unsigned ysize,
                           int size)
 {
     Imaging im;
+    const struct ImagingModeInstance* descr;
     ImagingSectionCookie cookie;
 
     im = (Imaging) calloc(1, size);
@@ -59,137 +175,36 @@ ImagingNewPrologueSubtype(const char *mode, unsigned xsize, unsigned ysize,
     im->xsize = xsize;
     im->ysize = ysize;
 
-    im->type = IMAGING_TYPE_UINT8;
+    descr = ImagingModeGet(ImagingModeId(mode));
+    if (!descr || !descr->storage) {
+        free(im);
+	return (Imaging) ImagingError_ValueError("unrecognized mode");
+    }
 
-    if (strcmp(mode, "1") == 0) {
-        /* 1-bit images */
-        im->bands = im->pixelsize = 1;
-        im->linesize = xsize;
+    im->modeid = descr->id;
+    im->type = descr->type;
+    im->bands = descr->bands;
+    im->pixelsize = descr->pixelsize;
 
-    } else if (strcmp(mode, "P") == 0) {
-        /* 8-bit palette mapped images */
-        im->bands = im->pixelsize = 1;
-        im->linesize = xsize;
-        im->palette = ImagingPaletteNew("RGB");
+    im->linesize = xsize * descr->pixelsize;
+    if (descr->padded)
+        im->linesize = (im->linesize + 3) & -4;
 
-    } else if (strcmp(mode, "PA") == 0) {
-        /* 8-bit palette with alpha */
-        im->bands = 2;
-        im->pixelsize = 4; /* store in image32 memory */
-        im->linesize = xsize * 4;
+    if (descr->palette)
         im->palette = ImagingPaletteNew("RGB");
 
-    } else if (strcmp(mode, "L") == 0) {
-        /* 8-bit greyscale (luminance) images */
-        im->bands = im->pixelsize = 1;
-        im->linesize = xsize;
-
-    } else if (strcmp(mode, "LA") == 0) {
-        /* 8-bit greyscale (luminance) with alpha */
-        im->bands = 2;
-        im->pixelsize = 4; /* store in image32 memory */
-        im->linesize = xsize * 4;
-
-    } else if (strcmp(mode, "F") == 0) {
-        /* 32-bit floating point images */
-        im->bands = 1;
-        im->pixelsize = 4;
-        im->linesize = xsize * 4;
-        im->type = IMAGING_TYPE_FLOAT32;
-
-    } else if (strcmp(mode, "I") == 0) {
-        /* 32-bit integer images */
-        im->bands = 1;
-        im->pixelsize = 4;
-        im->linesize = xsize * 4;
-        im->type = IMAGING_TYPE_INT32;
-
-    } else if (strcmp(mode, "I;16") == 0 || strcmp(mode, "I;16L") == 0 || strcmp(mode, "I;16B") == 0) {
-        /* EXPERIMENTAL */
-        /* 16-bit raw integer images */
-        im->bands = 1;
-        im->pixelsize = 2;
-        im->linesize = xsize * 2;
-        im->type = IMAGING_TYPE_SPECIAL;
-
-    } else if (strcmp(mode, "RGB") == 0) {
-        /* 24-bit true colour images */
-        im->bands = 3;
-        im->pixelsize = 4;
-        im->linesize = xsize * 4;
-
-    } else if (strcmp(mode, "BGR;15") == 0) {
-        /* EXPERIMENTAL */
-        /* 15-bit true colour */
-        im->bands = 1;
-        im->pixelsize = 2;
-        im->linesize = (xsize*2 + 3) & -4;
-        im->type = IMAGING_TYPE_SPECIAL;
-
-    } else if (strcmp(mode, "BGR;16") == 0) {
-        /* EXPERIMENTAL */
-        /* 16-bit reversed true colour */
-        im->bands = 1;
-        im->pixelsize = 2;
-        im->linesize = (xsize*2 + 3) & -4;
-        im->type = IMAGING_TYPE_SPECIAL;
-
-    } else if (strcmp(mode, "BGR;24") == 0) {
-        /* EXPERIMENTAL */
-        /* 24-bit reversed true colour */
-        im->bands = 1;
-        im->pixelsize = 3;
-        im->linesize = (xsize*3 + 3) & -4;
-        im->type = IMAGING_TYPE_SPECIAL;
-
-    } else if (strcmp(mode, "BGR;32") == 0) {
-        /* EXPERIMENTAL */
-        /* 32-bit reversed true colour */
-        im->bands = 1;
-        im->pixelsize = 4;
-        im->linesize = (xsize*4 + 3) & -4;
-        im->type = IMAGING_TYPE_SPECIAL;
-
-    } else if (strcmp(mode, "RGBX") == 0) {
-        /* 32-bit true colour images with padding */
-        im->bands = im->pixelsize = 4;
-        im->linesize = xsize * 4;
-
-    } else if (strcmp(mode, "RGBA") == 0) {
-        /* 32-bit true colour images with alpha */
-        im->bands = im->pixelsize = 4;
-        im->linesize = xsize * 4;
-
-    } else if (strcmp(mode, "RGBa") == 0) {
-        /* EXPERIMENTAL */
-        /* 32-bit true colour images with premultiplied alpha */
-        im->bands = im->pixelsize = 4;
-        im->linesize = xsize * 4;
-
-    } else if (strcmp(mode, "CMYK") == 0) {
-        /* 32-bit colour separation */
-        im->bands = im->pixelsize = 4;
-        im->linesize = xsize * 4;
-
-    } else if (strcmp(mode, "YCbCr") == 0) {
-        /* 24-bit video format */
-        im->bands = 3;
-        im->pixelsize = 4;
-        im->linesize = xsize * 4;
+    strcpy(im->mode, descr->name);
 
-    } else {
-        free(im);
-	return (Imaging) ImagingError_ValueError("unrecognized mode");
-    }
-
-    /* Setup image descriptor */
-    strcpy(im->mode, mode);
+    /* no padding, unless the allocator says otherwise */
+    im->stride = im->linesize;
 
     ImagingSectionEnter(&cookie);
 
     /* Pointer array (allocate at least one line, to avoid MemoryError
        exceptions on platforms where calloc(0, x) returns NULL) */
-    im->image = (char **) calloc((ysize > 0) ? ysize : 1, sizeof(void *));
+    im->image = (char **) ImagingPoolCalloc(
+        ((ysize > 0) ? ysize : 1) * sizeof(void *)
+        );
 
     ImagingSectionLeave(&cookie);
 
@@ -246,12 +261,28 @@ ImagingDelete(Imaging im)
 	im->destroy(im);
 
     if (im->image)
-	free(im->image);
+	ImagingPoolFree(im->image);
 
     free(im);
 }
 
 
+/* Both storage types below pad each line to a multiple of IMAGING_ALIGN
+   bytes, and the pool hands out blocks that start on such a boundary,
+   so every line is aligned.  Lines shorter than that are not padded
+   (that would make narrow images many times larger); only the first
+   line is aligned.  Vectorized kernels may read and write the full
+   stride. */
+
+static int
+padded_linesize(Imaging im)
+{
+    if (im->linesize < IMAGING_ALIGN)
+        return im->linesize;
+    return (im->linesize + IMAGING_ALIGN - 1) & ~(IMAGING_ALIGN - 1);
+}
+
+
 /* Array Storage Type */
 /* ------------------ */
 /* Allocate image as an array of line buffers. */
@@ -264,7 +295,9 @@ ImagingDestroyArray(Imaging im)
     if (im->image)
 	for (y = 0; y < im->ysize; y++)
 	    if (im->image[y])
-		free(im->image[y]);
+		ImagingPoolFree(im->image[y]);
+
+    credit(IMAGING_STORAGE_ARRAY, (long) im->ysize * im->stride);
 }
 
 Imaging
@@ -280,11 +313,18 @@ ImagingNewArray(const char *mode, int xsize, int ysize)
     if (!im)
 	return NULL;
 
+    im->stride = padded_linesize(im);
+
+    if (!charge(IMAGING_STORAGE_ARRAY, (long) im->ysize * im->stride)) {
+        ImagingDelete(im);
+	return (Imaging) ImagingError_MemoryError();
+    }
+
     ImagingSectionEnter(&cookie);
 
     /* Allocate image as an array of lines */
     for (y = 0; y < im->ysize; y++) {
-	p = (char *) malloc(im->linesize);
+	p = (char *) ImagingPoolAlloc(im->stride);
 	if (!p) {
 	    ImagingDestroyArray(im);
 	    break;
@@ -305,11 +345,22 @@ ImagingNewArray(const char *mode, int xsize, int ysize)
 /* ------------------ */
 /* Allocate image as a single block. */
 
+static void
+release_raster(char* raster)
+{
+    /* release a block image raster (which may be shared) */
+
+    long bytes = (long) ImagingPoolSize(raster);
+
+    if (ImagingPoolFree(raster))
+        credit(IMAGING_STORAGE_BLOCK, bytes);
+}
+
 static void
 ImagingDestroyBlock(Imaging im)
 {
     if (im->block)
-	free(im->block);
+	release_raster(im->block);
 }
 
 Imaging
@@ -324,19 +375,28 @@ ImagingNewBlock(const char *mode, int xsize, int ysize)
 	return NULL;
 
     /* Use a single block */
-    bytes = im->ysize * im->linesize;
+    im->stride = padded_linesize(im);
+    bytes = im->ysize * im->stride;
     if (bytes <= 0)
         /* some platforms return NULL for malloc(0); this fix
            prevents MemoryError on zero-sized images on such
            platforms */
         bytes = 1;
-    im->block = (char *) malloc(bytes);
+
+    if (!charge(IMAGING_STORAGE_BLOCK, bytes)) {
+        ImagingDelete(im);
+	return (Imaging) ImagingError_MemoryError();
+    }
+
+    im->block = (char *) ImagingPoolAlloc(bytes);
+    if (!im->block)
+        credit(IMAGING_STORAGE_BLOCK, bytes);
 
     if (im->block) {
 
 	for (y = i = 0; y < im->ysize; y++) {
 	    im->image[y] = im->block + i;
-	    i += im->linesize;
+	    i += im->stride;
 	}
 
 	im->destroy = ImagingDestroyBlock;
@@ -346,6 +406,528 @@ ImagingNewBlock(const char *mode, int xsize, int ysize)
     return ImagingNewEpilogue(im);
 }
 
+
+/* Shared Storage Type */
+/* ------------------- */
+/* Share lines with a block image, or a region of it.  The block is
+   reference counted, and the first write to either image gives that
+   image a private copy of its lines (see ImagingDetach). */
+
+typedef struct {
+    struct ImagingMemoryInstance im;
+    char* raster; /* the block holding the lines */
+} ImagingSharedInstance;
+
+/* a shared image keeps the whole block alive, so regions smaller than
+   1/SHARE_FRACTION of the block are not shared (the caller copies them
+   instead) */
+#define SHARE_FRACTION 4
+
+static void
+ImagingDestroyShared(Imaging im)
+{
+    release_raster(((ImagingSharedInstance*) im)->raster);
+}
+
+static char*
+shared_raster(Imaging im)
+{
+    /* get the block holding the lines, or NULL if the storage type
+       doesn't support sharing */
+
+    if (im->destroy == ImagingDestroyBlock)
+        return im->block;
+    if (im->destroy == ImagingDestroyShared)
+        return ((ImagingSharedInstance*) im)->raster;
+    return NULL;
+}
+
+Imaging
+ImagingNewShared(Imaging imIn, int x0, int y0, int xsize, int ysize)
+{
+    /* create an image sharing lines with the given region of imIn
+       (which must be inside the image, and not too small compared to
+       the block holding it) */
+
+    Imaging im;
+    char* raster;
+    int y, offset;
+
+    raster = shared_raster(imIn);
+    if (!raster || ImagingPoolPinned(raster))
+        return (Imaging) ImagingError_ValueError("cannot share storage");
+
+    if (x0 < 0 || y0 < 0 || xsize < 0 || ysize < 0 ||
+        x0 + xsize > imIn->xsize || y0 + ysize > imIn->ysize)
+        return (Imaging) ImagingError_ValueError("region outside image");
+
+    if ((double) xsize * ysize * imIn->pixelsize * SHARE_FRACTION <
+        (double) ImagingPoolSize(raster))
+        return (Imaging) ImagingError_ValueError("region too small to share");
+
+    im = ImagingNewPrologueSubtype(
+        imIn->mode, xsize, ysize, sizeof(ImagingSharedInstance)
+        );
+    if (!im)
+        return NULL;
+
+    /* lines are as far apart as in the source, but if x0 is not zero,
+       they're no longer aligned */
+    im->stride = imIn->stride;
+
+    offset = x0 * im->pixelsize;
+    for (y = 0; y < ysize; y++)
+        im->image[y] = imIn->image[y0 + y] + offset;
+
+    ImagingPoolRef(raster);
+    ((ImagingSharedInstance*) im)->raster = raster;
+
+    im->destroy = ImagingDestroyShared;
+
+    return ImagingNewEpilogue(im);
+}
+
+int
+ImagingDetach(Imaging im)
+{
+    /* make sure im has lines of its own.  this must be called
+       before modifying an existing image.  returns -1 if we're out
+       of memory. */
+
+    ImagingSectionCookie cookie;
+    char* raster;
+    char* block;
+    int y, stride, bytes;
+
+    raster = shared_raster(im);
+    if (!raster || !ImagingPoolShared(raster))
+        return 0;
+
+    stride = padded_linesize(im);
+    bytes = im->ysize * stride;
+    if (bytes <= 0)
+        bytes = 1;
+
+    if (!charge(IMAGING_STORAGE_BLOCK, bytes)) {
+        (void) ImagingError_MemoryError();
+        return -1;
+    }
+
+    block = (char *) ImagingPoolAlloc(bytes);
+    if (!block) {
+        credit(IMAGING_STORAGE_BLOCK, bytes);
+        (void) ImagingError_MemoryError();
+        return -1;
+    }
+
+    ImagingSectionEnter(&cookie);
+
+    for (y = 0; y < im->ysize; y++) {
+        memcpy(block + y * stride, im->image[y], im->linesize);
+        im->image[y] = block + y * stride;
+    }
+
+    ImagingSectionLeave(&cookie);
+
+    release_raster(raster);
+
+    im->block = block;
+    im->stride = stride;
+    im->destroy = ImagingDestroyBlock;
+
+    return 0;
+}
+
+int
+ImagingPin(Imaging im)
+{
+    /* keep the lines where they are, and don't share them with other
+       images, until ImagingUnpin is called.  use this when handing
+       out pointers to the pixels.  returns -1 if we're out of
+       memory. */
+
+    char* raster;
+
+    if (ImagingDetach(im) < 0)
+        return -1;
+
+    raster = shared_raster(im);
+    if (raster)
+        ImagingPoolPin(raster, 1);
+
+    return 0;
+}
+
+void
+ImagingUnpin(Imaging im)
+{
+    char* raster;
+
+    raster = shared_raster(im);
+    if (raster)
+        ImagingPoolPin(raster, -1);
+}
+
+
+/* External Storage Type */
+/* --------------------- */
+/* Wrap pixels owned by someone else.  The release function is called
+   (with the given context) when the image is deleted. */
+
+typedef struct {
+    struct ImagingMemoryInstance im;
+    void (*release)(void* context);
+    void* context;
+} ImagingExternalInstance;
+
+static void
+ImagingDestroyExternal(Imaging im)
+{
+    ImagingExternalInstance* external = (ImagingExternalInstance*) im;
+
+    if (external->release)
+        external->release(external->context);
+}
+
+Imaging
+ImagingNewExternal(const char* mode, int xsize, int ysize,
+                   char* data, int stride, int readonly,
+                   void (*release)(void* context), void* context)
+{
+    /* lines are stride bytes apart (linesize, if stride is zero).  if
+       this fails, the release function is not called. */
+
+    Imaging im;
+    int y;
+
+    im = ImagingNewPrologueSubtype(
+        mode, xsize, ysize, sizeof(ImagingExternalInstance)
+        );
+    if (!im)
+        return NULL;
+
+    if (stride <= 0)
+        stride = im->linesize;
+    else if (stride < im->linesize) {
+        ImagingDelete(im);
+        return (Imaging) ImagingError_ValueError("stride too small");
+    }
+
+    im->stride = stride;
+    im->readonly = readonly;
+
+    for (y = 0; y < ysize; y++)
+        im->image[y] = data + (size_t) y * stride;
+
+    ((ImagingExternalInstance*) im)->release = release;
+    ((ImagingExternalInstance*) im)->context = context;
+
+    im->destroy = ImagingDestroyExternal;
+
+    return ImagingNewEpilogue(im);
+}
+
+
+/* Mapped Storage Types */
+/* -------------------- */
+/* Map image from a file.  The operating system pages the lines in
+   when they're first touched, and writes them back to the file under
+   memory pressure, so images can be larger than physical memory.
+
+   Virtual images use an anonymous temporary file, which is removed as
+   soon as it has been mapped, and disappears with the mapping. */
+
+typedef struct {
+    struct ImagingMemoryInstance im;
+    char* base;
+    size_t size;
+} ImagingMappedInstance;
+
+/* images larger than this are allocated as virtual images (0 means
+   never, -1 means not yet initialized) */
+static long virtual_threshold = -1;
+
+long
+ImagingGetVirtualThreshold(void)
+{
+    if (virtual_threshold < 0) {
+        double bytes = 0.0;
+#if defined(WITH_MAPPED_STORAGE) && defined(_SC_PHYS_PAGES)
+        /* default is half the physical memory */
+        bytes = (double) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+#endif
+        if (bytes <= 0.0 || bytes > (double) LONG_MAX)
+            bytes = 0.0;
+        virtual_threshold = (long) bytes;
+    }
+    return virtual_threshold;
+}
+
+long
+ImagingSetVirtualThreshold(long bytes)
+{
+    long old = ImagingGetVirtualThreshold();
+
+    if (bytes < 0)
+        bytes = 0;
+
+    virtual_threshold = bytes;
+
+    return old;
+}
+
+#ifdef WITH_MAPPED_STORAGE
+
+static void
+ImagingDestroyMapped(Imaging im)
+{
+    ImagingMappedInstance* mapped = (ImagingMappedInstance*) im;
+
+    munmap(mapped->base, mapped->size);
+
+    credit(IMAGING_STORAGE_MAP, (long) mapped->size);
+}
+
+static int
+reserve_file(int fd, off_t offset, off_t size)
+{
+    /* allocate disk space for a range at the end of a file, extending
+       the file as necessary.  a sparse file works too, until the disk
+       (or tmpfs) runs full; after that, writing to a new page of the
+       mapping raises SIGBUS instead of an exception.  returns 0 on
+       success. */
+
+#if defined(_POSIX_ADVISORY_INFO) && _POSIX_ADVISORY_INFO > 0
+    return posix_fallocate(fd, offset, size);
+#else
+    static const char zeros[8192];
+    ssize_t n;
+    while (size > 0) {
+        n = pwrite(fd, zeros, (size < (off_t) sizeof(zeros)) ?
+                   (size_t) size : sizeof(zeros), offset);
+        if (n <= 0)
+            return -1;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+#endif
+}
+
+static int
+map_lines(Imaging im, int fd, int readonly)
+{
+    /* map the first ysize*stride bytes of the file, and point the
+       lines into the mapping.  returns 0 on failure (the caller owns
+       the file descriptor in either case). */
+
+    ImagingMappedInstance* mapped = (ImagingMappedInstance*) im;
+    void* base;
+    size_t size;
+    int y;
+
+    size = (size_t) im->ysize * im->stride;
+    if (size == 0)
+        size = 1;
+
+    base = mmap(NULL, size, readonly ? PROT_READ : PROT_READ|PROT_WRITE,
+                MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+        return 0;
+
+    mapped->base = (char*) base;
+    mapped->size = size;
+
+    charge(IMAGING_STORAGE_MAP, (long) size);
+
+    for (y = 0; y < im->ysize; y++)
+        im->image[y] = mapped->base + (size_t) y * im->stride;
+
+    im->destroy = ImagingDestroyMapped;
+
+    return 1;
+}
+
+Imaging
+ImagingNewVirtual(const char *mode, int xsize, int ysize)
+{
+    Imaging im;
+    ImagingSectionCookie cookie;
+
+    const char* dir;
+    char* filename;
+    off_t size;
+    int fd, ok, full;
+
+    im = ImagingNewPrologueSubtype(
+        mode, xsize, ysize, sizeof(ImagingMappedInstance)
+        );
+    if (!im)
+	return NULL;
+
+    im->stride = padded_linesize(im);
+
+    dir = getenv("TMPDIR");
+    if (!dir || !*dir)
+        dir = "/tmp";
+
+    filename = malloc(strlen(dir) + 20);
+    if (!filename) {
+        ImagingDelete(im);
+	return (Imaging) ImagingError_MemoryError();
+    }
+    sprintf(filename, "%s/pilXXXXXX", dir);
+
+    ImagingSectionEnter(&cookie);
+
+    ok = full = 0;
+
+    size = (off_t) im->ysize * im->stride;
+    if (size == 0)
+        size = 1;
+
+    fd = mkstemp(filename);
+    if (fd >= 0) {
+        unlink(filename);
+        if (reserve_file(fd, 0, size) == 0)
+            ok = map_lines(im, fd, 0);
+        else
+            full = 1;
+        close(fd); /* the mapping keeps the file alive */
+    }
+
+    ImagingSectionLeave(&cookie);
+
+    free(filename);
+
+    if (!ok) {
+        ImagingDelete(im);
+        if (full)
+            return (Imaging) ImagingError_MemoryError();
+	return (Imaging) ImagingError_IOError();
+    }
+
+    return ImagingNewEpilogue(im);
+}
+
+Imaging
+ImagingNewMap(const char* filename, int readonly,
+              const char* mode, int xsize, int ysize)
+{
+    /* map a raw image file (lines stored back to back, without
+       padding).  unless readonly is set, the file is created or
+       extended as necessary (with disk space allocated for the new
+       part), and changes to the image are written to the file. */
+
+    Imaging im;
+    ImagingSectionCookie cookie;
+
+    struct stat st;
+    off_t size;
+    int fd, ok;
+
+    im = ImagingNewPrologueSubtype(
+        mode, xsize, ysize, sizeof(ImagingMappedInstance)
+        );
+    if (!im)
+	return NULL;
+
+    size = (off_t) im->ysize * im->linesize;
+
+    ImagingSectionEnter(&cookie);
+
+    ok = 0;
+
+    if (readonly)
+        fd = open(filename, O_RDONLY);
+    else
+        fd = open(filename, O_RDWR|O_CREAT, 0666);
+
+    if (fd >= 0) {
+        if (fstat(fd, &st) == 0) {
+            if (st.st_size >= size)
+                ok = 1;
+            else if (!readonly)
+                ok = (reserve_file(fd, st.st_size, size - st.st_size) == 0);
+        }
+        if (ok)
+            ok = map_lines(im, fd, readonly);
+        close(fd);
+    }
+
+    ImagingSectionLeave(&cookie);
+
+    if (!ok) {
+        ImagingDelete(im);
+	return (Imaging) ImagingError_IOError();
+    }
+
+    im->readonly = readonly;
+
+    return ImagingNewEpilogue(im);
+}
+
+int
+ImagingMapAdvise(Imaging im, int advice)
+{
+    /* tell the system how a mapped image will be accessed.  returns
+       0 if the image isn't mapped, or if the hint was rejected. */
+
+    ImagingMappedInstance* mapped = (ImagingMappedInstance*) im;
+
+    if (im->destroy != ImagingDestroyMapped)
+        return 0;
+
+    switch (advice) {
+    case IMAGING_ACCESS_NORMAL:
+        advice = MADV_NORMAL;
+        break;
+    case IMAGING_ACCESS_SEQUENTIAL:
+        advice = MADV_SEQUENTIAL;
+        break;
+    case IMAGING_ACCESS_RANDOM:
+        advice = MADV_RANDOM;
+        break;
+    case IMAGING_ACCESS_WILLNEED:
+        advice = MADV_WILLNEED;
+        break;
+    case IMAGING_ACCESS_DONTNEED:
+        advice = MADV_DONTNEED;
+        break;
+    default:
+        return 0;
+    }
+
+    return madvise(mapped->base, mapped->size, advice) == 0;
+}
+
+#else
+
+Imaging
+ImagingNewVirtual(const char *mode, int xsize, int ysize)
+{
+    return (Imaging) ImagingError_ValueError(
+        "virtual storage not supported on this platform"
+        );
+}
+
+Imaging
+ImagingNewMap(const char* filename, int readonly,
+              const char* mode, int xsize, int ysize)
+{
+    return (Imaging) ImagingError_ValueError(
+        "memory mapping not supported on this platform"
+        );
+}
+
+int
+ImagingMapAdvise(Imaging im, int advice)
+{
+    return 0;
+}
+
+#endif
+
 /* --------------------------------------------------------------------
  * Create a new, internally allocated, image.
  */
@@ -359,6 +941,7 @@ Imaging
 ImagingNew(const char* mode, int xsize, int ysize)
 {
     int bytes;
+    long threshold;
     Imaging im;
 
     if (strlen(mode) == 1) {
@@ -377,6 +960,15 @@ ImagingNew(const char* mode, int xsize, int ysize)
         ImagingError_Clear();
     }
 
+    threshold = ImagingGetVirtualThreshold();
+    if (threshold > 0 && (double) xsize * ysize * bytes > threshold) {
+        im = ImagingNewVirtual(mode, xsize, ysize);
+        if (im)
+            return im;
+        /* no room for the file; try the heap instead */
+        ImagingError_Clear();
+    }
+
     return ImagingNewArray(mode, xsize, ysize);
 }
 
@@ -392,6 +984,9 @@ ImagingNew2(const char* mode, Imaging imOut, Imaging imIn)
             || imOut->ysize != imIn->ysize) {
             return ImagingError_Mismatch();
         }
+        /* the caller is about to overwrite it */
+        if (ImagingDetach(imOut) < 0)
+            return NULL;
     } else {
         /* create new image */
         imOut = ImagingNew(mode, imIn->xsize, imIn->ysize);
@@ -405,7 +1000,7 @@ ImagingNew2(const char* mode, Imaging imOut, Imaging imIn)
 void
 ImagingCopyInfo(Imaging destination, Imaging source)
 {
-    if (source->palette) {
+    if (source->palette && destination != source) {
         if (destination->palette)
             ImagingPaletteDelete(destination->palette);
 	destination->palette = ImagingPaletteDuplicate(source->palette);
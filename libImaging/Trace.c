@@ -0,0 +1,274 @@
+/*
+ * The Python Imaging Library
+ * $Id$
+ *
+ * operation tracing
+ *
+ * Instrumented primitives bracket their work with ImagingTraceBegin
+ * and ImagingTraceEnd (see Imaging.h).  When tracing is enabled, each
+ * call adds a record to a ring buffer owned by the calling thread, so
+ * threads never wait for each other.  The oldest records are dropped
+ * if the ring is not collected in time.  Rings of threads that have
+ * exited are released once they've been drained.
+ *
+ * When tracing is disabled, the cost is a test of a global flag per
+ * call.  Defining WITHOUT_TRACING removes even that.
+ *
+ * See the README file for information on usage and redistribution.
+ */
+
+
+#include "Imaging.h"
+
+#if defined(WITH_THREAD) && defined(HAVE_PTHREAD_H)
+#define WITH_TRACE_KEY
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_GETTIMEOFDAY
+#include <sys/time.h>
+#else
+#include <time.h>
+#endif
+
+#define	RING_SIZE	256
+
+int ImagingTraceEnabled = 0;
+
+int
+ImagingSetTrace(int enabled)
+{
+    int old = ImagingTraceEnabled;
+
+#ifdef WITH_TRACING
+    ImagingTraceEnabled = (enabled != 0);
+#endif
+
+    return old;
+}
+
+#ifdef WITH_TRACING
+
+typedef struct Ring {
+    struct Ring* next;
+    int thread;
+    int head; /* next record to write */
+    int count; /* records waiting to be collected */
+    int dead; /* owner has exited */
+    long bytes; /* image memory allocated by the owner */
+#ifdef WITH_TRACE_KEY
+    pthread_mutex_t lock;
+#endif
+    ImagingTraceRecord records[RING_SIZE];
+} Ring;
+
+static Ring* rings = NULL;
+static int ring_count = 0;
+
+#ifdef WITH_TRACE_KEY
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+#define	LOCK(lock)	pthread_mutex_lock(lock)
+#define	UNLOCK(lock)	pthread_mutex_unlock(lock)
+
+static void
+ring_exit(void* p)
+{
+    /* called when the owner exits; leave the ring to the collector */
+
+    Ring* ring = (Ring*) p;
+
+    LOCK(&ring->lock);
+    ring->dead = 1;
+    UNLOCK(&ring->lock);
+}
+
+static void
+make_key(void)
+{
+    pthread_key_create(&ring_key, ring_exit);
+}
+
+static Ring*
+get_ring(void)
+{
+    Ring* ring;
+
+    pthread_once(&ring_once, make_key);
+
+    ring = (Ring*) pthread_getspecific(ring_key);
+    if (ring)
+        return ring;
+
+    ring = calloc(1, sizeof(Ring));
+    if (!ring)
+        return NULL;
+
+    pthread_mutex_init(&ring->lock, NULL);
+
+    LOCK(&rings_lock);
+    ring->thread = ++ring_count;
+    ring->next = rings;
+    rings = ring;
+    UNLOCK(&rings_lock);
+
+    pthread_setspecific(ring_key, ring);
+
+    return ring;
+}
+
+#else
+
+#define	LOCK(lock)
+#define	UNLOCK(lock)
+
+static Ring*
+get_ring(void)
+{
+    static Ring ring;
+
+    if (!rings) {
+        ring.thread = ++ring_count;
+        rings = &ring;
+    }
+
+    return rings;
+}
+
+#endif
+
+static double
+now(void)
+{
+#ifdef HAVE_GETTIMEOFDAY
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+#else
+    return (double) time(NULL);
+#endif
+}
+
+void
+ImagingTraceStart(ImagingTraceCookie* cookie, const char* op)
+{
+    Ring* ring = get_ring();
+    if (!ring)
+        return;
+
+    cookie->active = 1;
+    cookie->op = op;
+    cookie->bytes = ring->bytes;
+    cookie->start = now();
+}
+
+void
+ImagingTraceStop(ImagingTraceCookie* cookie, long pixels)
+{
+    ImagingTraceRecord* record;
+    double t;
+    Ring* ring;
+
+    t = now();
+
+    ring = get_ring();
+    if (!ring)
+        return;
+
+    LOCK(&ring->lock);
+
+    record = &ring->records[ring->head];
+    record->op = cookie->op;
+    record->thread = ring->thread;
+    record->start = cookie->start;
+    record->time = t - cookie->start;
+    record->pixels = pixels;
+    record->bytes = ring->bytes - cookie->bytes;
+
+    ring->head = (ring->head + 1) % RING_SIZE;
+    if (ring->count < RING_SIZE)
+        ring->count++;
+
+    UNLOCK(&ring->lock);
+}
+
+void
+ImagingTraceAllocated(long bytes)
+{
+    /* only the owner touches this counter */
+
+    Ring* ring = get_ring();
+    if (ring)
+        ring->bytes += bytes;
+}
+
+int
+ImagingTraceCollect(ImagingTraceRecord* records, int count)
+{
+    /* move up to count records (oldest first, thread by thread) to
+       the given array.  returns the number of records. */
+
+    Ring** link;
+    Ring* ring;
+    int n, i, dead;
+
+    n = 0;
+
+    LOCK(&rings_lock);
+
+    link = &rings;
+    while ((ring = *link) != NULL) {
+
+        LOCK(&ring->lock);
+        while (ring->count > 0 && n < count) {
+            i = (ring->head - ring->count + RING_SIZE) % RING_SIZE;
+            records[n++] = ring->records[i];
+            ring->count--;
+        }
+        dead = ring->dead && ring->count == 0;
+        UNLOCK(&ring->lock);
+
+        if (dead) {
+            *link = ring->next;
+#ifdef WITH_TRACE_KEY
+            pthread_mutex_destroy(&ring->lock);
+#endif
+            free(ring);
+            continue;
+        }
+
+        link = &ring->next;
+    }
+
+    UNLOCK(&rings_lock);
+
+    return n;
+}
+
+#else
+
+void
+ImagingTraceStart(ImagingTraceCookie* cookie, const char* op)
+{
+}
+
+void
+ImagingTraceStop(ImagingTraceCookie* cookie, long pixels)
+{
+}
+
+void
+ImagingTraceAllocated(long bytes)
+{
+}
+
+int
+ImagingTraceCollect(ImagingTraceRecord* records, int count)
+{
+    return 0;
+}
+
+#endif
@@ -1008,18 +1008,37 @@ static struct {
 };
 
 
+#define	ENTRIES	(sizeof(unpackers) / sizeof(unpackers[0]))
+
+/* entries for each mode, chained in table order (index+1, 0 ends) */
+static int unpack_first[IMAGING_MODES];
+static int unpack_next[ENTRIES];
+
+void
+ImagingUnpackInit(void)
+{
+    int i, id;
+
+    for (i = (int) ENTRIES - 2; i >= 0; i--) {
+        id = ImagingModeId(unpackers[i].mode);
+        if (id == IMAGING_MODE_UNKNOWN)
+            continue;
+        unpack_next[i] = unpack_first[id];
+        unpack_first[id] = i + 1;
+    }
+}
+
 ImagingShuffler
 ImagingFindUnpacker(const char* mode, const char* rawmode, int* bits_out)
 {
     int i;
 
     /* find a suitable pixel unpacker */
-    for (i = 0; unpackers[i].rawmode; i++)
-	if (strcmp(unpackers[i].mode, mode) == 0 &&
-            strcmp(unpackers[i].rawmode, rawmode) == 0) {
+    for (i = unpack_first[ImagingModeId(mode)]; i; i = unpack_next[i-1])
+        if (strcmp(unpackers[i-1].rawmode, rawmode) == 0) {
 	    if (bits_out)
-		*bits_out = unpackers[i].bits;
-	    return unpackers[i].unpack;
+		*bits_out = unpackers[i-1].bits;
+	    return unpackers[i-1].unpack;
 	}
 
     /* FIXME: configure a general unpacker based on the type codes... */
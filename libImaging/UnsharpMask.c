@@ -54,345 +54,335 @@ static inline UINT8 clip(double in)
     return (UINT8) in;
 }
 
-static Imaging
-gblur(Imaging im, Imaging imOut, float floatRadius, int channels, int padding)
+/* the blur is done as three extended box blur passes in each direction
+   (Gwosdek et al, "Theoretical Foundations of Gaussian Convolution by
+   Extended Box Filtering"), using running sums.  the time per pixel is
+   independent of the radius.
+
+   the image is processed in tiles, so that the working set stays in
+   the cache.  each tile is blurred horizontally, line by line, into a
+   float buffer, and then vertically, row by row.  the input region
+   has a margin of BOX_PASSES*(r+1) pixels on each side (except at the
+   image edges), which is how far the box passes reach; the result is
+   the same as for a blur of the whole image, and is only rounded once.
+   when used for unsharp masking, the sharpening is done as each tile
+   is written to the output image. */
+
+#define BOX_PASSES 3
+
+/* minimum tile size, in pixels.  tiles are made larger for large
+   radii, so that the margins don't dominate. */
+#define TILE_WIDTH 256
+#define TILE_HEIGHT 64
+
+struct blur_context {
+    Imaging im;
+    Imaging imOut;
+    int channels;
+    int r;		/* box radius */
+    float a;		/* weight of the extra pixel at each end */
+    int margin;		/* extra input pixels on each side of a tile */
+    int xtile, ytile;	/* tile size */
+    int xtiles;		/* tiles per row */
+    int sharpen;	/* unsharp mask parameters (if sharpen is set) */
+    int percent;
+    int threshold;
+    int error;
+};
+
+static float
+blur_sigma(float floatRadius)
 {
-    ImagingSectionCookie cookie;
-
-    float *maskData = NULL;
-    int y = 0;
-    int x = 0;
-    float z = 0;
-    float sum = 0.0;
-    float dev = 0.0;
-
-    float *buffer = NULL;
-
-    int *line = NULL;
-    UINT8 *line8 = NULL;
-
-    int pix = 0;
-    float newPixel[4];
-    int channel = 0;
-    int offset = 0;
-    INT32 newPixelFinals;
-
-    int radius = 0;
-    float remainder = 0.0;
-
-    int i;
-
-    /* Do the gaussian blur */
+    /* standard deviation of the blur.  the radius used to select a
+       "gaussian-like" mask of 2*radius+2 taps; we use the deviation
+       of that mask, so the amount of blur is the same as before. */
 
-    /* For a symmetrical gaussian blur, instead of doing a radius*radius
-       matrix lookup, you get the EXACT same results by doing a radius*1
-       transform, followed by a 1*radius transform.  This reduces the
-       number of lookups exponentially (10 lookups per pixel for a
-       radius of 5 instead of 25 lookups).  So, we blur the lines first,
-       then we blur the resulting columns. */
-
-    /* first, round radius off to the next higher integer and hold the
-       remainder this is used so we can support float radius values
-       properly. */
+    double *mask;
+    double z, dev, sum, mean, var, remainder;
+    int radius, x, offset;
 
     remainder = floatRadius - ((int) floatRadius);
-    floatRadius = ceil(floatRadius);
+    radius = (int) ((ceil(floatRadius) * 2.0) + 2.0);
 
-    /* Next, double the radius and offset by 2.0... that way "0" returns
-       the original image instead of a black one.  We multiply it by 2.0
-       so that it is a true "radius", not a diameter (the results match
-       other paint programs closer that way too). */
-    radius = (int) ((floatRadius * 2.0) + 2.0);
+    mask = malloc(radius * sizeof(double));
+    if (!mask)
+	return -1.0;
 
-    /* create the maskData for the gaussian curve */
-    maskData = malloc(radius * sizeof(float));
-    /* FIXME: error checking */
+    dev = 0.5 + (((double) (radius * radius)) * 0.001);
     for (x = 0; x < radius; x++) {
-	z = ((float) (x + 2) / ((float) radius));
-	dev = 0.5 + (((float) (radius * radius)) * 0.001);
-	/* you can adjust this factor to change the shape/center-weighting
-	   of the gaussian */
-	maskData[x] = (float) pow((1.0 / sqrt(2.0 * 3.14159265359 * dev)),
-				  ((-(z - 1.0) * -(x - 1.0)) /
-				   (2.0 * dev)));
+	z = ((double) (x + 2) / ((double) radius));
+	mask[x] = pow((1.0 / sqrt(2.0 * 3.14159265359 * dev)),
+		      ((-(z - 1.0) * -(x - 1.0)) / (2.0 * dev)));
     }
-
-    /* if there's any remainder, multiply the first/last values in
-       MaskData it.  this allows us to support float radius values. */
     if (remainder > 0.0) {
-	maskData[0] *= remainder;
-	maskData[radius - 1] *= remainder;
+	mask[0] *= remainder;
+	mask[radius - 1] *= remainder;
     }
 
+    sum = mean = 0.0;
     for (x = 0; x < radius; x++) {
-	/* this is done separately now due to the correction for float
-	   radius values above */
-	sum += maskData[x];
+	offset = (int) ((-((double) radius / 2.0) + (double) x) + 0.5);
+	sum += mask[x];
+	mean += mask[x] * offset;
     }
+    mean /= sum;
 
-    for (i = 0; i < radius; i++) {
-	maskData[i] *= (1.0 / sum);
-	/* printf("%f\n", maskData[i]); */
+    var = 0.0;
+    for (x = 0; x < radius; x++) {
+	offset = (int) ((-((double) radius / 2.0) + (double) x) + 0.5);
+	var += mask[x] * (offset - mean) * (offset - mean);
     }
 
-    /* create a temporary memory buffer for the data for the first pass
-       memset the buffer to 0 so we can use it directly with += */
+    free(mask);
 
-    /* don't bother about alpha/padding */
-    buffer = calloc((size_t) (im->xsize * im->ysize * channels),
-		    sizeof(float));
-    if (buffer == NULL)
-	return ImagingError_MemoryError();
+    return (float) sqrt(var / sum);
+}
 
-    /* be nice to other threads while you go off to lala land */
-    ImagingSectionEnter(&cookie);
+static void
+box_blur(float *out, float *in, float *sums, int n, int lines,
+	 int r, float a)
+{
+    /* extended box blur of a number of interleaved sequences (line j
+       has item i at in[i*lines + j]).  the edges are extended. */
+
+    float w = 1.0 / (2*r + 1 + 2*a);
+    float *p, *q;
+    int i, j, k;
+
+#define ITEM(i) (in + ((i) < 0 ? 0 : (i) >= n ? n-1 : (i)) * lines)
+
+    /* initial window, centered on item 0 */
+    for (j = 0; j < lines; j++)
+	sums[j] = in[j] * (r + 1);
+    for (k = 1; k <= r; k++) {
+	p = ITEM(k);
+	for (j = 0; j < lines; j++)
+	    sums[j] += p[j];
+    }
+
+    for (i = 0; i < n; i++) {
+	/* the extra pixels */
+	p = ITEM(i - r - 1);
+	q = ITEM(i + r + 1);
+	for (j = 0; j < lines; j++)
+	    out[i*lines + j] = (sums[j] + a * (p[j] + q[j])) * w;
+	/* move the window */
+	p = ITEM(i - r);
+	for (j = 0; j < lines; j++)
+	    sums[j] += q[j] - p[j];
+    }
 
-    /* memset(buffer, 0, sizeof(buffer)); */
+#undef ITEM
+}
 
-    newPixel[0] = newPixel[1] = newPixel[2] = newPixel[3] = 0;
+static float*
+blur_passes(struct blur_context* ctx, float* buf[2], float* sums,
+	    int n, int lines)
+{
+    /* blur buf[0], and return the buffer holding the result */
 
-    /* perform a blur on each line, and place in the temporary storage buffer */
-    for (y = 0; y < im->ysize; y++) {
-	if (channels == 1 && im->image8 != NULL) {
-	    line8 = (UINT8 *) im->image8[y];
-	} else {
-	    line = im->image32[y];
-	}
-	for (x = 0; x < im->xsize; x++) {
-	    newPixel[0] = newPixel[1] = newPixel[2] = newPixel[3] = 0;
-	    /* for each neighbor pixel, factor in its value/weighting to the
-	       current pixel */
-	    for (pix = 0; pix < radius; pix++) {
-		/* figure the offset of this neighbor pixel */
-		offset =
-		    (int) ((-((float) radius / 2.0) + (float) pix) + 0.5);
-		if (x + offset < 0)
-		    offset = -x;
-		else if (x + offset >= im->xsize)
-		    offset = im->xsize - x - 1;
-
-		/* add (neighbor pixel value * maskData[pix]) to the current
-		   pixel value */
-		if (channels == 1) {
-		    buffer[(y * im->xsize) + x] +=
-			((float) ((UINT8 *) & line8[x + offset])[0]) *
-			(maskData[pix]);
-		} else {
-		    for (channel = 0; channel < channels; channel++) {
-			buffer[(y * im->xsize * channels) +
-			       (x * channels) + channel] +=
-			    ((float) ((UINT8 *) & line[x + offset])
-			     [channel]) * (maskData[pix]);
-		    }
-		}
-	    }
-	}
+    int pass;
+
+    for (pass = 0; pass < BOX_PASSES; pass++)
+	box_blur(buf[(pass+1)&1], buf[pass&1], sums, n, lines,
+		 ctx->r, ctx->a);
+
+    return buf[BOX_PASSES&1];
+}
+
+static inline UINT8
+sharpen(struct blur_context* ctx, UINT8 in, UINT8 blurred)
+{
+    /* if the difference between the original and the blurred pixel
+       is more than threshold, apply the OPPOSITE correction to the
+       amount of blur, multiplied by percent. */
+
+    int diff = in - blurred;
+
+    if (abs(diff) <= ctx->threshold)
+	return in;
+    if (ctx->channels == 1)
+	return clip(in + (diff * ((float) ctx->percent) / 100.0));
+    return clip((float) in + (diff * (((float) ctx->percent / 100.0))));
+}
+
+static void
+blur_tiles(void* context, int start, int end)
+{
+    /* tiles start to end, from the input image to the output image */
+
+    struct blur_context* ctx = context;
+    Imaging im = ctx->im;
+    Imaging imOut = ctx->imOut;
+    int channels = ctx->channels;
+    int pixelsize = im->pixelsize;
+    int width = ctx->xtile + 2 * ctx->margin; /* largest input region */
+    int height = ctx->ytile + 2 * ctx->margin;
+    int tile, x, y, c, i, n, lines;
+    int x0, x1, y0, y1;	/* output region */
+    int xa, xb, ya, yb;	/* input region */
+    float *hbuf[2], *vbuf[2], *sums, *res;
+    UINT8 *in, *out;
+
+    hbuf[0] = malloc(width * channels * sizeof(float));
+    hbuf[1] = malloc(width * channels * sizeof(float));
+    vbuf[0] = malloc(height * ctx->xtile * channels * sizeof(float));
+    vbuf[1] = malloc(height * ctx->xtile * channels * sizeof(float));
+    sums = malloc(ctx->xtile * channels * sizeof(float));
+    if (!hbuf[0] || !hbuf[1] || !vbuf[0] || !vbuf[1] || !sums) {
+	ctx->error = 1;
+	goto done;
     }
 
-    /* perform a blur on each column in the buffer, and place in the
-       output image */
-    for (x = 0; x < im->xsize; x++) {
-	for (y = 0; y < im->ysize; y++) {
-	    newPixel[0] = newPixel[1] = newPixel[2] = newPixel[3] = 0;
-	    /* for each neighbor pixel, factor in its value/weighting to the
-	       current pixel */
-	    for (pix = 0; pix < radius; pix++) {
-		/* figure the offset of this neighbor pixel */
-		offset =
-		    (int) (-((float) radius / 2.0) + (float) pix + 0.5);
-		if (y + offset < 0)
-		    offset = -y;
-		else if (y + offset >= im->ysize)
-		    offset = im->ysize - y - 1;
-		/* add (neighbor pixel value * maskData[pix]) to the current
-		   pixel value */
-		for (channel = 0; channel < channels; channel++) {
-		    newPixel[channel] +=
-			(buffer
-			 [((y + offset) * im->xsize * channels) +
-			  (x * channels) + channel]) * (maskData[pix]);
-		}
-	    }
-	    /* if the image is RGBX or RGBA, copy the 4th channel data to
-	       newPixel, so it gets put in imOut */
-	    if (strcmp(im->mode, "RGBX") == 0
-		|| strcmp(im->mode, "RGBA") == 0) {
-	      newPixel[3] = (float) ((UINT8 *) & line[x + offset])[3];
-	    }
+    for (tile = start; tile < end; tile++) {
+
+	x0 = (tile % ctx->xtiles) * ctx->xtile;
+	x1 = x0 + ctx->xtile;
+	if (x1 > im->xsize)
+	    x1 = im->xsize;
+	y0 = (tile / ctx->xtiles) * ctx->ytile;
+	y1 = y0 + ctx->ytile;
+	if (y1 > im->ysize)
+	    y1 = im->ysize;
+
+	xa = (x0 > ctx->margin) ? x0 - ctx->margin : 0;
+	xb = (x1 + ctx->margin < im->xsize) ? x1 + ctx->margin : im->xsize;
+	ya = (y0 > ctx->margin) ? y0 - ctx->margin : 0;
+	yb = (y1 + ctx->margin < im->ysize) ? y1 + ctx->margin : im->ysize;
+
+	lines = (x1 - x0) * channels;
+
+	/* horizontal passes, keeping the tile's columns */
+	for (y = ya; y < yb; y++) {
+	    in = (UINT8*) im->image[y];
+	    for (x = xa, i = 0; x < xb; x++)
+		for (c = 0; c < channels; c++)
+		    hbuf[0][i++] = in[x*pixelsize + c];
+	    res = blur_passes(ctx, hbuf, sums, xb - xa, channels);
+	    memcpy(vbuf[0] + (y - ya) * lines, res + (x0 - xa) * channels,
+		   lines * sizeof(float));
+	}
 
-	    /* pack the channels into an INT32 so we can put them back in
-	       the PIL image */
-	    newPixelFinals = 0;
-	    if (channels == 1) {
-		newPixelFinals = clip(newPixel[0]);
-	    } else {
-		/* for RGB, the fourth channel isn't used anyways, so just
-		   pack a 0 in there, this saves checking the mode for each
-		   pixel. */
-		/* this doesn't work on little-endian machines... fix it! */
-		newPixelFinals =
-		    clip(newPixel[0]) | clip(newPixel[1]) << 8 |
-		    clip(newPixel[2]) << 16 | clip(newPixel[3]) << 24;
-	    }
-	    /* set the resulting pixel in imOut */
-	    if (channels == 1) {
-		imOut->image8[y][x] = (UINT8) newPixelFinals;
-	    } else {
-		imOut->image32[y][x] = newPixelFinals;
+	/* vertical passes */
+	res = blur_passes(ctx, vbuf, sums, yb - ya, lines);
+
+	for (y = y0; y < y1; y++) {
+	    in = (UINT8*) im->image[y] + x0 * pixelsize;
+	    out = (UINT8*) imOut->image[y] + x0 * pixelsize;
+	    i = (y - ya) * lines;
+	    for (x = x0; x < x1; x++, in += pixelsize, out += pixelsize) {
+		if (ctx->sharpen)
+		    for (c = 0; c < channels; c++)
+			out[c] = sharpen(ctx, in[c], clip(res[i++] + 0.5));
+		else
+		    for (c = 0; c < channels; c++)
+			out[c] = clip(res[i++] + 0.5);
+		/* leave alpha (or padding) as is */
+		for (n = channels; n < pixelsize; n++)
+		    out[n] = in[n];
 	    }
 	}
     }
 
-    /* free the buffer */
-    free(buffer);
+  done:
+    free(hbuf[0]);
+    free(hbuf[1]);
+    free(vbuf[0]);
+    free(vbuf[1]);
+    free(sums);
+}
+
+static Imaging
+gblur(Imaging im, Imaging imOut, float floatRadius, int channels,
+      int sharpen, int percent, int threshold)
+{
+    ImagingSectionCookie cookie;
+    struct blur_context ctx;
+    float sigma, s;
+    int tiles;
+
+    if (!imOut || im->xsize != imOut->xsize || im->ysize != imOut->ysize ||
+	im->modeid != imOut->modeid)
+	return ImagingError_Mismatch();
+
+    sigma = blur_sigma(floatRadius);
+    if (sigma < 0.0)
+	return ImagingError_MemoryError();
+
+    /* box size for each pass */
+    s = sigma * sigma / BOX_PASSES;
+    ctx.r = (int) floor(0.5 * sqrt(12.0 * s + 1.0) - 0.5);
+    ctx.a = (2*ctx.r + 1) * (ctx.r * (ctx.r + 1) - 3.0 * s) /
+	(6.0 * (s - (ctx.r + 1) * (ctx.r + 1)));
+
+    /* the box passes reach r+1 pixels each way */
+    ctx.margin = BOX_PASSES * (ctx.r + 1);
+    ctx.xtile = TILE_WIDTH;
+    if (ctx.xtile < 4 * ctx.margin)
+	ctx.xtile = 4 * ctx.margin;
+    ctx.ytile = TILE_HEIGHT;
+    if (ctx.ytile < 4 * ctx.margin)
+	ctx.ytile = 4 * ctx.margin;
+    ctx.xtiles = (im->xsize + ctx.xtile - 1) / ctx.xtile;
+    tiles = ctx.xtiles * ((im->ysize + ctx.ytile - 1) / ctx.ytile);
+
+    ctx.im = im;
+    ctx.imOut = imOut;
+    ctx.channels = channels;
+    ctx.sharpen = sharpen;
+    ctx.percent = percent;
+    ctx.threshold = threshold;
+    ctx.error = 0;
+
+    ImagingSectionEnter(&cookie);
+
+    ImagingParallel(blur_tiles, &ctx, tiles,
+		    65536 / (ctx.xtile * ctx.ytile) + 1);
 
-    /* get the GIL back so Python knows who you are */
     ImagingSectionLeave(&cookie);
 
+    if (ctx.error)
+	return ImagingError_MemoryError();
+
     return imOut;
 }
 
+static int
+blur_channels(Imaging im)
+{
+    /* number of channels to blur (0 if mode not supported) */
+
+    if (im->modeid == IMAGING_MODE_RGB || im->modeid == IMAGING_MODE_RGBA ||
+	im->modeid == IMAGING_MODE_RGBX)
+	return 3;
+    else if (im->modeid == IMAGING_MODE_CMYK)
+	return 4;
+    else if (im->modeid == IMAGING_MODE_L)
+	return 1;
+    return 0;
+}
+
 Imaging ImagingGaussianBlur(Imaging im, Imaging imOut, float radius)
 {
-    int channels = 0;
-    int padding = 0;
-
-    if (strcmp(im->mode, "RGB") == 0) {
-	channels = 3;
-	padding = 1;
-    } else if (strcmp(im->mode, "RGBA") == 0) {
-	channels = 3;
-	padding = 1;
-    } else if (strcmp(im->mode, "RGBX") == 0) {
-	channels = 3;
-	padding = 1;
-    } else if (strcmp(im->mode, "CMYK") == 0) {
-	channels = 4;
-	padding = 0;
-    } else if (strcmp(im->mode, "L") == 0) {
-	channels = 1;
-	padding = 0;
-    } else
+    int channels = blur_channels(im);
+
+    if (!channels)
 	return ImagingError_ModeError();
 
-    return gblur(im, imOut, radius, channels, padding);
+    return gblur(im, imOut, radius, channels, 0, 0, 0);
 }
 
 Imaging
 ImagingUnsharpMask(Imaging im, Imaging imOut, float radius, int percent,
 		   int threshold)
 {
-    ImagingSectionCookie cookie;
+    int channels = blur_channels(im);
 
-    Imaging result;
-    int channel = 0;
-    int channels = 0;
-    int padding = 0;
-
-    int x = 0;
-    int y = 0;
-
-    int *lineIn = NULL;
-    int *lineOut = NULL;
-    UINT8 *lineIn8 = NULL;
-    UINT8 *lineOut8 = NULL;
-
-    int diff = 0;
-
-    INT32 newPixel = 0;
-
-    if (strcmp(im->mode, "RGB") == 0) {
-	channels = 3;
-	padding = 1;
-    } else if (strcmp(im->mode, "RGBA") == 0) {
-	channels = 3;
-	padding = 1;
-    } else if (strcmp(im->mode, "RGBX") == 0) {
-	channels = 3;
-	padding = 1;
-    } else if (strcmp(im->mode, "CMYK") == 0) {
-	channels = 4;
-	padding = 0;
-    } else if (strcmp(im->mode, "L") == 0) {
-	channels = 1;
-	padding = 0;
-    } else
+    if (!channels)
 	return ImagingError_ModeError();
 
-    /* first, do a gaussian blur on the image, putting results in imOut
-       temporarily */
-    result = gblur(im, imOut, radius, channels, padding);
-    if (!result)
-	return NULL;
-
-    /* now, go through each pixel, compare "normal" pixel to blurred
-       pixel.  if the difference is more than threshold values, apply
-       the OPPOSITE correction to the amount of blur, multiplied by
-       percent. */
-
-    ImagingSectionEnter(&cookie);
-
-    for (y = 0; y < im->ysize; y++) {
-	if (channels == 1) {
-	    lineIn8 = im->image8[y];
-	    lineOut8 = imOut->image8[y];
-	} else {
-	    lineIn = im->image32[y];
-	    lineOut = imOut->image32[y];
-	}
-	for (x = 0; x < im->xsize; x++) {
-	    newPixel = 0;
-	    /* compare in/out pixels, apply sharpening */
-	    if (channels == 1) {
-		diff =
-		    ((UINT8 *) & lineIn8[x])[0] -
-		    ((UINT8 *) & lineOut8[x])[0];
-		if (abs(diff) > threshold) {
-		    /* add the diff*percent to the original pixel */
-		    imOut->image8[y][x] =
-			clip((((UINT8 *) & lineIn8[x])[0]) +
-			     (diff * ((float) percent) / 100.0));
-		} else {
-		    /* newPixel is the same as imIn */
-		    imOut->image8[y][x] = ((UINT8 *) & lineIn8[x])[0];
-		}
-	    }
-
-	    else {
-		for (channel = 0; channel < channels; channel++) {
-		    diff = (int) ((((UINT8 *) & lineIn[x])[channel]) -
-				  (((UINT8 *) & lineOut[x])[channel]));
-		    if (abs(diff) > threshold) {
-			/* add the diff*percent to the original pixel
-			   this may not work for little-endian systems, fix it! */
-			newPixel =
-			    newPixel |
-			    clip((float) (((UINT8 *) & lineIn[x])[channel])
-				 +
-				 (diff *
-				  (((float) percent /
-				    100.0)))) << (channel * 8);
-		    } else {
-			/* newPixel is the same as imIn
-			   this may not work for little-endian systems, fix it! */
-			newPixel =
-			    newPixel | ((UINT8 *) & lineIn[x])[channel] <<
-			    (channel * 8);
-		    }
-		}
-		if (strcmp(im->mode, "RGBX") == 0
-		    || strcmp(im->mode, "RGBA") == 0) {
-		    /* preserve the alpha channel
-		       this may not work for little-endian systems, fix it! */
-		    newPixel =
-			newPixel | ((UINT8 *) & lineIn[x])[channel] << 24;
-		}
-		imOut->image32[y][x] = newPixel;
-	    }
-	}
-    }
-
-    ImagingSectionLeave(&cookie);
-
-    return imOut;
+    /* blur, and compare the "normal" pixels with the blurred pixels
+       as each tile is written to imOut (the blurred image is never
+       stored as a whole) */
+    return gblur(im, imOut, radius, channels, 1, percent, threshold);
 }
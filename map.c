@@ -237,6 +237,10 @@ mapping_readimage(ImagingMapperObject* mapper, PyObject* args)
         for (y = 0; y < ysize; y++)
             im->image[ysize-y-1] = mapper->base + mapper->offset + y * stride;
 
+    if (stride > im->linesize)
+        im->stride = stride;
+    im->readonly = 1;
+
     im->destroy = ImagingDestroyMap;
 
     if (!ImagingNewEpilogue(im))
@@ -288,6 +292,24 @@ PyImaging_Mapper(PyObject* self, PyObject* args)
     return (PyObject*) PyImaging_MapperNew(filename, 1);
 }
 
+/* -------------------------------------------------------------------- */
+/* File mapper (raw image data, read-write) */
+
+PyObject* 
+PyImaging_MapFile(PyObject* self, PyObject* args)
+{
+    char* filename;
+    char* mode;
+    int xsize, ysize;
+    int readonly = 0;
+
+    if (!PyArg_ParseTuple(args, "ss(ii)|i", &filename, &mode,
+                          &xsize, &ysize, &readonly))
+	return NULL;
+
+    return PyImagingNew(ImagingNewMap(filename, readonly, mode, xsize, ysize));
+}
+
 /* -------------------------------------------------------------------- */
 /* Buffer mapper */
 
@@ -366,6 +388,10 @@ PyImaging_MapBuffer(PyObject* self, PyObject* args)
         for (y = 0; y < ysize; y++)
             im->image[ysize-y-1] = ptr + offset + y * stride;
 
+    if (stride > im->linesize)
+        im->stride = stride;
+    im->readonly = 1;
+
     im->destroy = mapping_destroy_buffer;
 
     Py_INCREF(target);
@@ -377,3 +403,67 @@ PyImaging_MapBuffer(PyObject* self, PyObject* args)
     return PyImagingNew(im);
 }
 
+/* -------------------------------------------------------------------- */
+/* Buffer wrapper (new-style buffers, possibly writable) */
+
+#if PY_VERSION_HEX >= 0x02060000
+
+static void
+wrapper_release(void* context)
+{
+    /* called when the image is deleted (with the interpreter lock) */
+    PyBuffer_Release((Py_buffer*) context);
+    free(context);
+}
+
+PyObject* 
+PyImaging_WrapBuffer(PyObject* self, PyObject* args)
+{
+    Py_buffer* view;
+    Imaging im;
+
+    PyObject* target;
+    char* mode;
+    int xsize, ysize;
+    int stride = 0;
+    int readonly = 0;
+
+    if (!PyArg_ParseTuple(args, "Os(ii)|ii", &target, &mode,
+                          &xsize, &ysize, &stride, &readonly))
+	return NULL;
+
+    if (xsize < 0 || ysize < 0) {
+        PyErr_SetString(PyExc_ValueError, "bad image size");
+        return NULL;
+    }
+
+    view = malloc(sizeof(Py_buffer));
+    if (!view)
+        return PyErr_NoMemory();
+
+    if (PyObject_GetBuffer(target, view,
+                           readonly ? PyBUF_SIMPLE : PyBUF_WRITABLE) < 0) {
+        free(view);
+        return NULL;
+    }
+
+    im = ImagingNewExternal(mode, xsize, ysize, (char*) view->buf, stride,
+                            readonly, wrapper_release, view);
+    if (!im) {
+        wrapper_release(view);
+        return NULL;
+    }
+
+    /* check buffer size */
+    if (ysize > 0 &&
+        (Py_ssize_t) (ysize - 1) * im->stride + im->linesize > view->len) {
+        ImagingDelete(im);
+        PyErr_SetString(PyExc_ValueError, "buffer is not large enough");
+        return NULL;
+    }
+
+    return PyImagingNew(im);
+}
+
+#endif
+
@@ -75,6 +75,8 @@ def testimage():
     (None, 'RGB', (64, 64))
     >>> _info(im.filter(ImageFilter.BLUR))
     (None, 'RGB', (128, 128))
+    >>> _info(im.filter(ImageFilter.Kernel((7, 3), [1] * 21)))
+    (None, 'RGB', (128, 128))
     >>> im.getbands()
     ('R', 'G', 'B')
     >>> im.getbbox()
@@ -106,6 +108,68 @@ def testimage():
     >>> _info(im.transform((512, 512), Image.EXTENT, (32,32,96,96)))
     (None, 'RGB', (512, 512))
 
+    Resampling of 8-bit images uses fixed point arithmetics, which
+    stays within one level of the (clipped) floating point result:
+
+    >>> import random
+    >>> random.seed(1)
+    >>> def _stretcherror(mode, size, filter):
+    ...     bands = []
+    ...     for b in Image.new(mode, (1, 1)).getbands():
+    ...         band = Image.new("L", (61, 47))
+    ...         band.putdata([random.randrange(256) for i in range(61*47)])
+    ...         bands.append(band)
+    ...     im = Image.merge(mode, bands)
+    ...     out = im._new(im.im.stretch(size, filter))
+    ...     error = 0
+    ...     for a, b in zip(out.split(), bands):
+    ...         b = b.convert("F")
+    ...         b = b._new(b.im.stretch(size, filter))
+    ...         b = ImageMath.eval("abs(float(a) - min(max(b, 0), 255))",
+    ...                            a=a, b=b)
+    ...         error = max(error, b.getextrema()[1])
+    ...     return error
+    >>> features = Image.core.getcpufeatures()
+    >>> errors = []
+    >>> for cpu in (features, 0): # with and without vector code
+    ...     previous = Image.core.setcpufeatures(cpu)
+    ...     for mode in ("L", "RGB", "RGBA", "CMYK", "LA"):
+    ...         for size in ((23, 47), (150, 47), (61, 20), (61, 100)):
+    ...             for filter in (Image.ANTIALIAS, Image.BILINEAR,
+    ...                            Image.BICUBIC):
+    ...                 errors.append(_stretcherror(mode, size, filter))
+    >>> previous = Image.core.setcpufeatures(features)
+    >>> max(errors) <= 1.0
+    True
+
+    Rank filters on 8-bit images use a sliding histogram; the result
+    is the same as for the general code used for "I" images, also for
+    images smaller than the filter window:
+
+    >>> random.seed(1)
+    >>> def _rankfilter(im, filter):
+    ...     bands = [b.convert("I").filter(filter).convert("L")
+    ...              for b in im.split()]
+    ...     return Image.merge(im.mode, bands)
+    >>> results = []
+    >>> for mode in ("L", "RGB"):
+    ...     for size in ((37, 23), (3, 20), (20, 2)):
+    ...         bands = []
+    ...         for b in Image.new(mode, (1, 1)).getbands():
+    ...             band = Image.new("L", size)
+    ...             band.putdata([random.randrange(256)
+    ...                           for i in range(size[0]*size[1])])
+    ...             bands.append(band)
+    ...         im = Image.merge(mode, bands)
+    ...         for filter in (ImageFilter.MedianFilter(5),
+    ...                        ImageFilter.RankFilter(7, 0),
+    ...                        ImageFilter.RankFilter(7, 30),
+    ...                        ImageFilter.RankFilter(7, 48)):
+    ...             results.append(im.filter(filter).tostring() ==
+    ...                            _rankfilter(im, filter).tostring())
+    >>> len(results), False in results
+    (24, False)
+
     The ImageDraw module lets you draw stuff in raster images:
 
     >>> im = Image.new("L", (128, 128), 64)
@@ -146,6 +210,208 @@ def testimage():
     >>> im.mode, im.size
     ('F', (128, 128))
 
+    Copies and crops share the pixels with the original image, until
+    one of them is modified:
+
+    >>> im = Image.new("L", (128, 128), 0)
+    >>> c1 = im.copy()
+    >>> c2 = im.crop((32, 32, 96, 96))
+    >>> ImageDraw.Draw(c1).line((0, 0, 127, 127), fill=255)
+    >>> c2.paste(128, (0, 0, 32, 32))
+    >>> im.getextrema(), c1.getextrema(), c2.getextrema()
+    ((0, 0), (0, 255), (0, 128))
+    >>> im.paste(64, (0, 0, 128, 128))
+    >>> c1.getpixel((1, 0)), c2.getpixel((63, 63))
+    (0, 0)
+
+    This also holds for images that are still being decoded:
+
+    >>> from PIL import ImageFile
+    >>> import StringIO
+    >>> ref = Image.open(os.path.join(ROOT, "Images/lena.ppm"))
+    >>> ref = ref.resize((256, 256))
+    >>> file = StringIO.StringIO()
+    >>> ref.save(file, "PPM")
+    >>> data = file.getvalue()
+    >>> p = ImageFile.Parser()
+    >>> for i in range(0, len(data) // 3, 4096):
+    ...     p.feed(data[i:i+4096])
+    >>> c = p.image.copy()
+    >>> s = c.tostring()
+    >>> p.feed(data[i+4096:])
+    >>> im = p.close()
+    >>> c.tostring() == s, im.tostring() == ref.tostring()
+    (True, True)
+
+    Small crops are copied right away, so they don't keep the
+    original image alive:
+
+    >>> im = Image.new("L", (1024, 1024))
+    >>> c = im.crop((0, 0, 16, 16))
+    >>> c.getpixel((0, 0))
+    0
+    >>> live = Image.core.getmemorystats()["live_bytes"]
+    >>> del im
+    >>> live - Image.core.getmemorystats()["live_bytes"] >= 1024*1024
+    True
+
+    The memory statistics keep track of live and peak usage, and you
+    can set a budget for heap storage:
+
+    >>> stats = Image.core.getmemorystats
+    >>> Image.core.resetmemorypeak()
+    >>> live = stats()["live_bytes"]
+    >>> im = Image.new("L", (1024, 1024))
+    >>> stats()["live_bytes"] - live >= 1024*1024
+    True
+    >>> del im
+    >>> stats()["live_bytes"] - live, stats()["peak_bytes"] - live >= 1024*1024
+    (0, True)
+    >>> s = stats()
+    >>> budget = s["block_bytes"] + s["array_bytes"] + 65536
+    >>> budget = Image.core.setmemorybudget(budget)
+    >>> Image.new("L", (1024, 1024))
+    Traceback (most recent call last):
+    MemoryError
+    >>> stats()["refused"] > s["refused"]
+    True
+    >>> im = Image.new("L", (16, 16))
+    >>> budget = Image.core.setmemorybudget(budget)
+    >>> im = Image.new("L", (1024, 1024))
+
+    In Python 2.7, the internal image supports the buffer interface.
+    Lines may be padded, so use the strides:
+
+    >>> v = memoryview(Image.new("RGB", (10, 4)).im)
+    >>> v.format, v.shape, v.strides
+    ('B', (4L, 10L, 3L), (40L, 4L, 1L))
+    >>> v = memoryview(Image.new("LA", (5, 2)).im)
+    >>> v.format, v.shape, v.strides
+    ('B', (2L, 5L, 2L), (20L, 4L, 3L))
+
+    While a view is held, the pixels stay where they are, and are not
+    shared with copies:
+
+    >>> im = Image.new("L", (4, 2), 1)
+    >>> c1 = im.copy()
+    >>> v = memoryview(im.im)
+    >>> c2 = im.copy()
+    >>> im.paste(255, (0, 0, 2, 1))
+    >>> v.tobytes()
+    '\\xff\\xff\\x01\\x01\\x01\\x01\\x01\\x01'
+    >>> c1.getpixel((0, 0)), c2.getpixel((0, 0))
+    (1, 1)
+    >>> del v
+
+    Raw files can be mapped into memory.  A writable map extends the
+    file if necessary, and changes go straight to the file; a read-only
+    map must fit in the file:
+
+    >>> import tempfile
+    >>> file = tempfile.mktemp()
+    >>> open(file, "wb").write("abc")
+    >>> Image.mapfile(file, "L", (4, 2), readonly=1)
+    Traceback (most recent call last):
+    IOError: error when accessing file
+    >>> im = Image.mapfile(file, "L", (4, 2), readonly=0)
+    >>> im.im.advise(1) # sequential
+    1
+    >>> im.getpixel((0, 0)), im.getpixel((3, 1))
+    (97, 0)
+    >>> im.paste(255, (0, 0, 2, 1))
+    >>> del im
+    >>> open(file, "rb").read()
+    '\\xff\\xffc\\x00\\x00\\x00\\x00\\x00'
+    >>> im = Image.mapfile(file, "L", (4, 2), readonly=1)
+    >>> im.paste(0, (0, 0, 4, 2))
+    >>> del im
+    >>> open(file, "rb").read(3)
+    '\\xff\\xffc'
+    >>> os.remove(file)
+
+    A pipeline converts and resizes an image as the lines arrive.
+    The result is available when all lines have been pushed:
+
+    >>> im = Image.open(os.path.join(ROOT, "Images/lena.ppm"))
+    >>> a = im.load()
+    >>> p = Image.core.pipeline("RGB", (128, 128), "L", (64, 64),
+    ...                         Image.BILINEAR)
+    >>> p.push(im.im.crop((0, 0, 128, 64)))
+    >>> p.lines
+    64
+    >>> p.getimage()
+    Traceback (most recent call last):
+    ValueError: pipeline not complete
+    >>> p.push(im.im.crop((0, 64, 128, 128)))
+    >>> out = p.getimage()
+    >>> out.mode, out.size
+    ('L', (64, 64))
+    >>> c = out.copy()
+    >>> extrema = c.getextrema()
+    >>> p.push(im.im.crop((0, 0, 128, 64))) # ignored
+    >>> out.paste(0, (0, 0, 64, 64))
+    >>> out.getextrema(), c.getextrema() == extrema
+    ((0, 0), True)
+
+    Conversions to "1" and "P" use error diffusion by default, but
+    can also use ordered dithering, with a Bayer matrix (ORDERED is
+    8x8, BAYER4 is 4x4) or a blue noise matrix:
+
+    >>> im = Image.new("L", (8, 8), 128)
+    >>> list(im.convert("1").getdata())[:8]
+    [0, 255, 0, 255, 0, 255, 0, 255]
+    >>> list(im.convert("1", dither=Image.ORDERED).getdata())[:8]
+    [255, 0, 255, 0, 255, 0, 255, 0]
+    >>> im.convert("1", dither=Image.BAYER4).histogram()[255]
+    32
+    >>> im = Image.new("RGB", (32, 32), (64, 64, 64))
+    >>> im.convert("1", dither=Image.BLUENOISE).histogram()[255]
+    256
+    >>> im = Image.new("RGB", (32, 32), (128, 128, 128))
+    >>> im.convert("P", dither=Image.NONE).convert("RGB").getcolors()
+    [(1024, (153, 153, 153))]
+    >>> p = im.convert("P", dither=Image.ORDERED)
+    >>> sorted(p.convert("RGB").getcolors())
+    [(496, (102, 102, 102)), (528, (153, 153, 153))]
+    >>> p = im.convert("P", dither=Image.BLUENOISE)
+    >>> sorted(p.convert("RGB").getcolors())
+    [(492, (102, 102, 102)), (532, (153, 153, 153))]
+
+    Without dithering, each pixel gets the nearest palette entry; ties
+    go to the lowest entry:
+
+    >>> random.seed(4)
+    >>> colors = [random.randrange(0, 256, 32) for i in range(3*256)]
+    >>> pal = Image.new("P", (1, 1))
+    >>> pal.putpalette(colors)
+    >>> im = Image.new("RGB", (64, 64))
+    >>> im.putdata([tuple(random.randrange(256) for k in range(3))
+    ...             for i in range(64*64)])
+    >>> out = im._new(im.im.convert("P", Image.NONE, pal.im))
+    >>> def nearest(c):
+    ...     return min(range(256), key=lambda i: (
+    ...         (c[0]-colors[3*i])**2 + (c[1]-colors[3*i+1])**2 +
+    ...         (c[2]-colors[3*i+2])**2, i))
+    >>> [nearest(c) for c in im.getdata()] == list(out.getdata())
+    True
+
+    Operations can be traced.  Each record holds the operation name,
+    thread, start time, duration, pixels and bytes allocated:
+
+    >>> im = Image.new("RGB", (64, 32))
+    >>> Image.core.settrace(1)
+    0
+    >>> out = im.convert("L").resize((32, 16), Image.ANTIALIAS)
+    >>> [(r[0], r[4], r[5]) for r in Image.core.gettrace()]
+    [('convert', 2048, 2048), ('resample', 512, 0)]
+    >>> Image.core.gettrace()
+    []
+    >>> Image.core.settrace(0)
+    1
+    >>> out = im.convert("L")
+    >>> Image.core.gettrace()
+    []
+
     PIL can do many other things, but I'll leave that for another
     day.  If you're curious, check the handbook, available from:
 
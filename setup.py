@@ -60,16 +60,16 @@ IMAGING = [
 
 LIBIMAGING = [
     "Access", "Antialias", "Bands", "BitDecode", "Blend", "Chops",
-    "Convert", "ConvertYCbCr", "Copy", "Crc32", "Crop", "Dib", "Draw",
-    "Effects", "EpsEncode", "File", "Fill", "Filter", "FliDecode",
-    "Geometry", "GetBBox", "GifDecode", "GifEncode", "HexDecode",
-    "Histo", "JpegDecode", "JpegEncode", "LzwDecode", "Matrix",
-    "ModeFilter", "MspDecode", "Negative", "Offset", "Pack",
-    "PackDecode", "Palette", "Paste", "Quant", "QuantHash",
-    "QuantHeap", "PcdDecode", "PcxDecode", "PcxEncode", "Point",
-    "RankFilter", "RawDecode", "RawEncode", "Storage", "SunRleDecode",
-    "TgaRleDecode", "Unpack", "UnpackYCC", "UnsharpMask", "XbmDecode",
-    "XbmEncode", "ZipDecode", "ZipEncode"
+    "Convert", "ConvertYCbCr", "Copy", "Cpu", "Crc32", "Crop", "Dib",
+    "Dither", "Draw", "Effects", "EpsEncode", "File", "Fill", "Filter",
+    "FliDecode", "Geometry", "GetBBox", "GifDecode", "GifEncode",
+    "HexDecode", "Histo", "JpegDecode", "JpegEncode", "LzwDecode",
+    "Matrix", "Mode", "ModeFilter", "MspDecode", "Negative", "Offset", "Pack",
+    "PackDecode", "Palette", "Parallel", "Paste", "Quant", "QuantHash",
+    "QuantHeap", "PcdDecode", "PcxDecode", "PcxEncode", "Pipeline", "Point",
+    "Pool", "RankFilter", "RawDecode", "RawEncode", "Storage", "SunRleDecode",
+    "TgaRleDecode", "Trace", "Unpack", "UnpackYCC", "UnsharpMask",
+    "XbmDecode", "XbmEncode", "ZipDecode", "ZipEncode"
     ]
 
 # --------------------------------------------------------------------
@@ -299,6 +299,8 @@ class pil_build_ext(build_ext):
             defs.append(("HAVE_LIBZ", None))
         if sys.platform == "win32":
             libs.extend(["kernel32", "user32", "gdi32"])
+        else:
+            libs.append("pthread") # worker pool
         if struct.unpack("h", "\0\1")[0] == 1:
             defs.append(("WORDS_BIGENDIAN", None))
 